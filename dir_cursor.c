@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include "ff.h"
+#include "dir_index.h"
+#include "dir_cursor.h"
+
+static int Wanted(const DirCursor *cursor, const char *name, BYTE attrib)
+{
+    if(strcmp(name, DIR_INDEX_NAME) == 0) {
+        return 0;
+    } else if((name[0] == '.') && cursor->skipDotfiles) {
+        return 0;
+    } else if(attrib & AM_DIR) {
+        return 1;
+    } else if(cursor->suffix) {
+        size_t nameLength = strlen(name);
+        size_t suffixLength = strlen(cursor->suffix);
+        return (nameLength >= suffixLength) && (strcmp(cursor->suffix, name + nameLength - suffixLength) == 0);
+    }
+    return 1;
+}
+
+static int AddName(DirCursor *cursor, const char *name, BYTE attrib)
+{
+    char directory[FF_LFN_BUF + 2];
+
+    if(attrib & AM_DIR) {
+        snprintf(directory, sizeof(directory), "%s/", name);
+        name = directory;
+    }
+    return FilenameListAdd(&cursor->names, name);
+}
+
+typedef struct IndexedFill {
+    DirCursor *cursor;
+    int failed;
+} IndexedFill;
+
+static int AddIndexed(void *user, const DirIndexEntry *entry)
+{
+    IndexedFill *fill = (IndexedFill *)user;
+    if(Wanted(fill->cursor, entry->name, entry->attrib) && !AddName(fill->cursor, entry->name, entry->attrib)) {
+        fill->failed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static FRESULT Start(DirCursor *cursor)
+{
+    IndexedFill fill = { cursor, 0 };
+
+    FilenameListInit(&cursor->names);
+    cursor->open = 0;
+    cursor->complete = 0;
+    cursor->sorted = 0;
+
+    if(DirIndexForEach(cursor->path, AddIndexed, &fill)) {
+        cursor->complete = 1;
+        cursor->sorted = 1;
+        return fill.failed ? FR_NOT_ENOUGH_CORE : FR_OK;
+    }
+    FRESULT result = f_opendir(&cursor->dir, cursor->path);
+    cursor->open = (result == FR_OK);
+    return result;
+}
+
+static void Stop(DirCursor *cursor)
+{
+    if(cursor->open) {
+        f_closedir(&cursor->dir);
+        cursor->open = 0;
+    }
+    FilenameListFree(&cursor->names);
+}
+
+FRESULT DirCursorOpen(DirCursor *cursor, const char *dirName, const char *suffix, int skipDotfiles)
+{
+    size_t length = strlen(dirName);
+    if(length >= DIR_CURSOR_PATH_MAX) {
+        return FR_INVALID_NAME;
+    }
+    memcpy(cursor->path, dirName, length + 1);
+    while((length > 1) && (cursor->path[length - 1] == '/')) {
+        cursor->path[--length] = '\0';
+    }
+    cursor->suffix = suffix;
+    cursor->skipDotfiles = skipDotfiles;
+    return Start(cursor);
+}
+
+FRESULT DirCursorFetch(DirCursor *cursor, size_t wanted)
+{
+    FILINFO info;
+    size_t goal = cursor->names.count + wanted;
+
+    while(cursor->open && (cursor->names.count < goal)) {
+        FRESULT result = f_readdir(&cursor->dir, &info);
+        if(result != FR_OK) {
+            f_closedir(&cursor->dir);
+            cursor->open = 0;
+            return result;
+        }
+        if(info.fname[0] == '\0') {
+            f_closedir(&cursor->dir);
+            cursor->open = 0;
+            cursor->complete = 1;
+            break;
+        }
+        if(Wanted(cursor, info.fname, info.fattrib) && !AddName(cursor, info.fname, info.fattrib)) {
+            return FR_NOT_ENOUGH_CORE;
+        }
+    }
+    return FR_OK;
+}
+
+FRESULT DirCursorDescend(DirCursor *cursor, const char *name)
+{
+    size_t pathLength = strlen(cursor->path);
+    size_t nameLength = strlen(name);
+    while((nameLength > 0) && (name[nameLength - 1] == '/')) {
+        nameLength--;
+    }
+    int separator = (pathLength > 0) && (cursor->path[pathLength - 1] != '/');
+    if((nameLength == 0) || (pathLength + separator + nameLength >= DIR_CURSOR_PATH_MAX)) {
+        return FR_INVALID_NAME;
+    }
+
+    Stop(cursor);
+    if(separator) {
+        cursor->path[pathLength++] = '/';
+    }
+    memcpy(cursor->path + pathLength, name, nameLength);
+    cursor->path[pathLength + nameLength] = '\0';
+    return Start(cursor);
+}
+
+FRESULT DirCursorAscend(DirCursor *cursor)
+{
+    char *slash = strrchr(cursor->path, '/');
+    if((slash == NULL) || (slash[1] == '\0')) {
+        return FR_OK;                   /* Already at the root */
+    }
+
+    Stop(cursor);
+    if(slash == cursor->path) {
+        slash[1] = '\0';                /* "/games" to "/" */
+    } else {
+        slash[0] = '\0';                /* "0:/games" to "0:" */
+    }
+    return Start(cursor);
+}
+
+void DirCursorClose(DirCursor *cursor)
+{
+    Stop(cursor);
+    cursor->complete = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef __DIR_CURSOR_H__
+#define __DIR_CURSOR_H__
+
+#include "ff.h"
+#include "filename_list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+// A directory listing that's read a little at a time, so the launcher can
+// show the first screenful right away and read the rest between frames
+// while the user browses.  Names collect in cursor->names in directory
+// order; subdirectories are listed with a '/' on the end and can be
+// descended into.  If the directory has an index (dir_index.c), the whole
+// list, sorted, is there as soon as it's opened.
+//
+// The DIR stays open between DirCursorFetch calls, so a cursor holds one
+// of FatFs's FF_FS_LOCK slots until it's complete or closed.
+
+#define DIR_CURSOR_PATH_MAX 256
+
+typedef struct DirCursor {
+    char path[DIR_CURSOR_PATH_MAX];     /* Directory being listed */
+    const char *suffix;                 /* Files must end with this, if not NULL */
+    int skipDotfiles;
+    DIR dir;
+    int open;                           /* dir is open */
+    int complete;                       /* Every entry is in names */
+    int sorted;                         /* names came sorted from an index */
+    FilenameList names;
+} DirCursor;
+
+// Start listing dirName.  suffix and skipDotfiles filter files, not
+// subdirectories; suffix must stay valid until the cursor is closed.
+FRESULT DirCursorOpen(DirCursor *cursor, const char *dirName, const char *suffix, int skipDotfiles);
+
+// Read until there are at least wanted more names, or the directory ends.
+FRESULT DirCursorFetch(DirCursor *cursor, size_t wanted);
+
+// Start over listing subdirectory name ("games" or "games/") of the
+// current directory, or the parent of the current directory.
+FRESULT DirCursorDescend(DirCursor *cursor, const char *name);
+FRESULT DirCursorAscend(DirCursor *cursor);
+
+void DirCursorClose(DirCursor *cursor);
+
+#ifdef __cplusplus
+};
+#endif /* __cplusplus */
+
+#endif /* __DIR_CURSOR_H__ */
@@ -0,0 +1,606 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "ff.h"
+#include "diskio.h"
+#include "pico/time.h"
+#include "dir_index.h"
+
+/*--------------------------------------------------------------------------*/
+/* Directory indexes -------------------------------------------------------*/
+
+// Each directory's index is a file in DIR_INDEX_NAME at the root of its
+// volume, named for a hash of the directory's path.  Keeping them out of
+// the directories themselves matters: a new file lands at the end of a
+// directory, so opening an index kept in a directory of hundreds of
+// games would search the whole directory, which is what the index is
+// there to avoid.
+//
+// The index file is little-endian:
+//
+//     header      magic "RIX" 2, entry count, signature, path bytes,
+//                 name bytes, fingerprint, end sector
+//     path        the directory, NUL-terminated, to catch hash collisions
+//     entries     name offset, size, suffix class, attributes + 3 pad
+//     names       NUL-terminated, in the same order as the entries
+//
+// Entries are sorted by name ignoring case, the way the launcher shows
+// them.  The signature is FNV-1a over the name, size, date, time, and
+// attributes of every directory entry in f_readdir order.  Checking it
+// means reading the whole directory, so that's done in the background and
+// at most every DIR_INDEX_RECHECK_MS per directory.  The fingerprint is
+// FNV-1a over the raw sectors of the directory's first cluster and of the
+// end sector, the one holding the entry after the last, which takes a
+// read or two and is checked before every use.  A file added anywhere or
+// removed from the end changes it, and so does anything that rebuilt the
+// directory, like a PC's defragmenter or a fresh copy; a file deleted
+// from the middle waits for the background check.
+
+#define DIR_INDEX_MAGIC 0x02584952     /* "RIX" 2 */
+
+enum {
+    DIR_INDEX_HEADER_SIZE = 28,
+    DIR_INDEX_ENTRY_SIZE = 16,
+    DIR_INDEX_MAX_ENTRIES = 1024,       /* Larger directories aren't indexed */
+    DIR_INDEX_MAX_FILE_SIZE = 64 * 1024,
+    DIR_INDEX_PATH_MAX = 256,
+    DIR_INDEX_FILE_PATH_MAX = 32,       /* "0:/.roindex/XXXXXXXX.IDX" */
+    DIR_INDEX_ENTRIES_PER_POLL = 8,     /* f_readdir calls per DirIndexPoll */
+    DIR_INDEX_RECORDS_PER_POLL = FF_MAX_SS / DIR_INDEX_ENTRY_SIZE,
+    DIR_INDEX_NAME_BYTES_PER_POLL = FF_MAX_SS,  /* Roughly; names aren't split */
+    DIR_INDEX_FINGERPRINT_SECTORS = 8,  /* At most, if clusters are larger */
+    DIR_INDEX_RECENT_SLOTS = 8,         /* Directories remembered as checked */
+    DIR_INDEX_RECHECK_MS = 60 * 1000,
+};
+
+static const uint32_t FNV_OFFSET_BASIS = 2166136261u;
+static const uint32_t FNV_PRIME = 16777619u;
+
+static uint32_t Hash(uint32_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+    for(size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+uint32_t DirIndexSuffixClass(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    if(dot == NULL) {
+        return 0;
+    }
+    uint32_t hash = Hash(FNV_OFFSET_BASIS, dot + 1, strlen(dot + 1));
+    return (hash == 0) ? 1 : hash;
+}
+
+static uint32_t Get32(const BYTE *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void Put32(BYTE *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+// "0:/coleco/" and "0:/coleco" are the same directory, and so are "0:/"
+// and "0:".
+static int NormalizePath(char *normalized, const char *dirName)
+{
+    size_t length = strlen(dirName);
+    if(length >= DIR_INDEX_PATH_MAX) {
+        return 0;
+    }
+    memcpy(normalized, dirName, length + 1);
+    while((length > 1) && (normalized[length - 1] == '/')) {
+        normalized[--length] = '\0';
+    }
+    return 1;
+}
+
+// FAT names are case-insensitive, so the hash is too.
+static uint32_t PathHash(const char *dirName)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for(const char *p = dirName; *p; p++) {
+        unsigned char c = (*p >= 'A' && *p <= 'Z') ? (*p - 'A' + 'a') : *p;
+        hash = Hash(hash, &c, 1);
+    }
+    return hash;
+}
+
+static void MakeIndexPath(char *path, const char *dirName)
+{
+    const char *colon = strchr(dirName, ':');
+    int driveLength = colon ? (colon - dirName + 1) : 0;
+    snprintf(path, DIR_INDEX_FILE_PATH_MAX, "%.*s/" DIR_INDEX_NAME "/%08lX.IDX", driveLength, dirName, (unsigned long)PathHash(dirName));
+}
+
+// Hash the directory's first cluster as it is on the card, or the start
+// of a FAT12/16 root directory, and endSector if that's elsewhere and not
+// 0.  Returns 0 if they couldn't be read.
+static int Fingerprint(const char *dirName, uint32_t endSector, uint32_t *fingerprint)
+{
+    DIR dir;
+
+    if(f_opendir(&dir, dirName) != FR_OK) {
+        return 0;
+    }
+    FATFS *fs = dir.obj.fs;
+    DWORD cluster = dir.obj.sclust;
+    f_closedir(&dir);
+
+    LBA_t sector;
+    UINT count;
+    if((cluster == 0) && (fs->fs_type < FS_FAT32)) {
+        sector = fs->dirbase;
+        count = fs->n_rootdir / (FF_MAX_SS / 32);
+    } else {
+        if(cluster == 0) {
+            cluster = fs->dirbase;      /* FAT32 and exFAT root */
+        }
+        sector = fs->database + (LBA_t)fs->csize * (cluster - 2);
+        count = fs->csize;
+    }
+    if(count > DIR_INDEX_FINGERPRINT_SECTORS) {
+        count = DIR_INDEX_FINGERPRINT_SECTORS;
+    }
+
+    BYTE *sectors = malloc(count * FF_MAX_SS);
+    if(sectors == NULL) {
+        return 0;
+    }
+    int success = (disk_read(fs->pdrv, sectors, sector, count) == RES_OK);
+    uint32_t hash = Hash(FNV_OFFSET_BASIS, sectors, count * FF_MAX_SS);
+    if(success && (endSector != 0) && ((endSector < sector) || (endSector >= sector + count))) {
+        success = (disk_read(fs->pdrv, sectors, endSector, 1) == RES_OK);
+        hash = Hash(hash, sectors, FF_MAX_SS);
+    }
+    if(success) {
+        *fingerprint = hash;
+    }
+    free(sectors);
+    return success;
+}
+
+// Directories whose index was checked against every entry lately.
+static struct {
+    uint32_t pathHash;
+    uint64_t checked;                   /* time_us_64(), 0 if unused */
+} gDirIndexRecent[DIR_INDEX_RECENT_SLOTS];
+
+static int CheckedRecently(const char *dirName)
+{
+    uint32_t pathHash = PathHash(dirName);
+    uint64_t now = time_us_64();
+    for(int i = 0; i < DIR_INDEX_RECENT_SLOTS; i++) {
+        if((gDirIndexRecent[i].checked != 0) && (gDirIndexRecent[i].pathHash == pathHash)) {
+            return now - gDirIndexRecent[i].checked < (uint64_t)DIR_INDEX_RECHECK_MS * 1000;
+        }
+    }
+    return 0;
+}
+
+static void MarkChecked(const char *dirName)
+{
+    uint32_t pathHash = PathHash(dirName);
+    int slot = 0;
+    for(int i = 0; i < DIR_INDEX_RECENT_SLOTS; i++) {
+        if((gDirIndexRecent[i].checked != 0) && (gDirIndexRecent[i].pathHash == pathHash)) {
+            slot = i;
+            break;
+        }
+        if(gDirIndexRecent[i].checked < gDirIndexRecent[slot].checked) {
+            slot = i;
+        }
+    }
+    gDirIndexRecent[slot].pathHash = pathHash;
+    gDirIndexRecent[slot].checked = time_us_64() | 1;
+}
+
+// Read and sanity-check dirName's index.  Caller frees the result.
+static BYTE *LoadIndex(const char *dirName, uint32_t *count, uint32_t *signature, uint32_t *fingerprint, uint32_t *endSector)
+{
+    char path[DIR_INDEX_FILE_PATH_MAX];
+    FIL file;
+    UINT got;
+
+    MakeIndexPath(path, dirName);
+    if(f_open(&file, path, FA_READ) != FR_OK) {
+        return NULL;
+    }
+    FSIZE_t size = f_size(&file);
+    BYTE *index = NULL;
+    if((size >= DIR_INDEX_HEADER_SIZE) && (size <= DIR_INDEX_MAX_FILE_SIZE)) {
+        index = malloc(size);
+    }
+    if((index == NULL) || (f_read(&file, index, size, &got) != FR_OK) || (got != size)) {
+        f_close(&file);
+        free(index);
+        return NULL;
+    }
+    f_close(&file);
+
+    uint32_t entries = Get32(index + 4);
+    uint32_t pathBytes = Get32(index + 12);
+    uint32_t nameBytes = Get32(index + 16);
+    const BYTE *names = index + DIR_INDEX_HEADER_SIZE + pathBytes + entries * DIR_INDEX_ENTRY_SIZE;
+    int valid = (Get32(index) == DIR_INDEX_MAGIC) && (entries <= DIR_INDEX_MAX_ENTRIES) &&
+        (pathBytes <= DIR_INDEX_PATH_MAX) && (nameBytes <= DIR_INDEX_MAX_FILE_SIZE) &&
+        (size == DIR_INDEX_HEADER_SIZE + pathBytes + entries * DIR_INDEX_ENTRY_SIZE + nameBytes) &&
+        (pathBytes == strlen(dirName) + 1) &&
+        (strncasecmp((const char *)index + DIR_INDEX_HEADER_SIZE, dirName, pathBytes) == 0) &&
+        ((entries == 0) || ((nameBytes > 0) && (names[nameBytes - 1] == '\0')));
+    for(uint32_t i = 0; valid && (i < entries); i++) {
+        valid = Get32(index + DIR_INDEX_HEADER_SIZE + pathBytes + i * DIR_INDEX_ENTRY_SIZE) < nameBytes;
+    }
+    if(!valid) {
+        free(index);
+        return NULL;
+    }
+    *count = entries;
+    *signature = Get32(index + 8);
+    *fingerprint = Get32(index + 20);
+    *endSector = Get32(index + 24);
+    return index;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Background check and rebuild --------------------------------------------*/
+
+typedef struct IndexedName {
+    uint32_t nameOffset;
+    uint32_t size;
+    BYTE attrib;
+} IndexedName;
+
+// One directory is checked at a time, holding its DIR open between polls
+// and then, if the index needs rewriting, its index file.  A directory
+// visited meanwhile waits in gDirIndexPending; only the most recent one is
+// kept.
+enum {
+    JOB_READING,                        /* DIR_INDEX_ENTRIES_PER_POLL entries */
+    JOB_WRITING_HEADER,                 /* Sort, create the file, header, path */
+    JOB_WRITING_RECORDS,                /* DIR_INDEX_RECORDS_PER_POLL records */
+    JOB_WRITING_NAMES,                  /* DIR_INDEX_NAME_BYTES_PER_POLL */
+};
+
+static struct {
+    int busy;
+    int phase;
+    char path[DIR_INDEX_PATH_MAX];
+    DIR dir;
+    FIL file;
+    int fileOpen;
+    uint32_t fingerprint;
+    size_t next;                        /* Next record or name to write */
+    uint32_t nameOffset;                /* Of the next record's name */
+    int haveIndex;
+    uint32_t indexSignature;
+    uint32_t indexFingerprint;
+    uint32_t signature;
+    uint32_t endSector;                 /* Where the entry after the last is */
+    IndexedName *entries;
+    size_t count, capacity;
+    char *names;
+    size_t nameBytes, nameCapacity;
+} gDirIndexJob;
+
+static char gDirIndexPending[DIR_INDEX_PATH_MAX];
+
+static const char *gSortNames;
+
+static int CompareNames(const void *a, const void *b)
+{
+    return strcasecmp(gSortNames + ((const IndexedName *)a)->nameOffset, gSortNames + ((const IndexedName *)b)->nameOffset);
+}
+
+static void FinishJob(void)
+{
+    f_closedir(&gDirIndexJob.dir);
+    if(gDirIndexJob.fileOpen) {
+        f_close(&gDirIndexJob.file);
+        gDirIndexJob.fileOpen = 0;
+    }
+    free(gDirIndexJob.entries);
+    free(gDirIndexJob.names);
+    gDirIndexJob.entries = NULL;
+    gDirIndexJob.names = NULL;
+    gDirIndexJob.busy = 0;
+}
+
+// haveIndex, indexSignature, and indexFingerprint describe the index the
+// caller just read.
+static void StartJob(const char *dirName, int haveIndex, uint32_t indexSignature, uint32_t indexFingerprint)
+{
+    strcpy(gDirIndexJob.path, dirName);
+    if(f_opendir(&gDirIndexJob.dir, dirName) != FR_OK) {
+        return;
+    }
+    gDirIndexJob.haveIndex = haveIndex;
+    gDirIndexJob.indexSignature = indexSignature;
+    gDirIndexJob.indexFingerprint = indexFingerprint;
+    gDirIndexJob.signature = FNV_OFFSET_BASIS;
+    gDirIndexJob.endSector = 0;
+    gDirIndexJob.count = 0;
+    gDirIndexJob.capacity = 0;
+    gDirIndexJob.nameBytes = 0;
+    gDirIndexJob.nameCapacity = 0;
+    gDirIndexJob.phase = JOB_READING;
+    gDirIndexJob.busy = 1;
+}
+
+static void QueueJob(const char *dirName, int haveIndex, uint32_t indexSignature, uint32_t indexFingerprint)
+{
+    if(!gDirIndexJob.busy) {
+        StartJob(dirName, haveIndex, indexSignature, indexFingerprint);
+    } else if(strcmp(gDirIndexJob.path, dirName) != 0) {
+        strcpy(gDirIndexPending, dirName);
+    }
+}
+
+static int AddEntry(const FILINFO *info)
+{
+    size_t length = strlen(info->fname) + 1;
+
+    if(gDirIndexJob.count == gDirIndexJob.capacity) {
+        if(gDirIndexJob.count == DIR_INDEX_MAX_ENTRIES) {
+            return 0;
+        }
+        size_t capacity = gDirIndexJob.capacity ? gDirIndexJob.capacity * 2 : 32;
+        IndexedName *entries = realloc(gDirIndexJob.entries, capacity * sizeof(IndexedName));
+        if(entries == NULL) {
+            return 0;
+        }
+        gDirIndexJob.entries = entries;
+        gDirIndexJob.capacity = capacity;
+    }
+    if(gDirIndexJob.nameBytes + length > gDirIndexJob.nameCapacity) {
+        size_t capacity = gDirIndexJob.nameCapacity ? gDirIndexJob.nameCapacity * 2 : 1024;
+        char *names = realloc(gDirIndexJob.names, capacity);
+        if(names == NULL) {
+            return 0;
+        }
+        gDirIndexJob.names = names;
+        gDirIndexJob.nameCapacity = capacity;
+    }
+
+    IndexedName *entry = &gDirIndexJob.entries[gDirIndexJob.count++];
+    entry->nameOffset = gDirIndexJob.nameBytes;
+    entry->size = info->fsize;
+    entry->attrib = info->fattrib;
+    memcpy(gDirIndexJob.names + gDirIndexJob.nameBytes, info->fname, length);
+    gDirIndexJob.nameBytes += length;
+    return 1;
+}
+
+// Make the index directory the first time.  In the root, that has to
+// happen before the fingerprint is taken.  The volume may be read-only,
+// or full; then there's just no index.
+static int MakeIndexDirectory(const char *dirName)
+{
+    char path[DIR_INDEX_FILE_PATH_MAX];
+
+    MakeIndexPath(path, dirName);
+    *strrchr(path, '/') = '\0';
+    FRESULT result = f_mkdir(path);
+    return (result == FR_OK) || (result == FR_EXIST);
+}
+
+// Sort the entries, create the index file, and write its header and path.
+static FRESULT WriteHeader(void)
+{
+    char path[DIR_INDEX_FILE_PATH_MAX];
+    BYTE header[DIR_INDEX_HEADER_SIZE];
+    UINT wrote;
+
+    gSortNames = gDirIndexJob.names;
+    qsort(gDirIndexJob.entries, gDirIndexJob.count, sizeof(IndexedName), CompareNames);
+
+    MakeIndexPath(path, gDirIndexJob.path);
+    FRESULT result = f_open(&gDirIndexJob.file, path, FA_WRITE | FA_CREATE_ALWAYS);
+    if(result != FR_OK) {
+        return result;
+    }
+    gDirIndexJob.fileOpen = 1;
+
+    uint32_t pathBytes = strlen(gDirIndexJob.path) + 1;
+    Put32(header, DIR_INDEX_MAGIC);
+    Put32(header + 4, gDirIndexJob.count);
+    Put32(header + 8, gDirIndexJob.signature);
+    Put32(header + 12, pathBytes);
+    Put32(header + 16, gDirIndexJob.nameBytes);
+    Put32(header + 20, gDirIndexJob.fingerprint);
+    Put32(header + 24, gDirIndexJob.endSector);
+    result = f_write(&gDirIndexJob.file, header, sizeof(header), &wrote);
+    if(result == FR_OK) {
+        result = f_write(&gDirIndexJob.file, gDirIndexJob.path, pathBytes, &wrote);
+    }
+    gDirIndexJob.next = 0;
+    gDirIndexJob.nameOffset = 0;
+    return result;
+}
+
+// Names are written in sorted order, so their offsets are recomputed.
+static FRESULT WriteRecords(void)
+{
+    BYTE record[DIR_INDEX_ENTRY_SIZE];
+    UINT wrote;
+    FRESULT result = FR_OK;
+
+    memset(record, 0, sizeof(record));
+    for(int i = 0; (result == FR_OK) && (i < DIR_INDEX_RECORDS_PER_POLL) && (gDirIndexJob.next < gDirIndexJob.count); i++) {
+        const IndexedName *entry = &gDirIndexJob.entries[gDirIndexJob.next++];
+        const char *name = gDirIndexJob.names + entry->nameOffset;
+        Put32(record, gDirIndexJob.nameOffset);
+        Put32(record + 4, entry->size);
+        Put32(record + 8, DirIndexSuffixClass(name));
+        record[12] = entry->attrib;
+        result = f_write(&gDirIndexJob.file, record, sizeof(record), &wrote);
+        gDirIndexJob.nameOffset += strlen(name) + 1;
+    }
+    return result;
+}
+
+static FRESULT WriteNames(void)
+{
+    UINT wrote;
+    FRESULT result = FR_OK;
+
+    for(size_t bytes = 0; (result == FR_OK) && (bytes < DIR_INDEX_NAME_BYTES_PER_POLL) && (gDirIndexJob.next < gDirIndexJob.count); ) {
+        const char *name = gDirIndexJob.names + gDirIndexJob.entries[gDirIndexJob.next++].nameOffset;
+        result = f_write(&gDirIndexJob.file, name, strlen(name) + 1, &wrote);
+        bytes += strlen(name) + 1;
+    }
+    return result;
+}
+
+// Write the next piece of the index, a sector or so, so that no one poll
+// holds up the caller for long.  A failed index is removed.
+static void WriteIndexStep(void)
+{
+    FRESULT result;
+
+    switch(gDirIndexJob.phase) {
+        case JOB_WRITING_HEADER:
+            result = WriteHeader();
+            if(!gDirIndexJob.fileOpen) {
+                FinishJob();            /* Read-only or full, say */
+                return;
+            }
+            gDirIndexJob.phase = JOB_WRITING_RECORDS;
+            break;
+        case JOB_WRITING_RECORDS:
+            result = WriteRecords();
+            if(gDirIndexJob.next == gDirIndexJob.count) {
+                gDirIndexJob.next = 0;
+                gDirIndexJob.phase = JOB_WRITING_NAMES;
+            }
+            break;
+        default:
+            result = WriteNames();
+            if((result == FR_OK) && (gDirIndexJob.next == gDirIndexJob.count)) {
+                gDirIndexJob.fileOpen = 0;
+                result = f_close(&gDirIndexJob.file);
+                if(result == FR_OK) {
+                    FinishJob();
+                    return;
+                }
+            }
+            break;
+    }
+    if(result != FR_OK) {
+        char path[DIR_INDEX_FILE_PATH_MAX];
+        MakeIndexPath(path, gDirIndexJob.path);
+        printf("DirIndex: couldn't write %s\n", path);
+        FinishJob();
+        f_unlink(path);
+    }
+}
+
+int DirIndexPoll(void)
+{
+    if(!gDirIndexJob.busy) {
+        if(gDirIndexPending[0] == '\0') {
+            return 0;
+        }
+        char dirName[DIR_INDEX_PATH_MAX];
+        uint32_t count, signature, fingerprint, endSector;
+        strcpy(dirName, gDirIndexPending);
+        gDirIndexPending[0] = '\0';
+        BYTE *index = LoadIndex(dirName, &count, &signature, &fingerprint, &endSector);
+        StartJob(dirName, index != NULL, signature, fingerprint);
+        free(index);
+        return 1;
+    }
+
+    if(gDirIndexJob.phase != JOB_READING) {
+        WriteIndexStep();
+        return 1;
+    }
+
+    for(int i = 0; i < DIR_INDEX_ENTRIES_PER_POLL; i++) {
+        FILINFO info;
+        if(gDirIndexJob.dir.sect != 0) {
+            gDirIndexJob.endSector = gDirIndexJob.dir.sect;
+        }
+        if(f_readdir(&gDirIndexJob.dir, &info) != FR_OK) {
+            FinishJob();
+            return 1;
+        }
+        if(info.fname[0] == '\0') {
+            // The index is written over the following polls.
+            f_closedir(&gDirIndexJob.dir);
+            MarkChecked(gDirIndexJob.path);
+            if(MakeIndexDirectory(gDirIndexJob.path) &&
+                Fingerprint(gDirIndexJob.path, gDirIndexJob.endSector, &gDirIndexJob.fingerprint) &&
+                (!gDirIndexJob.haveIndex || (gDirIndexJob.signature != gDirIndexJob.indexSignature) ||
+                (gDirIndexJob.fingerprint != gDirIndexJob.indexFingerprint))) {
+                gDirIndexJob.phase = JOB_WRITING_HEADER;
+            } else {
+                FinishJob();
+            }
+            return 1;
+        }
+        // Making the index directory in the root mustn't make the root's
+        // index stale.
+        if(strcmp(info.fname, DIR_INDEX_NAME) == 0) {
+            continue;
+        }
+        uint32_t hash = Hash(gDirIndexJob.signature, info.fname, strlen(info.fname) + 1);
+        uint32_t size = info.fsize;
+        hash = Hash(hash, &size, sizeof(size));
+        hash = Hash(hash, &info.fdate, sizeof(info.fdate));
+        hash = Hash(hash, &info.ftime, sizeof(info.ftime));
+        gDirIndexJob.signature = Hash(hash, &info.fattrib, sizeof(info.fattrib));
+        if(!AddEntry(&info)) {
+            FinishJob();        /* Too big to index */
+            return 1;
+        }
+    }
+    return 1;
+}
+
+int DirIndexForEach(const char *dirName, DirIndexVisitor visitor, void *user)
+{
+    char normalized[DIR_INDEX_PATH_MAX];
+    uint32_t count, signature, indexFingerprint, endSector, fingerprint;
+
+    if(!NormalizePath(normalized, dirName)) {
+        return 0;
+    }
+    BYTE *index = LoadIndex(normalized, &count, &signature, &indexFingerprint, &endSector);
+    if((index != NULL) && (!Fingerprint(normalized, endSector, &fingerprint) || (fingerprint != indexFingerprint))) {
+        free(index);                    /* Stale */
+        index = NULL;
+    }
+    if(index == NULL) {
+        QueueJob(normalized, 0, 0, 0);
+        return 0;
+    }
+    if(!CheckedRecently(normalized)) {
+        QueueJob(normalized, 1, signature, indexFingerprint);
+    }
+
+    const BYTE *records = index + DIR_INDEX_HEADER_SIZE + Get32(index + 12);
+    const char *names = (const char *)records + count * DIR_INDEX_ENTRY_SIZE;
+    for(uint32_t i = 0; i < count; i++) {
+        const BYTE *record = records + i * DIR_INDEX_ENTRY_SIZE;
+        DirIndexEntry entry;
+        entry.name = names + Get32(record);
+        entry.size = Get32(record + 4);
+        entry.suffix = Get32(record + 8);
+        entry.attrib = record[12];
+        if(!visitor(user, &entry)) {
+            break;
+        }
+    }
+    free(index);
+    return 1;
+}
@@ -0,0 +1,51 @@
+#ifndef __DIR_INDEX_H__
+#define __DIR_INDEX_H__
+
+#include <stdint.h>
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+// A directory's entries sorted by name, kept in a file under DIR_INDEX_NAME
+// at the root of the volume, so listing a large directory is one small
+// file read instead of an f_readdir walk.  FAT doesn't update a
+// directory's timestamp when its entries change, so an index is only used
+// if a fingerprint of the directory's first cluster still matches, and
+// using it queues a background check (DirIndexPoll) that re-reads the
+// directory a few entries at a time, compares a signature over every
+// entry, and rewrites the index if the directory changed.  A directory
+// checked in the last DIR_INDEX_RECHECK_MS isn't checked again.
+
+#define DIR_INDEX_NAME ".roindex"
+
+typedef struct DirIndexEntry {
+    const char *name;
+    uint32_t size;
+    uint32_t suffix;                    /* DirIndexSuffixClass(name) */
+    BYTE attrib;                        /* AM_DIR etc. */
+} DirIndexEntry;
+
+// Return 0 to stop early.
+typedef int (*DirIndexVisitor)(void *user, const DirIndexEntry *entry);
+
+// Call visitor for each entry of dirName's index in name order.  The
+// index doesn't list DIR_INDEX_NAME itself.  Returns
+// 1 if there was a current index, 0 if not, in which case the caller has
+// to read the directory itself and the index is queued to be built.
+int DirIndexForEach(const char *dirName, DirIndexVisitor visitor, void *user);
+
+// Do a little of the queued check or rebuild.  Called from
+// RoDoHousekeeping.  Returns 1 while there is more to do.
+int DirIndexPoll(void);
+
+// Hash of the text after the last '.' in name, 0 if there is no '.'.
+// Names ending in the same ".suffix" have the same class.
+uint32_t DirIndexSuffixClass(const char *name);
+
+#ifdef __cplusplus
+};
+#endif /* __cplusplus */
+
+#endif /* __DIR_INDEX_H__ */
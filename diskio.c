@@ -7,12 +7,28 @@
 /* storage control modules to the FatFs module with a defined API.       */
 /*-----------------------------------------------------------------------*/
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "ff.h"
 #include "diskio.h"
 #include "sd_spi.h"
+#include "sd_queue.h"
 #include "hardware/spi.h"
+#include "pico/time.h"
+#include "pico/sync.h"
+
+// Set to 0 where there is no XIP flash, as in the host build.
+#ifndef DISKIO_FLASH_VOLUME
+#define DISKIO_FLASH_VOLUME 1
+#endif
+
+#if DISKIO_FLASH_VOLUME
+#include "hardware/regs/addressmap.h"
+#endif
 
 enum DebugLevels {
     DEBUG_SILENT = 0,
@@ -25,17 +41,1047 @@ enum DebugLevels {
 };
 extern void logprintf(int level, char *fmt, ...);
 
-static spi_inst_t *gSPI;
-
+// All card access goes through the SD request queue, so disk_read and
+// disk_write are blocking wrappers around asynchronous requests that core 1
+// (or the calling core, if core 1 is busy or not yet running) services.
 void set_ff_spi_inst(spi_inst_t *spi_)
 {
-    gSPI = spi_;
+    SDCARD_queue_init(spi_);
 }
 
 /* Definitions of physical drive number for each drive */
-#define DEV_RAM		0	/* Example: Map Ramdisk to physical drive 0 */
-#define DEV_MMC		1	/* Example: Map MMC/SD card to physical drive 1 */
-#define DEV_USB		2	/* Example: Map USB MSD to physical drive 2 */
+#define DEV_MMC		0	/* SD card, "0:" */
+#define DEV_RAM		1	/* RAM disk, "1:" */
+#define DEV_FLASH	2	/* read-only volume in XIP flash, "2:" */
+#define DISKIO_DRIVES	3
+
+// FatFs locks each volume, but disk_stream_write and the disk_cache_*
+// calls come from outside FatFs and may be on the other core, so every
+// entry point that touches the sector cache, the read-ahead ring, or the
+// telemetry holds gDiskLock.  The SD request queue has its own locks.
+auto_init_mutex(gDiskLock);
+
+
+/*-----------------------------------------------------------------------*/
+/* Telemetry                                                             */
+/*-----------------------------------------------------------------------*/
+
+// Per-drive counts and latency histograms of disk_read and disk_write,
+// plus, for the SD card, sd_spi.c's own counters, all read through
+// disk_ioctl(DISK_GET_TELEMETRY).
+
+// A card transfer that fails (usually a CRC error) is tried this many
+// more times before FatFs sees RES_ERROR.
+#ifndef DISKIO_CARD_RETRIES
+#define DISKIO_CARD_RETRIES 1
+#endif
+
+static DiskTelemetry gDiskTelemetry[DISKIO_DRIVES];
+
+static void DiskTelemetryRecord(BYTE pdrv, int write, UINT count, uint64_t micros, DRESULT result)
+{
+    DiskTelemetry *telemetry = &gDiskTelemetry[pdrv];
+
+    int bucket = 0;
+    while((bucket < DISK_LATENCY_BUCKETS - 1) && (micros >= (32ULL << bucket)))
+        bucket++;
+
+    if(write) {
+        telemetry->writes++;
+        telemetry->sectors_written += count;
+        telemetry->write_latency[bucket]++;
+    } else {
+        telemetry->reads++;
+        telemetry->sectors_read += count;
+        telemetry->read_latency[bucket]++;
+    }
+    if(result != RES_OK)
+        telemetry->errors++;
+}
+
+static DRESULT DiskTelemetryIoctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+    if(pdrv >= DISKIO_DRIVES)
+        return RES_PARERR;
+
+    if(cmd == DISK_RESET_TELEMETRY) {
+        memset(&gDiskTelemetry[pdrv], 0, sizeof(gDiskTelemetry[pdrv]));
+        if(pdrv == DEV_MMC)
+            SDCARD_reset_telemetry();
+        return RES_OK;
+    }
+
+    DiskTelemetry *telemetry = buff;
+    *telemetry = gDiskTelemetry[pdrv];
+    if(pdrv == DEV_MMC) {
+        SDCardTelemetry card;
+        SDCARD_get_telemetry(&card);
+        telemetry->commands = card.commands;
+        telemetry->card_sectors_read = card.sectors_read;
+        telemetry->card_sectors_written = card.sectors_written;
+        telemetry->crc_failures = card.crc_failures;
+        telemetry->timeouts = card.timeouts;
+        telemetry->token_wait_us = card.token_wait_us;
+        telemetry->data_us = card.data_us;
+        telemetry->busy_wait_us = card.busy_wait_us;
+    }
+    return RES_OK;
+}
+
+static void DiskPrintLatency(const char *what, const DWORD *buckets)
+{
+    printf("  %s latency:", what);
+    for(int i = 0; i < DISK_LATENCY_BUCKETS; i++) {
+        if(buckets[i] == 0)
+            continue;
+        if(i < DISK_LATENCY_BUCKETS - 1)
+            printf(" <%luus:%lu", 32UL << i, (unsigned long)buckets[i]);
+        else
+            printf(" >=%luus:%lu", 32UL << (i - 1), (unsigned long)buckets[i]);
+    }
+    printf("\n");
+}
+
+// Print telemetry for every drive that has been used.
+void disk_print_telemetry(void)
+{
+    DiskTelemetry telemetry;
+
+    for(BYTE pdrv = 0; pdrv < DISKIO_DRIVES; pdrv++) {
+        if((disk_ioctl(pdrv, DISK_GET_TELEMETRY, &telemetry) != RES_OK) ||
+            (telemetry.reads + telemetry.writes + telemetry.commands == 0))
+            continue;
+
+        printf("drive %d: %lu reads (%lu sectors), %lu writes (%lu sectors), %lu errors, %lu retries\n", pdrv,
+            (unsigned long)telemetry.reads, (unsigned long)telemetry.sectors_read,
+            (unsigned long)telemetry.writes, (unsigned long)telemetry.sectors_written,
+            (unsigned long)telemetry.errors, (unsigned long)telemetry.retries);
+        if(pdrv == DEV_MMC) {
+            printf("  card: %lu commands, %lu sectors read, %lu written, %lu CRC failures, %lu timeouts\n",
+                (unsigned long)telemetry.commands, (unsigned long)telemetry.card_sectors_read,
+                (unsigned long)telemetry.card_sectors_written, (unsigned long)telemetry.crc_failures,
+                (unsigned long)telemetry.timeouts);
+            printf("  card time: %lu.%03lu ms token wait, %lu.%03lu ms data, %lu.%03lu ms busy\n",
+                (unsigned long)(telemetry.token_wait_us / 1000), (unsigned long)(telemetry.token_wait_us % 1000),
+                (unsigned long)(telemetry.data_us / 1000), (unsigned long)(telemetry.data_us % 1000),
+                (unsigned long)(telemetry.busy_wait_us / 1000), (unsigned long)(telemetry.busy_wait_us % 1000));
+        }
+        if(telemetry.reads)
+            DiskPrintLatency("read", telemetry.read_latency);
+        if(telemetry.writes)
+            DiskPrintLatency("write", telemetry.write_latency);
+    }
+}
+
+void disk_reset_telemetry(void)
+{
+    for(BYTE pdrv = 0; pdrv < DISKIO_DRIVES; pdrv++)
+        disk_ioctl(pdrv, DISK_RESET_TELEMETRY, NULL);
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Sector cache                                                          */
+/*-----------------------------------------------------------------------*/
+
+// Single-sector reads and writes (FAT, directory, and the FatFs window)
+// go through a small LRU cache so cluster chain walks and directory scans
+// don't keep re-reading the same sectors.  Multiple-sector transfers go
+// straight to the card, but update any cached copies they overlap.
+//
+// In write-back mode single-sector writes only dirty the cached copy.
+// Dirty sectors go to the card, sorted and merged into multiple-block
+// writes of adjacent sectors, on CTRL_SYNC (f_sync, f_close, f_unmount),
+// when DISKIO_WRITEBACK_MAX_DIRTY are waiting, when a dirty sector has to
+// be evicted, or from disk_cache_poll once the oldest has waited
+// DISKIO_WRITEBACK_MAX_AGE_MS.
+
+#ifndef DISKIO_CACHE_SECTORS
+#define DISKIO_CACHE_SECTORS 16 /* SRAM budget is DISKIO_CACHE_SECTORS * FF_MAX_SS */
+#endif
+
+// At most this many cached sectors are exempt from eviction.
+#ifndef DISKIO_CACHE_PINNED_MAX
+#define DISKIO_CACHE_PINNED_MAX (DISKIO_CACHE_SECTORS / 2)
+#endif
+
+#define DISKIO_CACHE_PIN_RANGES 4
+
+#ifndef DISKIO_WRITE_BACK
+#define DISKIO_WRITE_BACK 1
+#endif
+
+#ifndef DISKIO_WRITEBACK_MAX_DIRTY
+#define DISKIO_WRITEBACK_MAX_DIRTY (DISKIO_CACHE_SECTORS / 2)
+#endif
+
+#ifndef DISKIO_WRITEBACK_MAX_AGE_MS
+#define DISKIO_WRITEBACK_MAX_AGE_MS 1000
+#endif
+
+typedef struct DiskCacheEntry {
+    LBA_t sector;
+    uint32_t lastUsed;
+    uint8_t valid;
+    uint8_t pinned;                     /* 1 + index of its pin range, 0 if not */
+    uint8_t dirty;
+} DiskCacheEntry;
+
+static DiskCacheEntry gDiskCacheEntries[DISKIO_CACHE_SECTORS];
+static BYTE gDiskCacheData[DISKIO_CACHE_SECTORS][FF_MAX_SS] __attribute__((aligned(4)));
+static uint32_t gDiskCacheClock;
+static int gDiskCachePinnedCount;
+
+// Each range gets its share of DISKIO_CACHE_PINNED_MAX when it's added,
+// so a range added first can't be crowded out by one added later.
+static struct {
+    LBA_t first;
+    DWORD count;
+    int limit;                          /* sectors of it that may be pinned */
+    int pinned;                         /* sectors of it pinned now */
+} gDiskCachePinRanges[DISKIO_CACHE_PIN_RANGES];
+static int gDiskCachePinRangeCount;
+static int gDiskCachePinBudget = DISKIO_CACHE_PINNED_MAX;
+
+static uint32_t gDiskCacheHits;
+static uint32_t gDiskCacheMisses;
+static uint32_t gDiskCacheEvictions;
+
+static int gDiskCacheWriteBack = DISKIO_WRITE_BACK;
+static int gDiskCacheDirtyCount;
+static uint32_t gDiskCacheDirtySinceMillis;
+static uint32_t gDiskCacheFlushes;
+static uint32_t gDiskCacheFlushRuns;
+static uint32_t gDiskCacheFlushedSectors;
+
+static void DiskPrefetchInvalidate(LBA_t sector, UINT count);
+
+static uint32_t DiskCacheMillis(void)
+{
+    return to_ms_since_boot(get_absolute_time());
+}
+
+// Write count sectors to the card, from buff or, if list is not NULL,
+// from list[0..count-1].  Cards program fastest when a multiple block
+// write stays inside one erase/allocation unit, so long runs are split at
+// unit boundaries.
+static int DiskWriteCard(LBA_t sector, const BYTE *buff, const BYTE *const *list, UINT count)
+{
+    unsigned long unit = SDCARD_get_erase_block_sectors();
+
+    DiskPrefetchInvalidate(sector, count);
+
+    while(count > 0) {
+        UINT run = count;
+        if(unit > 1) {
+            UINT to_boundary = unit - (sector % unit);
+            if(run > to_boundary)
+                run = to_boundary;
+        }
+
+        int success = 0;
+        for(int attempt = 0; !success && (attempt <= DISKIO_CARD_RETRIES); attempt++) {
+            if(attempt > 0) {
+                gDiskTelemetry[DEV_MMC].retries++;
+                logprintf(DEBUG_WARNINGS, "retrying write of %d SD blocks at %d\n", run, sector);
+            }
+            if(list) {
+                success = SDCARD_queue_writeblock_list(sector, list, run);
+            } else {
+                success = SDCARD_queue_writeblocks(sector, buff, run);
+            }
+        }
+        if(list) {
+            list += run;
+        } else {
+            buff += run * SD_BLOCK_SIZE;
+        }
+        if(!success) {
+            logprintf(DEBUG_ERRORS, "ERROR: failed writing %d SD blocks at %d\n", run, sector);
+            return 0;
+        }
+
+        sector += run;
+        count -= run;
+    }
+
+    return 1;
+}
+
+static void DiskCacheSetDirty(DiskCacheEntry *entry, int dirty)
+{
+    if(dirty && !entry->dirty) {
+        if(gDiskCacheDirtyCount++ == 0) {
+            gDiskCacheDirtySinceMillis = DiskCacheMillis();
+        }
+    } else if(!dirty && entry->dirty) {
+        gDiskCacheDirtyCount--;
+    }
+    entry->dirty = dirty;
+}
+
+// Write all dirty sectors back, merging adjacent sectors into one write.
+static int DiskCacheFlush(void)
+{
+    static int order[DISKIO_CACHE_SECTORS];
+    static const BYTE *list[DISKIO_CACHE_SECTORS];
+    int dirty = 0;
+
+    if(gDiskCacheDirtyCount == 0) {
+        return 1;
+    }
+
+    // Insertion sort of the dirty entries by sector
+    for(int i = 0; i < DISKIO_CACHE_SECTORS; i++) {
+        if(gDiskCacheEntries[i].valid && gDiskCacheEntries[i].dirty) {
+            int j = dirty++;
+            while((j > 0) && (gDiskCacheEntries[order[j - 1]].sector > gDiskCacheEntries[i].sector)) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+    }
+
+    gDiskCacheFlushes++;
+    int success = 1;
+    for(int first = 0; first < dirty; ) {
+        int count = 1;
+        list[0] = gDiskCacheData[order[first]];
+        while((first + count < dirty) &&
+            (gDiskCacheEntries[order[first + count]].sector == gDiskCacheEntries[order[first]].sector + count)) {
+            list[count] = gDiskCacheData[order[first + count]];
+            count++;
+        }
+
+        if(DiskWriteCard(gDiskCacheEntries[order[first]].sector, NULL, list, count)) {
+            for(int i = 0; i < count; i++) {
+                DiskCacheSetDirty(&gDiskCacheEntries[order[first + i]], 0);
+            }
+            gDiskCacheFlushRuns++;
+            gDiskCacheFlushedSectors += count;
+        } else {
+            success = 0;
+        }
+        first += count;
+    }
+
+    return success;
+}
+
+static int DiskCacheFind(LBA_t sector)
+{
+    for(int i = 0; i < DISKIO_CACHE_SECTORS; i++) {
+        if(gDiskCacheEntries[i].valid && (gDiskCacheEntries[i].sector == sector)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Pin a newly claimed entry if its sector is in a range with room left.
+static void DiskCachePin(DiskCacheEntry *entry)
+{
+    for(int i = 0; i < gDiskCachePinRangeCount; i++) {
+        if((entry->sector >= gDiskCachePinRanges[i].first) &&
+            (entry->sector - gDiskCachePinRanges[i].first < gDiskCachePinRanges[i].count)) {
+            if(gDiskCachePinRanges[i].pinned < gDiskCachePinRanges[i].limit) {
+                gDiskCachePinRanges[i].pinned++;
+                gDiskCachePinnedCount++;
+                entry->pinned = i + 1;
+            }
+            return;
+        }
+    }
+}
+
+static void DiskCacheUnpin(DiskCacheEntry *entry)
+{
+    if(entry->pinned) {
+        gDiskCachePinRanges[entry->pinned - 1].pinned--;
+        gDiskCachePinnedCount--;
+        entry->pinned = 0;
+    }
+}
+
+// Pick an empty entry, or else the least recently used unpinned entry
+// (preferring clean ones), and claim it for "sector".  The entry is left
+// invalid until filled.  Returns -1 if a dirty victim couldn't be written
+// back.
+static int DiskCacheClaim(LBA_t sector)
+{
+    int victim = -1;
+    for(int i = 0; i < DISKIO_CACHE_SECTORS; i++) {
+        DiskCacheEntry *entry = &gDiskCacheEntries[i];
+        if(!entry->valid) {
+            victim = i;
+            break;
+        }
+        if(entry->pinned) {
+            continue;
+        }
+        if(victim < 0) {
+            victim = i;
+        } else {
+            DiskCacheEntry *best = &gDiskCacheEntries[victim];
+            if((entry->dirty < best->dirty) ||
+                ((entry->dirty == best->dirty) && ((int32_t)(entry->lastUsed - best->lastUsed) < 0))) {
+                victim = i;
+            }
+        }
+    }
+
+    DiskCacheEntry *entry = &gDiskCacheEntries[victim];
+    if(entry->valid && entry->dirty) {
+        if(!DiskCacheFlush()) {
+            return -1;
+        }
+    }
+    if(entry->valid) {
+        gDiskCacheEvictions++;
+    }
+    DiskCacheUnpin(entry);
+    entry->valid = 0;
+    entry->sector = sector;
+    DiskCachePin(entry);
+    entry->lastUsed = ++gDiskCacheClock;
+    return victim;
+}
+
+// Keep cached copies of sectors that were just written to the card up to
+// date.  The card now has the newest data, so they are clean.
+static void DiskCacheUpdate(const BYTE *buff, LBA_t sector, UINT count)
+{
+    for(int i = 0; i < DISKIO_CACHE_SECTORS; i++) {
+        DiskCacheEntry *entry = &gDiskCacheEntries[i];
+        if(entry->valid && (entry->sector >= sector) && (entry->sector - sector < count)) {
+            memcpy(gDiskCacheData[i], buff + (entry->sector - sector) * FF_MAX_SS, FF_MAX_SS);
+            DiskCacheSetDirty(entry, 0);
+        }
+    }
+}
+
+// Replace sectors just read from the card with dirty cached copies.
+static void DiskCacheOverlayDirty(BYTE *buff, LBA_t sector, UINT count)
+{
+    if(gDiskCacheDirtyCount == 0) {
+        return;
+    }
+    for(int i = 0; i < DISKIO_CACHE_SECTORS; i++) {
+        DiskCacheEntry *entry = &gDiskCacheEntries[i];
+        if(entry->valid && entry->dirty && (entry->sector >= sector) && (entry->sector - sector < count)) {
+            memcpy(buff + (entry->sector - sector) * FF_MAX_SS, gDiskCacheData[i], FF_MAX_SS);
+        }
+    }
+}
+
+// Forget clean sectors whose contents on the card are unknown.  Dirty
+// sectors are kept and will be written again.
+static void DiskCacheInvalidate(LBA_t sector, UINT count)
+{
+    for(int i = 0; i < DISKIO_CACHE_SECTORS; i++) {
+        DiskCacheEntry *entry = &gDiskCacheEntries[i];
+        if(entry->valid && !entry->dirty && (entry->sector >= sector) && (entry->sector - sector < count)) {
+            entry->valid = 0;
+            DiskCacheUnpin(entry);
+        }
+    }
+}
+
+// Forget sectors FatFs has freed, dirty ones included; their contents no
+// longer matter and writing them back would only undo the erase.
+static void DiskCacheDiscard(LBA_t sector, LBA_t count)
+{
+    for(int i = 0; i < DISKIO_CACHE_SECTORS; i++) {
+        DiskCacheEntry *entry = &gDiskCacheEntries[i];
+        if(entry->valid && (entry->sector >= sector) && (entry->sector - sector < count)) {
+            DiskCacheSetDirty(entry, 0);
+            entry->valid = 0;
+            DiskCacheUnpin(entry);
+        }
+    }
+}
+
+// Keep sectors in [first, first + count) in the cache once they've been
+// read.  The range gets as much of what's left of DISKIO_CACHE_PINNED_MAX
+// as it covers; returns 0 if there's none left.
+int disk_cache_pin(LBA_t first, DWORD count)
+{
+    mutex_enter_blocking(&gDiskLock);
+    int limit = (count < (DWORD)gDiskCachePinBudget) ? (int)count : gDiskCachePinBudget;
+    int success = (gDiskCachePinRangeCount < DISKIO_CACHE_PIN_RANGES) && (limit > 0);
+    if(success) {
+        gDiskCachePinRanges[gDiskCachePinRangeCount].first = first;
+        gDiskCachePinRanges[gDiskCachePinRangeCount].count = count;
+        gDiskCachePinRanges[gDiskCachePinRangeCount].limit = limit;
+        gDiskCachePinRanges[gDiskCachePinRangeCount].pinned = 0;
+        gDiskCachePinRangeCount++;
+        gDiskCachePinBudget -= limit;
+    }
+    mutex_exit(&gDiskLock);
+    return success;
+}
+
+// Pin the root directory of a mounted volume, where the launcher starts,
+// then give what's left to the start of the first FAT.  The root keeps
+// one pin back for the FAT.
+void disk_cache_pin_volume(const FATFS *fs)
+{
+    LBA_t root;
+    DWORD rootSectors;
+    if(fs->fs_type >= FS_FAT32) {
+        root = fs->database + (LBA_t)fs->csize * (fs->dirbase - 2);
+        rootSectors = fs->csize;
+    } else {
+        root = fs->dirbase;
+        rootSectors = fs->n_rootdir * 32 / FF_MAX_SS;
+    }
+    if(rootSectors > DISKIO_CACHE_PINNED_MAX - 1) {
+        rootSectors = DISKIO_CACHE_PINNED_MAX - 1;
+    }
+    disk_cache_pin(root, rootSectors);
+    disk_cache_pin(fs->fatbase, fs->fsize);
+}
+
+// Whether sector is in the cache, for tests.
+int disk_cache_contains(LBA_t sector)
+{
+    mutex_enter_blocking(&gDiskLock);
+    int found = DiskCacheFind(sector) >= 0;
+    mutex_exit(&gDiskLock);
+    return found;
+}
+
+// Switch between write-back and write-through.  Switching to
+// write-through writes back anything dirty first.
+int disk_cache_set_write_back(int enable)
+{
+    mutex_enter_blocking(&gDiskLock);
+    int success = enable || DiskCacheFlush();
+    if(success) {
+        gDiskCacheWriteBack = enable;
+    }
+    mutex_exit(&gDiskLock);
+    return success;
+}
+
+// Called periodically (from RoDoHousekeeping) to write back dirty sectors
+// that have waited too long.  If the other core is in diskio.c, try again
+// next time.
+void disk_cache_poll(void)
+{
+    if(!mutex_try_enter(&gDiskLock, NULL)) {
+        return;
+    }
+    if((gDiskCacheDirtyCount > 0) && (DiskCacheMillis() - gDiskCacheDirtySinceMillis >= DISKIO_WRITEBACK_MAX_AGE_MS)) {
+        DiskCacheFlush();
+    }
+    mutex_exit(&gDiskLock);
+}
+
+void disk_cache_print_stats(void)
+{
+    uint32_t lookups = gDiskCacheHits + gDiskCacheMisses;
+    printf("sector cache: %lu hits, %lu misses (%lu%% hit), %lu evictions, %d of %d sectors pinned\n",
+        (unsigned long)gDiskCacheHits, (unsigned long)gDiskCacheMisses,
+        (unsigned long)(lookups ? (uint64_t)gDiskCacheHits * 100 / lookups : 0),
+        (unsigned long)gDiskCacheEvictions, gDiskCachePinnedCount, DISKIO_CACHE_SECTORS);
+    printf("write-back %s: %d dirty, %lu flushes wrote %lu sectors in %lu runs\n",
+        gDiskCacheWriteBack ? "on" : "off", gDiskCacheDirtyCount,
+        (unsigned long)gDiskCacheFlushes, (unsigned long)gDiskCacheFlushedSectors, (unsigned long)gDiskCacheFlushRuns);
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Sequential read-ahead                                                 */
+/*-----------------------------------------------------------------------*/
+
+// Once multiple-sector reads in the data area, each starting where the
+// last one ended, have covered more than DISKIO_PREFETCH_TRIGGER sectors,
+// the sectors after the stream are read ahead into a ring with an
+// asynchronous SD request, which core 1 services while the caller gets on
+// with decoding or emulating.  FatFs reads FAT and directory sectors one at
+// a time through its window, so walking those never starts read-ahead, and
+// a cartridge ROM of up to 32KB is read whole before it would.  Reads that
+// land in the ring are copied out of it and move the ring forward; more is
+// requested whenever half the prefetch depth is free, but never past the
+// end of the cluster it starts in, so a stream that ends or jumps wastes
+// at most that much.  Only one stream is tracked.
+
+#ifndef DISKIO_PREFETCH_SECTORS
+#define DISKIO_PREFETCH_SECTORS 16 /* SRAM budget is DISKIO_PREFETCH_SECTORS * FF_MAX_SS */
+#endif
+
+#ifndef DISKIO_PREFETCH_TRIGGER
+#define DISKIO_PREFETCH_TRIGGER 64 /* sectors */
+#endif
+
+static BYTE gPrefetchData[DISKIO_PREFETCH_SECTORS][FF_MAX_SS] __attribute__((aligned(4)));
+static UINT gPrefetchDepth = DISKIO_PREFETCH_SECTORS;
+static LBA_t gPrefetchFirst;            /* sector in the first valid slot */
+static UINT gPrefetchValid;             /* sectors read and waiting */
+static SDCardRequest gPrefetchRequest;  /* reads the sectors after those */
+static int gPrefetchInFlight;
+
+static LBA_t gPrefetchDataStart;        /* cluster 2, from disk_prefetch_set_volume */
+static UINT gPrefetchClusterSectors;    /* 0 until disk_prefetch_set_volume */
+
+static LBA_t gStreamNext;               /* sector after the last read */
+static UINT gStreamSectors;             /* read in a row, ending at gStreamNext */
+
+static uint32_t gPrefetchHits;          /* sectors served from the ring */
+static uint32_t gPrefetchMisses;        /* sequential sectors that weren't */
+static uint32_t gPrefetchIssued;        /* sectors requested */
+static uint32_t gPrefetchWasted;        /* sectors dropped unread */
+
+// Move a finished read-ahead request's sectors into the ring.  If wait is
+// set, wait for the request to finish first.
+static void DiskPrefetchCollect(int wait)
+{
+    if(!gPrefetchInFlight) {
+        return;
+    }
+    if(!wait && !SDCARD_request_done(&gPrefetchRequest)) {
+        return;
+    }
+    if(SDCARD_wait(&gPrefetchRequest)) {
+        gPrefetchValid += gPrefetchRequest.count;
+    } else {
+        logprintf(DEBUG_WARNINGS, "WARNING: read-ahead of %d SD blocks at %d failed\n", gPrefetchRequest.count, gPrefetchRequest.blocknum);
+    }
+    gPrefetchInFlight = 0;
+}
+
+static void DiskPrefetchDrop(void)
+{
+    DiskPrefetchCollect(1);
+    gPrefetchWasted += gPrefetchValid;
+    gPrefetchValid = 0;
+}
+
+// Drop the ring if any of [sector, sector + count) is in it or being read.
+static void DiskPrefetchInvalidate(LBA_t sector, UINT count)
+{
+    UINT span = gPrefetchValid + (gPrefetchInFlight ? gPrefetchRequest.count : 0);
+    if((span > 0) && (sector < gPrefetchFirst + span) && (gPrefetchFirst < sector + count)) {
+        DiskPrefetchDrop();
+    }
+}
+
+// Copy the leading sectors of [sector, sector + count) that are in the
+// ring into buff and return how many there were.  A read that runs into
+// sectors still being read ahead waits for them rather than reading them
+// again.
+static UINT DiskPrefetchRead(BYTE *buff, LBA_t sector, UINT count)
+{
+    DiskPrefetchCollect(0);
+
+    if(gPrefetchInFlight && (sector < gPrefetchRequest.blocknum + gPrefetchRequest.count) &&
+        (gPrefetchRequest.blocknum < sector + count)) {
+        DiskPrefetchCollect(1);
+    }
+    if((sector < gPrefetchFirst) || (sector >= gPrefetchFirst + gPrefetchValid)) {
+        return 0;
+    }
+
+    UINT served = gPrefetchFirst + gPrefetchValid - sector;
+    if(served > count) {
+        served = count;
+    }
+    for(UINT i = 0; i < served; i++) {
+        memcpy(buff + i * FF_MAX_SS, gPrefetchData[(sector + i) % DISKIO_PREFETCH_SECTORS], FF_MAX_SS);
+    }
+
+    // Everything up to the end of this read is consumed.
+    UINT consumed = sector + served - gPrefetchFirst;
+    gPrefetchWasted += sector - gPrefetchFirst;
+    gPrefetchFirst += consumed;
+    gPrefetchValid -= consumed;
+    gPrefetchHits += served;
+
+    return served;
+}
+
+// Keep the ring topped up after a read that ended at "next".
+static void DiskPrefetchIssue(LBA_t next)
+{
+    if(gPrefetchDepth == 0) {
+        return;
+    }
+
+    if((gPrefetchValid == 0) && !gPrefetchInFlight) {
+        gPrefetchFirst = next;
+    } else if(next != gPrefetchFirst) {
+        UINT span = gPrefetchValid + (gPrefetchInFlight ? gPrefetchRequest.count : 0);
+        if((next > gPrefetchFirst) && (next <= gPrefetchFirst + span)) {
+            // the read ended inside the ring; skip the sectors it covered
+            if(next > gPrefetchFirst + gPrefetchValid) {
+                DiskPrefetchCollect(1);
+            }
+        }
+        if((next > gPrefetchFirst) && (next <= gPrefetchFirst + gPrefetchValid)) {
+            UINT skipped = next - gPrefetchFirst;
+            gPrefetchWasted += skipped;
+            gPrefetchFirst = next;
+            gPrefetchValid -= skipped;
+        } else {
+            // the stream moved somewhere else
+            DiskPrefetchDrop();
+            gPrefetchFirst = next;
+        }
+    }
+    if(gPrefetchInFlight) {
+        return;
+    }
+
+    UINT space = gPrefetchDepth - gPrefetchValid;
+    if(space < (gPrefetchDepth + 1) / 2) {
+        return;
+    }
+
+    LBA_t ahead = gPrefetchFirst + gPrefetchValid;
+    UINT slot = ahead % DISKIO_PREFETCH_SECTORS;
+    UINT count = space;
+    if(count > DISKIO_PREFETCH_SECTORS - slot) {
+        count = DISKIO_PREFETCH_SECTORS - slot;
+    }
+    if((gPrefetchClusterSectors != 0) && (ahead >= gPrefetchDataStart)) {
+        UINT left = gPrefetchClusterSectors - (ahead - gPrefetchDataStart) % gPrefetchClusterSectors;
+        if(count > left) {
+            count = left;
+        }
+    }
+    LBA_t end = SDCARD_get_sector_count();
+    if((end != 0) && (ahead + count > end)) {
+        if(ahead >= end) {
+            return;
+        }
+        count = end - ahead;
+    }
+
+    gPrefetchRequest.operation = SD_REQUEST_READ;
+    gPrefetchRequest.blocknum = ahead;
+    gPrefetchRequest.count = count;
+    gPrefetchRequest.buffer = gPrefetchData[slot];
+    gPrefetchRequest.callback = NULL;
+    if(SDCARD_submit(&gPrefetchRequest)) {
+        gPrefetchInFlight = 1;
+        gPrefetchIssued += count;
+    }
+}
+
+// Sectors to keep read ahead of a sequential stream, up to
+// DISKIO_PREFETCH_SECTORS; 0 turns read-ahead off.
+void disk_prefetch_set_depth(UINT sectors)
+{
+    if(sectors > DISKIO_PREFETCH_SECTORS) {
+        sectors = DISKIO_PREFETCH_SECTORS;
+    }
+    mutex_enter_blocking(&gDiskLock);
+    DiskPrefetchDrop();
+    gPrefetchDepth = sectors;
+    mutex_exit(&gDiskLock);
+}
+
+UINT disk_prefetch_get_depth(void)
+{
+    return gPrefetchDepth;
+}
+
+// Where the SD card volume's clusters are, once it's mounted, so read-ahead
+// stays in the data area and within a cluster.
+void disk_prefetch_set_volume(const FATFS *fs)
+{
+    mutex_enter_blocking(&gDiskLock);
+    gPrefetchDataStart = fs->database;
+    gPrefetchClusterSectors = fs->csize;
+    mutex_exit(&gDiskLock);
+}
+
+void disk_prefetch_print_stats(void)
+{
+    uint32_t sequential = gPrefetchHits + gPrefetchMisses;
+    printf("read-ahead depth %u: %lu sectors hit, %lu missed (%lu%% hit), %lu read ahead, %lu wasted\n",
+        gPrefetchDepth, (unsigned long)gPrefetchHits, (unsigned long)gPrefetchMisses,
+        (unsigned long)(sequential ? (uint64_t)gPrefetchHits * 100 / sequential : 0),
+        (unsigned long)gPrefetchIssued, (unsigned long)gPrefetchWasted);
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* RAM disk                                                              */
+/*-----------------------------------------------------------------------*/
+
+// A block device in SRAM for scratch files, decompression output and save
+// states.  It has no persistent contents; format it with f_mkfs after
+// creating it.
+
+static BYTE *gRamDisk;
+static UINT gRamDiskSectors;
+
+// Allocate a RAM disk of "sectors" sectors.  Returns 1 on success.
+int disk_ramdisk_create(UINT sectors)
+{
+    if(gRamDisk != NULL) {
+        return 0;
+    }
+    gRamDisk = malloc((size_t)sectors * FF_MAX_SS);
+    if(gRamDisk == NULL) {
+        logprintf(DEBUG_ERRORS, "ERROR: couldn't allocate %d sector RAM disk\n", sectors);
+        return 0;
+    }
+    gRamDiskSectors = sectors;
+    return 1;
+}
+
+static DRESULT RamDiskRead(BYTE *buff, LBA_t sector, UINT count)
+{
+    if((sector >= gRamDiskSectors) || (count > gRamDiskSectors - sector))
+        return RES_PARERR;
+
+    memcpy(buff, gRamDisk + (size_t)sector * FF_MAX_SS, (size_t)count * FF_MAX_SS);
+    return RES_OK;
+}
+
+static DRESULT RamDiskWrite(const BYTE *buff, LBA_t sector, UINT count)
+{
+    if((sector >= gRamDiskSectors) || (count > gRamDiskSectors - sector))
+        return RES_PARERR;
+
+    memcpy(gRamDisk + (size_t)sector * FF_MAX_SS, buff, (size_t)count * FF_MAX_SS);
+    return RES_OK;
+}
+
+static DRESULT RamDiskIoctl(BYTE cmd, void *buff)
+{
+    switch(cmd) {
+        case CTRL_SYNC:
+        case CTRL_TRIM:
+            return RES_OK;
+
+        case GET_SECTOR_COUNT:
+            *(LBA_t*)buff = gRamDiskSectors;
+            return RES_OK;
+
+        case GET_SECTOR_SIZE:
+            *(WORD*)buff = FF_MAX_SS;
+            return RES_OK;
+
+        case GET_BLOCK_SIZE:
+            *(DWORD*)buff = 1;
+            return RES_OK;
+
+        default:
+            return RES_PARERR;
+    }
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Flash volume                                                          */
+/*-----------------------------------------------------------------------*/
+
+// A read-only FAT volume in the flash after the firmware, made by
+// pack_flash_volume.py.  Flash is memory-mapped through XIP, so reads are
+// plain copies, and since the packer stores every file in consecutive
+// clusters, disk_flash_map_file can hand out a pointer to a file's
+// contents in place.
+
+#ifndef FLASH_VOLUME_OFFSET
+#define FLASH_VOLUME_OFFSET (1024 * 1024) /* from the start of flash */
+#endif
+
+#ifndef FLASH_VOLUME_SIZE
+#define FLASH_VOLUME_SIZE (1024 * 1024)
+#endif
+
+#define FLASH_VOLUME_SECTORS (FLASH_VOLUME_SIZE / FF_MAX_SS)
+
+#if DISKIO_FLASH_VOLUME
+extern char __flash_binary_end;
+
+static const BYTE *const gFlashVolume = (const BYTE *)(XIP_BASE + FLASH_VOLUME_OFFSET);
+#else
+static const BYTE *const gFlashVolume = NULL;
+#endif
+
+static DSTATUS FlashVolumeStatus(void)
+{
+#if !DISKIO_FLASH_VOLUME
+    return STA_NOINIT | STA_NODISK;
+#else
+    if((uintptr_t)&__flash_binary_end > (uintptr_t)gFlashVolume) {
+        return STA_NOINIT | STA_NODISK;
+    }
+    // Erased flash reads as 0xFF, so this also catches "nothing packed".
+    if((gFlashVolume[510] != 0x55) || (gFlashVolume[511] != 0xAA)) {
+        return STA_NOINIT | STA_NODISK;
+    }
+    return STA_PROTECT;
+#endif
+}
+
+static DRESULT FlashVolumeRead(BYTE *buff, LBA_t sector, UINT count)
+{
+    if((sector >= FLASH_VOLUME_SECTORS) || (count > FLASH_VOLUME_SECTORS - sector))
+        return RES_PARERR;
+
+    memcpy(buff, gFlashVolume + (size_t)sector * FF_MAX_SS, (size_t)count * FF_MAX_SS);
+    return RES_OK;
+}
+
+static DRESULT FlashVolumeIoctl(BYTE cmd, void *buff)
+{
+    switch(cmd) {
+        case CTRL_SYNC:
+            return RES_OK;
+
+        case GET_SECTOR_COUNT:
+            *(LBA_t*)buff = FLASH_VOLUME_SECTORS;
+            return RES_OK;
+
+        case GET_SECTOR_SIZE:
+            *(WORD*)buff = FF_MAX_SS;
+            return RES_OK;
+
+        case GET_BLOCK_SIZE:
+            *(DWORD*)buff = 1;
+            return RES_OK;
+
+        default:
+            return RES_PARERR;
+    }
+}
+
+// FAT entry for cluster "clst", read straight out of flash.
+static DWORD FlashVolumeFATEntry(const FATFS *fs, DWORD clst)
+{
+    const BYTE *fat = gFlashVolume + (size_t)fs->fatbase * FF_MAX_SS;
+
+    if(fs->fs_type == FS_FAT12) {
+        UINT offset = clst + clst / 2;
+        UINT pair = fat[offset] | (fat[offset + 1] << 8);
+        return (clst & 1) ? (pair >> 4) : (pair & 0xFFF);
+    } else if(fs->fs_type == FS_FAT16) {
+        return fat[clst * 2] | (fat[clst * 2 + 1] << 8);
+    } else {
+        return ((DWORD)fat[clst * 4] | ((DWORD)fat[clst * 4 + 1] << 8) |
+            ((DWORD)fat[clst * 4 + 2] << 16) | ((DWORD)fat[clst * 4 + 3] << 24)) & 0x0FFFFFFF;
+    }
+}
+
+// Return a pointer to the contents of a file on the flash volume, and its
+// size in *size, or NULL if the file doesn't exist, isn't on the flash
+// volume, or isn't stored contiguously.  The pointer stays valid as long
+// as the firmware runs.
+const void *disk_flash_map_file(const TCHAR *path, FSIZE_t *size)
+{
+    FIL file;
+
+    if(f_open(&file, path, FA_READ) != FR_OK) {
+        return NULL;
+    }
+
+    const FATFS *fs = file.obj.fs;
+    DWORD first = file.obj.sclust;
+    FSIZE_t length = file.obj.objsize;
+    f_close(&file);
+
+    if(fs->pdrv != DEV_FLASH) {
+        return NULL;
+    }
+    *size = length;
+    if(length == 0) {
+        return gFlashVolume;
+    }
+
+    DWORD cluster_bytes = (DWORD)fs->csize * FF_MAX_SS;
+    DWORD clusters = (length + cluster_bytes - 1) / cluster_bytes;
+    for(DWORD i = 0; i + 1 < clusters; i++) {
+        if(FlashVolumeFATEntry(fs, first + i) != first + i + 1) {
+            logprintf(DEBUG_WARNINGS, "disk_flash_map_file: %s is fragmented\n", path);
+            return NULL;
+        }
+    }
+
+    return gFlashVolume + (size_t)(fs->database + (LBA_t)fs->csize * (first - 2)) * FF_MAX_SS;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Contiguous streams                                                    */
+/*-----------------------------------------------------------------------*/
+
+// Continuous captures (audio, screen recordings, save states) allocate the
+// whole file up front with f_expand and then write whole sectors straight
+// to the drive, so the hot path never touches the FAT or directory and
+// every write can be a multiple-block write.
+//
+//   DiskStream capture;
+//   disk_stream_create(&capture, "0:/capture.raw", 4 * 1024 * 1024);
+//   while(recording)
+//       disk_stream_write(&capture, buffer, 16);
+//   disk_stream_close(&capture, bytes_recorded);
+
+#if FF_FS_READONLY == 0
+
+// Create (or replace) "path" with "size" bytes in one run of clusters.
+// Fails with FR_DENIED if the volume has no free run that long.
+FRESULT disk_stream_create(DiskStream *stream, const TCHAR *path, FSIZE_t size)
+{
+    if(size == 0) {
+        return FR_INVALID_PARAMETER;
+    }
+
+    FRESULT result = f_open(&stream->file, path, FA_WRITE | FA_CREATE_ALWAYS);
+    if(result != FR_OK) {
+        return result;
+    }
+    result = f_expand(&stream->file, size, 1);
+    if(result != FR_OK) {
+        f_close(&stream->file);
+        f_unlink(path);
+        return result;
+    }
+
+    const FATFS *fs = stream->file.obj.fs;
+    stream->pdrv = fs->pdrv;
+    stream->first = fs->database + (LBA_t)fs->csize * (stream->file.obj.sclust - 2);
+    stream->sectors = (size + FF_MAX_SS - 1) / FF_MAX_SS;
+    stream->written = 0;
+    return FR_OK;
+}
+
+// Write the next "count" sectors of the file.
+DRESULT disk_stream_write(DiskStream *stream, const BYTE *buff, UINT count)
+{
+    if(count > stream->sectors - stream->written) {
+        return RES_PARERR;
+    }
+    DRESULT result = disk_write(stream->pdrv, buff, stream->first + stream->written, count);
+    if(result == RES_OK) {
+        stream->written += count;
+    }
+    return result;
+}
+
+// Cut the file to "length" bytes, freeing the clusters past it, and close
+// it.
+FRESULT disk_stream_close(DiskStream *stream, FSIZE_t length)
+{
+    FRESULT result = FR_OK;
+
+    if(length < f_size(&stream->file)) {
+        result = f_lseek(&stream->file, length);
+        if(result == FR_OK) {
+            result = f_truncate(&stream->file);
+        }
+    }
+    FRESULT closed = f_close(&stream->file);
+    return (result != FR_OK) ? result : closed;
+}
+
+#endif
 
 
 /*-----------------------------------------------------------------------*/
@@ -46,7 +1092,13 @@ DSTATUS disk_status (
 	BYTE pdrv		/* Physical drive nmuber to identify the drive */
 )
 {
-    if(pdrv != 0)
+    if(pdrv == DEV_RAM)
+        return gRamDisk ? 0 : (STA_NOINIT | STA_NODISK);
+
+    if(pdrv == DEV_FLASH)
+        return FlashVolumeStatus();
+
+    if(pdrv != DEV_MMC)
         return STA_NODISK;
 
     return 0;
@@ -62,18 +1114,106 @@ DSTATUS disk_initialize (
 	BYTE pdrv				/* Physical drive nmuber to identify the drive */
 )
 {
-    if(pdrv != 0)
+    if(pdrv == DEV_RAM)
+        return gRamDisk ? 0 : (STA_NOINIT | STA_NODISK);
+
+    if(pdrv == DEV_FLASH)
+        return FlashVolumeStatus();
+
+    if(pdrv != DEV_MMC)
+        return STA_NOINIT;
+
+    return 0;
+}
+
+
+
+static int DiskReadCard(LBA_t sector, BYTE *buff, UINT count)
+{
+    for(int attempt = 0; ; attempt++) {
+        if(SDCARD_queue_readblocks(sector, buff, count))
+            return 1;
+        if(attempt >= DISKIO_CARD_RETRIES)
+            return 0;
+        gDiskTelemetry[DEV_MMC].retries++;
+        logprintf(DEBUG_WARNINGS, "retrying read of %d SD blocks at %d\n", count, sector);
+    }
+}
+
+// Read through the sector cache.
+static DRESULT DiskReadSectors(BYTE *buff, LBA_t sector, UINT count)
+{
+    if(count == 1) {
+        int which = DiskCacheFind(sector);
+        if(which >= 0) {
+            gDiskCacheHits++;
+            gDiskCacheEntries[which].lastUsed = ++gDiskCacheClock;
+            memcpy(buff, gDiskCacheData[which], FF_MAX_SS);
+            return RES_OK;
+        }
+
+        gDiskCacheMisses++;
+        which = DiskCacheClaim(sector);
+        if(which < 0)
+            return RES_ERROR;
+        if(!DiskReadCard(sector, gDiskCacheData[which], 1)) {
+            logprintf(DEBUG_ERRORS, "ERROR: failed reading %d SD blocks at %d\n", count, sector);
+            return RES_ERROR;
+        }
+        gDiskCacheEntries[which].valid = 1;
+        memcpy(buff, gDiskCacheData[which], FF_MAX_SS);
+        return RES_OK;
+    }
+
+    if(!DiskReadCard(sector, buff, count)) {
+        logprintf(DEBUG_ERRORS, "ERROR: failed reading %d SD blocks at %d\n", count, sector);
         return RES_ERROR;
+    }
+    DiskCacheOverlayDirty(buff, sector, count);
 
     return RES_OK;
 }
 
 
-
 /*-----------------------------------------------------------------------*/
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
 
+static DRESULT DiskReadDrive(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
+{
+    if(pdrv == DEV_RAM)
+        return RamDiskRead(buff, sector, count);
+
+    if(pdrv == DEV_FLASH)
+        return FlashVolumeRead(buff, sector, count);
+
+    if(pdrv != DEV_MMC)
+        return RES_ERROR;
+
+    int sequential = (sector == gStreamNext);
+    gStreamSectors = sequential ? (gStreamSectors + count) : count;
+    gStreamNext = sector + count;
+
+    UINT served = DiskPrefetchRead(buff, sector, count);
+    if(sequential) {
+        gPrefetchMisses += count - served;
+    }
+
+    DiskCacheOverlayDirty(buff, sector, served);
+
+    DRESULT result = RES_OK;
+    if(served < count) {
+        result = DiskReadSectors(buff + served * FF_MAX_SS, sector + served, count - served);
+    }
+
+    if((result == RES_OK) && ((served > 0) ||
+        ((count > 1) && (sector >= gPrefetchDataStart) && (gStreamSectors > DISKIO_PREFETCH_TRIGGER)))) {
+        DiskPrefetchIssue(gStreamNext);
+    }
+
+    return result;
+}
+
 DRESULT disk_read (
 	BYTE pdrv,		/* Physical drive nmuber to identify the drive */
 	BYTE *buff,		/* Data buffer to store read data */
@@ -81,16 +1221,13 @@ DRESULT disk_read (
 	UINT count		/* Number of sectors to read */
 )
 {
-    if(pdrv != 0)
-        return RES_ERROR;
-
-    for(int i = 0; i < count; i++)
-        if(!SDCARD_readblock(gSPI, sector + i, buff + SD_BLOCK_SIZE * i))  {
-            logprintf(DEBUG_ERRORS, "ERROR: failed reading SD block %d\n", sector + i);
-            return RES_ERROR;
-	}
-
-    return RES_OK;
+    mutex_enter_blocking(&gDiskLock);
+    uint64_t started = time_us_64();
+    DRESULT result = DiskReadDrive(pdrv, buff, sector, count);
+    if(pdrv < DISKIO_DRIVES)
+        DiskTelemetryRecord(pdrv, 0, count, time_us_64() - started, result);
+    mutex_exit(&gDiskLock);
+    return result;
 }
 
 
@@ -101,6 +1238,51 @@ DRESULT disk_read (
 
 #if FF_FS_READONLY == 0
 
+static DRESULT DiskWriteDrive(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
+{
+    if(pdrv == DEV_RAM)
+        return RamDiskWrite(buff, sector, count);
+
+    if(pdrv == DEV_FLASH)
+        return RES_WRPRT;
+
+    if(pdrv != DEV_MMC)
+        return RES_ERROR;
+
+    if(gDiskCacheWriteBack && (count == 1)) {
+        int which = DiskCacheFind(sector);
+        if(which < 0) {
+            which = DiskCacheClaim(sector);
+            if(which < 0)
+                return RES_ERROR;
+            gDiskCacheEntries[which].valid = 1;
+        }
+        gDiskCacheEntries[which].lastUsed = ++gDiskCacheClock;
+        memcpy(gDiskCacheData[which], buff, FF_MAX_SS);
+        DiskCacheSetDirty(&gDiskCacheEntries[which], 1);
+
+        if((gDiskCacheDirtyCount >= DISKIO_WRITEBACK_MAX_DIRTY) && !DiskCacheFlush())
+            return RES_ERROR;
+        return RES_OK;
+    }
+
+    if(!DiskWriteCard(sector, buff, NULL, count)) {
+        DiskCacheInvalidate(sector, count);
+        return RES_ERROR;
+    }
+
+    DiskCacheUpdate(buff, sector, count);
+    if((count == 1) && (DiskCacheFind(sector) < 0)) {
+        int which = DiskCacheClaim(sector);
+        if(which >= 0) {
+            memcpy(gDiskCacheData[which], buff, FF_MAX_SS);
+            gDiskCacheEntries[which].valid = 1;
+        }
+    }
+
+    return RES_OK;
+}
+
 DRESULT disk_write (
 	BYTE pdrv,			/* Physical drive nmuber to identify the drive */
 	const BYTE *buff,	/* Data to be written */
@@ -108,16 +1290,13 @@ DRESULT disk_write (
 	UINT count			/* Number of sectors to write */
 )
 {
-    if(pdrv != 0)
-        return RES_ERROR;
-
-    for(int i = 0; i < count; i++)
-        if(!SDCARD_writeblock(gSPI, sector + i, buff + SD_BLOCK_SIZE * i)) {
-            logprintf(DEBUG_ERRORS, "ERROR: failed reading SD block %d\n", sector + i);
-            return RES_ERROR;
-	}
-
-    return RES_OK;
+    mutex_enter_blocking(&gDiskLock);
+    uint64_t started = time_us_64();
+    DRESULT result = DiskWriteDrive(pdrv, buff, sector, count);
+    if(pdrv < DISKIO_DRIVES)
+        DiskTelemetryRecord(pdrv, 1, count, time_us_64() - started, result);
+    mutex_exit(&gDiskLock);
+    return result;
 }
 
 #endif
@@ -127,22 +1306,89 @@ DRESULT disk_write (
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_ioctl (
-	BYTE pdrv,		/* Physical drive nmuber (0..) */
-	BYTE cmd,		/* Control code */
-	void *buff		/* Buffer to send/receive control data */
-)
+// Set to 0 to keep CTRL_TRIM from erasing, e.g. for a card that is slow
+// to erase.  Trimmed sectors are still dropped from the caches.
+#ifndef DISKIO_TRIM
+#define DISKIO_TRIM 1
+#endif
+
+static DRESULT DiskIoctl(BYTE pdrv, BYTE cmd, void *buff)
 {
     DRESULT result = RES_OK;
 
-    if(pdrv != 0)
+    if((cmd == DISK_GET_TELEMETRY) || (cmd == DISK_RESET_TELEMETRY))
+        return DiskTelemetryIoctl(pdrv, cmd, buff);
+
+    if(pdrv == DEV_RAM)
+        return RamDiskIoctl(cmd, buff);
+
+    if(pdrv == DEV_FLASH)
+        return FlashVolumeIoctl(cmd, buff);
+
+    if(pdrv != DEV_MMC)
         return RES_ERROR;
 
     switch(cmd) {
         case CTRL_SYNC:
-            result = RES_OK;
+            result = DiskCacheFlush() ? RES_OK : RES_ERROR;
+            break;
+
+        case GET_SECTOR_COUNT:
+            if(SDCARD_get_sector_count() == 0)
+                return RES_ERROR;
+            *(LBA_t*)buff = SDCARD_get_sector_count();
+            break;
+
+        case GET_SECTOR_SIZE:
+            *(WORD*)buff = SD_BLOCK_SIZE;
+            break;
+
+        case GET_BLOCK_SIZE:
+            // Erase block size in sectors, 1 if unknown
+            *(DWORD*)buff = SDCARD_get_erase_block_sectors() ? SDCARD_get_erase_block_sectors() : 1;
+            break;
+
+        case CTRL_TRIM: {
+            // FatFs passes the first and last sector of a freed cluster
+            // run, or of the whole volume from f_mkfs.  Erasing them now
+            // spares the card a read-modify-write when they are reused.
+            LBA_t first = ((LBA_t*)buff)[0];
+            LBA_t last = ((LBA_t*)buff)[1];
+            if((last < first) || (last >= SDCARD_get_sector_count()))
+                return RES_PARERR;
+            DiskCacheDiscard(first, last - first + 1);
+            DiskPrefetchInvalidate(first, last - first + 1);
+#if DISKIO_TRIM
+            if(!SDCARD_queue_erase(first, last - first + 1)) {
+                logprintf(DEBUG_WARNINGS, "failed erasing SD blocks %d through %d\n", first, last);
+                result = RES_ERROR;
+            }
+#endif
+            break;
+        }
+
+        case MMC_GET_TYPE:
+            *(BYTE*)buff = SDCARD_get_type();
+            break;
+
+        case MMC_GET_CSD:
+            memcpy(buff, SDCARD_get_csd(), 16);
             break;
 
+        case MMC_GET_CID:
+            memcpy(buff, SDCARD_get_cid(), 16);
+            break;
+
+        case MMC_GET_OCR: {
+            unsigned long ocr = SDCARD_get_ocr();
+            BYTE *bytes = buff;
+            bytes[0] = ocr >> 24;
+            bytes[1] = ocr >> 16;
+            bytes[2] = ocr >> 8;
+            bytes[3] = ocr >> 0;
+            break;
+        }
+
         default:
             logprintf(DEBUG_ERRORS, "ERROR: unexpected FatFS ioctl %d\n", cmd);
             result = RES_ERROR;
@@ -152,6 +1398,18 @@ DRESULT disk_ioctl (
     return result;
 }
 
+DRESULT disk_ioctl (
+	BYTE pdrv,		/* Physical drive nmuber (0..) */
+	BYTE cmd,		/* Control code */
+	void *buff		/* Buffer to send/receive control data */
+)
+{
+    mutex_enter_blocking(&gDiskLock);
+    DRESULT result = DiskIoctl(pdrv, cmd, buff);
+    mutex_exit(&gDiskLock);
+    return result;
+}
+
 DWORD get_fattime(void)
 {
     // returns FatFS formatted date-time
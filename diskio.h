@@ -33,6 +33,47 @@ DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 
 
+/* Counters returned by DISK_GET_TELEMETRY.  Latency bucket i counts calls
+   that took under (32 << i) microseconds; the last bucket takes the rest. */
+
+#define DISK_LATENCY_BUCKETS	12
+
+typedef struct {
+	DWORD	reads;			/* disk_read calls */
+	DWORD	writes;			/* disk_write calls */
+	DWORD	sectors_read;	/* sectors FatFs asked for */
+	DWORD	sectors_written;
+	DWORD	errors;			/* calls that didn't return RES_OK */
+	DWORD	retries;		/* failed card transfers tried again */
+	DWORD	commands;		/* SD card only from here down */
+	DWORD	card_sectors_read;	/* sectors that crossed the bus, read-ahead included */
+	DWORD	card_sectors_written;
+	DWORD	crc_failures;
+	DWORD	timeouts;
+	QWORD	token_wait_us;
+	QWORD	data_us;
+	QWORD	busy_wait_us;
+	DWORD	read_latency[DISK_LATENCY_BUCKETS];
+	DWORD	write_latency[DISK_LATENCY_BUCKETS];
+} DiskTelemetry;
+
+
+/* A file allocated contiguously up front, written a sector at a time
+   straight to the drive without going through FatFs.  See diskio.c. */
+
+typedef struct {
+	FIL		file;
+	BYTE	pdrv;
+	LBA_t	first;			/* first sector of the file */
+	LBA_t	sectors;		/* sectors allocated */
+	LBA_t	written;		/* sectors written so far */
+} DiskStream;
+
+FRESULT disk_stream_create (DiskStream* stream, const TCHAR* path, FSIZE_t size);
+DRESULT disk_stream_write (DiskStream* stream, const BYTE* buff, UINT count);
+FRESULT disk_stream_close (DiskStream* stream, FSIZE_t length);
+
+
 /* Disk Status Bits (DSTATUS) */
 
 #define STA_NOINIT		0x01	/* Drive not initialized */
@@ -65,6 +106,10 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 #define ISDIO_WRITE			56	/* Write data to SD iSDIO register */
 #define ISDIO_MRITE			57	/* Masked write data to SD iSDIO register */
 
+/* Rocinante specific ioctl command */
+#define DISK_GET_TELEMETRY		60	/* Get DiskTelemetry for the drive */
+#define DISK_RESET_TELEMETRY	61	/* Zero the drive's DiskTelemetry */
+
 /* ATA/CF specific ioctl command */
 #define ATA_GET_REV			20	/* Get F/W revision */
 #define ATA_GET_MODEL		21	/* Get model name */
@@ -0,0 +1,56 @@
+/*------------------------------------------------------------------------*/
+/* OS dependent functions for FatFs on Rocinante                          */
+/*------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include "ff.h"
+
+// FatFs runs on both cores, so the LFN work buffer comes from the heap
+// (FF_USE_LFN 3) rather than a single static buffer, and each volume is
+// guarded by a pico mutex (FF_FS_REENTRANT).  diskio.c and the SD request
+// queue do their own locking underneath.
+
+#if FF_USE_LFN == 3
+
+void *ff_memalloc(UINT msize)
+{
+    return malloc(msize);
+}
+
+void ff_memfree(void *mblock)
+{
+    free(mblock);
+}
+
+#endif
+
+#if FF_FS_REENTRANT
+
+static mutex_t gFatFsVolumeMutexes[FF_VOLUMES];
+
+// Called from f_mount.  Returns 1 on success.
+int ff_cre_syncobj(BYTE vol, FF_SYNC_t *sobj)
+{
+    mutex_init(&gFatFsVolumeMutexes[vol]);
+    *sobj = &gFatFsVolumeMutexes[vol];
+    return 1;
+}
+
+int ff_del_syncobj(FF_SYNC_t sobj)
+{
+    return 1;
+}
+
+// Returns 1 once the volume is ours, or 0 after FF_FS_TIMEOUT
+// milliseconds, which FatFs reports as FR_TIMEOUT.
+int ff_req_grant(FF_SYNC_t sobj)
+{
+    return mutex_enter_timeout_ms(sobj, FF_FS_TIMEOUT);
+}
+
+void ff_rel_grant(FF_SYNC_t sobj)
+{
+    mutex_exit(sobj);
+}
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "filename_list.h"
+
+// Offset i is at the end of the arena counting backwards, so the offsets
+// in memory order are the list reversed.  The arena's size is kept a
+// multiple of the offset size so the offsets are aligned.
+
+typedef uint32_t NameOffset;
+
+enum {
+    FILENAME_LIST_INITIAL_SIZE = 1024,
+};
+
+static NameOffset *Offsets(const FilenameList *list)
+{
+    return (NameOffset *)(list->arena + list->size) - list->count;
+}
+
+void FilenameListInit(FilenameList *list)
+{
+    list->arena = NULL;
+    list->size = 0;
+    list->nameBytes = 0;
+    list->count = 0;
+}
+
+void FilenameListFree(FilenameList *list)
+{
+    free(list->arena);
+    FilenameListInit(list);
+}
+
+int FilenameListAdd(FilenameList *list, const char *name)
+{
+    size_t length = strlen(name) + 1;
+    size_t needed = list->nameBytes + length + (list->count + 1) * sizeof(NameOffset);
+
+    if(needed > list->size) {
+        size_t size = list->size ? list->size : FILENAME_LIST_INITIAL_SIZE;
+        while(size < needed) {
+            size *= 2;
+        }
+        char *arena = realloc(list->arena, size);
+        if(arena == NULL) {
+            return 0;
+        }
+        // Move the offsets to the new end.
+        size_t offsetBytes = list->count * sizeof(NameOffset);
+        memmove(arena + size - offsetBytes, arena + list->size - offsetBytes, offsetBytes);
+        list->arena = arena;
+        list->size = size;
+    }
+
+    memcpy(list->arena + list->nameBytes, name, length);
+    list->count++;
+    Offsets(list)[0] = list->nameBytes;
+    list->nameBytes += length;
+    return 1;
+}
+
+const char *FilenameListGet(const FilenameList *list, size_t index)
+{
+    if(index >= list->count) {
+        return NULL;
+    }
+    return list->arena + Offsets(list)[list->count - 1 - index];
+}
+
+static const char *gSortArena;
+
+// Descending, since the offsets are stored reversed.
+static int CompareReversed(const void *a, const void *b)
+{
+    return strcasecmp(gSortArena + *(const NameOffset *)b, gSortArena + *(const NameOffset *)a);
+}
+
+void FilenameListSort(FilenameList *list)
+{
+    gSortArena = list->arena;
+    qsort(Offsets(list), list->count, sizeof(NameOffset), CompareReversed);
+}
+
+size_t FilenameListFind(const FilenameList *list, const char *prefix)
+{
+    size_t length = strlen(prefix);
+    size_t low = 0;
+    size_t high = list->count;
+
+    while(low < high) {
+        size_t middle = low + (high - low) / 2;
+        if(strncasecmp(FilenameListGet(list, middle), prefix, length) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if((low < list->count) && (strncasecmp(FilenameListGet(list, low), prefix, length) == 0)) {
+        return low;
+    }
+    return list->count;
+}
+
+size_t FilenameListPage(const FilenameList *list, size_t first, size_t count, const char **names)
+{
+    size_t filled = 0;
+    while((filled < count) && (first + filled < list->count)) {
+        names[filled] = FilenameListGet(list, first + filled);
+        filled++;
+    }
+    return filled;
+}
@@ -0,0 +1,49 @@
+#ifndef __FILENAME_LIST_H__
+#define __FILENAME_LIST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+// A list of file names packed into one allocation: the names grow up from
+// the start of the arena and their offsets grow down from the end, so a
+// directory of hundreds of names is one block on the heap instead of
+// hundreds of little ones, and FilenameListFree gives it all back at once.
+// Initialize with FilenameListInit or "= {0}".
+
+typedef struct FilenameList {
+    char *arena;
+    size_t size;                        /* Bytes in arena */
+    size_t nameBytes;                   /* Used from the start of arena */
+    size_t count;                       /* Offsets used from the end */
+} FilenameList;
+
+void FilenameListInit(FilenameList *list);
+void FilenameListFree(FilenameList *list);
+
+// Returns 1 on success, 0 if out of memory.
+int FilenameListAdd(FilenameList *list, const char *name);
+
+// NULL if index is out of range.
+const char *FilenameListGet(const FilenameList *list, size_t index);
+
+// Sort by name ignoring case.
+void FilenameListSort(FilenameList *list);
+
+// Index of the first name in a sorted list starting with prefix, ignoring
+// case, or list->count if there isn't one.  The names starting with
+// prefix follow it.
+size_t FilenameListFind(const FilenameList *list, const char *prefix);
+
+// Fill names with up to count names starting at first, for showing a
+// screenful at a time.  Returns how many were filled.
+size_t FilenameListPage(const FilenameList *list, size_t first, size_t count, const char **names);
+
+#ifdef __cplusplus
+};
+#endif /* __cplusplus */
+
+#endif /* __FILENAME_LIST_H__ */
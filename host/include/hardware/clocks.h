@@ -0,0 +1,10 @@
+#ifndef _HOST_HARDWARE_CLOCKS_H
+#define _HOST_HARDWARE_CLOCKS_H
+
+#include <stdint.h>
+
+enum clock_index { clk_gpout0 = 0, clk_ref = 4, clk_sys = 5, clk_peri = 6 };
+
+uint32_t clock_get_hz(enum clock_index clk_index);
+
+#endif /* _HOST_HARDWARE_CLOCKS_H */
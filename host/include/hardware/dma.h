@@ -0,0 +1,49 @@
+#ifndef _HOST_HARDWARE_DMA_H
+#define _HOST_HARDWARE_DMA_H
+
+// Host stand-in for the pico-sdk DMA header.  A transfer between memory
+// and the SPI data register runs synchronously against the SD card model
+// when the channel pair is started, with the sniffer's CRC16 computed on
+// the way through.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef unsigned int uint;
+
+enum dma_channel_transfer_size { DMA_SIZE_8 = 0, DMA_SIZE_16 = 1, DMA_SIZE_32 = 2 };
+
+typedef struct {
+    bool read_increment;
+    bool write_increment;
+    bool sniff_enable;
+    uint dreq;
+} dma_channel_config;
+
+typedef struct {
+    volatile uint32_t ints1;
+    volatile uint32_t sniff_ctrl;
+    volatile uint32_t sniff_data;
+} dma_hw_t;
+
+extern dma_hw_t *dma_hw;
+
+#define DMA_SNIFF_CTRL_CALC_VALUE_CRC16 0x2
+
+int dma_claim_unused_channel(bool required);
+void dma_channel_unclaim(uint channel);
+dma_channel_config dma_channel_get_default_config(uint channel);
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size);
+void channel_config_set_read_increment(dma_channel_config *c, bool incr);
+void channel_config_set_write_increment(dma_channel_config *c, bool incr);
+void channel_config_set_dreq(dma_channel_config *c, uint dreq);
+void channel_config_set_sniff_enable(dma_channel_config *c, bool sniff_enable);
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr, const volatile void *read_addr, uint transfer_count, bool trigger);
+void dma_start_channel_mask(uint32_t chan_mask);
+bool dma_channel_is_busy(uint channel);
+void dma_channel_set_irq1_enabled(uint channel, bool enabled);
+void dma_channel_acknowledge_irq1(uint channel);
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable);
+void dma_sniffer_disable(void);
+
+#endif /* _HOST_HARDWARE_DMA_H */
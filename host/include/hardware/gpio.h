@@ -0,0 +1,10 @@
+#ifndef _HOST_HARDWARE_GPIO_H
+#define _HOST_HARDWARE_GPIO_H
+
+typedef unsigned int uint;
+
+enum gpio_function { GPIO_FUNC_SPI = 1, GPIO_FUNC_PIO0 = 6, GPIO_FUNC_PIO1 = 7 };
+
+void gpio_set_function(uint gpio, enum gpio_function fn);
+
+#endif /* _HOST_HARDWARE_GPIO_H */
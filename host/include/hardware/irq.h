@@ -0,0 +1,13 @@
+#ifndef _HOST_HARDWARE_IRQ_H
+#define _HOST_HARDWARE_IRQ_H
+
+// Host stand-in for the pico-sdk IRQ header.  Nothing interrupts, so
+// there's nothing pending to clear.
+
+typedef unsigned int uint;
+
+enum { DMA_IRQ_0 = 11, DMA_IRQ_1 = 12 };
+
+static inline void irq_clear(uint int_num) {}
+
+#endif /* _HOST_HARDWARE_IRQ_H */
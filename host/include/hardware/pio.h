@@ -0,0 +1,44 @@
+#ifndef _HOST_HARDWARE_PIO_H
+#define _HOST_HARDWARE_PIO_H
+
+// Host stand-in for the pico-sdk PIO header.  There are no state machines,
+// so SDCARD_use_pio_spi() fails and the driver stays on the SPI model.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef unsigned int uint;
+typedef volatile uint8_t io_rw_8;
+
+typedef struct pio_hw {
+    volatile uint32_t txf[4];
+    volatile uint32_t rxf[4];
+    volatile uint32_t input_sync_bypass;
+} pio_hw_t;
+typedef pio_hw_t *PIO;
+
+typedef struct pio_program {
+    const uint16_t *instructions;
+    uint8_t length;
+    int8_t origin;
+} pio_program_t;
+
+extern PIO pio0, pio1;
+
+bool pio_can_add_program(PIO pio, const pio_program_t *program);
+uint pio_add_program(PIO pio, const pio_program_t *program);
+void pio_remove_program(PIO pio, const pio_program_t *program, uint loaded_offset);
+int pio_claim_unused_sm(PIO pio, bool required);
+void pio_sm_unclaim(PIO pio, uint sm);
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx);
+bool pio_sm_is_tx_fifo_full(PIO pio, uint sm);
+bool pio_sm_is_rx_fifo_empty(PIO pio, uint sm);
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled);
+void pio_sm_set_clkdiv_int_frac(PIO pio, uint sm, uint16_t div_int, uint8_t div_frac);
+
+static inline void hw_clear_bits(volatile uint32_t *addr, uint32_t mask)
+{
+    *addr &= ~mask;
+}
+
+#endif /* _HOST_HARDWARE_PIO_H */
@@ -0,0 +1,37 @@
+#ifndef _HOST_HARDWARE_SPI_H
+#define _HOST_HARDWARE_SPI_H
+
+// Host stand-in for the pico-sdk SPI header.  Transfers go to the SD card
+// model in host/sd_card_model.c.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef unsigned int uint;
+
+typedef struct {
+    volatile uint32_t dr;
+} spi_hw_t;
+
+typedef struct spi_inst {
+    spi_hw_t hw;
+    uint baudrate;
+} spi_inst_t;
+
+extern spi_inst_t *spi0;
+
+static inline spi_hw_t *spi_get_hw(spi_inst_t *spi)
+{
+    return &spi->hw;
+}
+
+uint spi_init(spi_inst_t *spi, uint baudrate);
+uint spi_set_baudrate(spi_inst_t *spi, uint baudrate);
+uint spi_get_baudrate(const spi_inst_t *spi);
+uint spi_get_dreq(spi_inst_t *spi, bool is_tx);
+int spi_write_read_blocking(spi_inst_t *spi, const uint8_t *src, uint8_t *dst, size_t len);
+int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len);
+int spi_read_blocking(spi_inst_t *spi, uint8_t repeated_tx_data, uint8_t *dst, size_t len);
+
+#endif /* _HOST_HARDWARE_SPI_H */
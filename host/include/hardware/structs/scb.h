@@ -0,0 +1,21 @@
+#ifndef _HOST_HARDWARE_STRUCTS_SCB_H
+#define _HOST_HARDWARE_STRUCTS_SCB_H
+
+// Host stand-in for the Cortex-M0+ system control block; writes to it
+// change nothing.
+
+#include <stdint.h>
+
+typedef volatile uint32_t io_rw_32;
+
+typedef struct {
+    io_rw_32 scr;
+} armv6m_scb_t;
+
+extern armv6m_scb_t *scb_hw;
+
+#define M0PLUS_SCR_SEVONPEND_BITS 0x00000010
+
+static inline void hw_set_bits(io_rw_32 *addr, uint32_t mask) { *addr |= mask; }
+
+#endif /* _HOST_HARDWARE_STRUCTS_SCB_H */
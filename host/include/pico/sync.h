@@ -0,0 +1,47 @@
+#ifndef _HOST_PICO_SYNC_H
+#define _HOST_PICO_SYNC_H
+
+// Host stand-in for pico/sync.h on pthreads, so a host program can run a
+// second thread in place of core 1.  Events are no-ops; waiting loops
+// yield instead.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+typedef struct { pthread_mutex_t lock; } critical_section_t;
+typedef struct { pthread_mutex_t lock; } mutex_t;
+
+#define auto_init_mutex(name) static mutex_t name = { PTHREAD_MUTEX_INITIALIZER }
+
+static inline void critical_section_init(critical_section_t *crit_sec) { pthread_mutex_init(&crit_sec->lock, NULL); }
+static inline void critical_section_enter_blocking(critical_section_t *crit_sec) { pthread_mutex_lock(&crit_sec->lock); }
+static inline void critical_section_exit(critical_section_t *crit_sec) { pthread_mutex_unlock(&crit_sec->lock); }
+
+static inline void mutex_init(mutex_t *mtx) { pthread_mutex_init(&mtx->lock, NULL); }
+static inline bool mutex_try_enter(mutex_t *mtx, uint32_t *owner_out)
+{
+    return pthread_mutex_trylock(&mtx->lock) == 0;
+}
+static inline void mutex_enter_blocking(mutex_t *mtx) { pthread_mutex_lock(&mtx->lock); }
+static inline bool mutex_enter_timeout_ms(mutex_t *mtx, uint32_t timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return pthread_mutex_timedlock(&mtx->lock, &deadline) == 0;
+}
+static inline void mutex_exit(mutex_t *mtx) { pthread_mutex_unlock(&mtx->lock); }
+
+static inline void __sev(void) {}
+static inline void __wfe(void) { sched_yield(); }
+static inline void tight_loop_contents(void) { sched_yield(); }
+
+#endif /* _HOST_PICO_SYNC_H */
@@ -0,0 +1,34 @@
+#ifndef _HOST_PICO_TIME_H
+#define _HOST_PICO_TIME_H
+
+// Host stand-in for pico/time.h.  Time is whatever clock the SD backend
+// in use keeps (modeled SPI time), so timeouts and benchmarks see the
+// card's timing rather than the host's.
+
+#include <stdint.h>
+
+typedef uint64_t absolute_time_t;
+
+uint64_t HostGetMicros(void);
+
+static inline absolute_time_t get_absolute_time(void)
+{
+    return HostGetMicros();
+}
+
+static inline uint32_t to_ms_since_boot(absolute_time_t t)
+{
+    return (uint32_t)(t / 1000);
+}
+
+static inline uint64_t to_us_since_boot(absolute_time_t t)
+{
+    return t;
+}
+
+static inline uint64_t time_us_64(void)
+{
+    return HostGetMicros();
+}
+
+#endif /* _HOST_PICO_TIME_H */
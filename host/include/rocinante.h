@@ -0,0 +1,12 @@
+#ifndef _HOST_ROCINANTE_H
+#define _HOST_ROCINANTE_H
+
+// The parts of the Rosa platform API the SD driver uses.  On the host they
+// run on the SD card model's clock.
+
+#include <stdint.h>
+
+uint32_t RoGetMillis(void);
+void RoDelayMillis(uint32_t millis);
+
+#endif /* _HOST_ROCINANTE_H */
@@ -0,0 +1,10 @@
+#ifndef _HOST_ROCINANTE_PIO_H
+#define _HOST_ROCINANTE_PIO_H
+
+#include "hardware/pio.h"
+
+extern const pio_program_t sd_spi_program;
+
+void sd_spi_program_init(PIO pio, uint sm, uint offset, uint pin_sck, uint pin_mosi, uint pin_miso, uint16_t clkdiv);
+
+#endif /* _HOST_ROCINANTE_PIO_H */
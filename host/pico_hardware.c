@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <string.h>
+#include "hardware/spi.h"
+#include "hardware/dma.h"
+#include "hardware/structs/scb.h"
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/pio.h"
+#include "rocinante.pio.h"
+#include "rocinante.h"
+#include "sd_card_model.h"
+#include "crc7.h"
+
+// Just enough of the pico-sdk hardware API for sd_spi.c, with spi0 wired
+// to the SD card model.
+
+enum {
+    HOST_CLK_SYS_HZ = 125000000,
+    HOST_DMA_CHANNELS = 12,
+    HOST_DREQ_SPI0_TX = 16,
+    HOST_DREQ_SPI0_RX = 17,
+};
+
+uint32_t clock_get_hz(enum clock_index clk_index)
+{
+    return HOST_CLK_SYS_HZ;
+}
+
+void gpio_set_function(uint gpio, enum gpio_function fn)
+{
+}
+
+// rocinante.c drives the card's CS through a GPIO.
+void spi_enable_cs()
+{
+    SDCARD_model_select(1);
+    RoDelayMillis(1);
+}
+
+void spi_disable_cs()
+{
+    SDCARD_model_select(0);
+    RoDelayMillis(1);
+}
+
+/*--------------------------------------------------------------------------*/
+/* SPI ---------------------------------------------------------------------*/
+
+static spi_inst_t gHostSPI0;
+spi_inst_t *spi0 = &gHostSPI0;
+
+// Same prescale and post-divide search as the pico-sdk.
+uint spi_set_baudrate(spi_inst_t *spi, uint baudrate)
+{
+    uint32_t freq_in = clock_get_hz(clk_peri);
+    uint32_t prescale, postdiv;
+
+    for(prescale = 2; prescale <= 254; prescale += 2) {
+        if(freq_in < (prescale + 2) * 256 * (uint64_t)baudrate) {
+            break;
+        }
+    }
+    for(postdiv = 256; postdiv > 1; --postdiv) {
+        if(freq_in / (prescale * (postdiv - 1)) > baudrate) {
+            break;
+        }
+    }
+    spi->baudrate = freq_in / (prescale * postdiv);
+    SDCARD_model_set_clock(spi->baudrate);
+    return spi->baudrate;
+}
+
+uint spi_init(spi_inst_t *spi, uint baudrate)
+{
+    return spi_set_baudrate(spi, baudrate);
+}
+
+uint spi_get_baudrate(const spi_inst_t *spi)
+{
+    return spi->baudrate;
+}
+
+uint spi_get_dreq(spi_inst_t *spi, bool is_tx)
+{
+    return is_tx ? HOST_DREQ_SPI0_TX : HOST_DREQ_SPI0_RX;
+}
+
+int spi_write_read_blocking(spi_inst_t *spi, const uint8_t *src, uint8_t *dst, size_t len)
+{
+    for(size_t i = 0; i < len; i++) {
+        dst[i] = SDCARD_model_exchange(src[i]);
+    }
+    return len;
+}
+
+int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len)
+{
+    for(size_t i = 0; i < len; i++) {
+        SDCARD_model_exchange(src[i]);
+    }
+    return len;
+}
+
+int spi_read_blocking(spi_inst_t *spi, uint8_t repeated_tx_data, uint8_t *dst, size_t len)
+{
+    for(size_t i = 0; i < len; i++) {
+        dst[i] = SDCARD_model_exchange(repeated_tx_data);
+    }
+    return len;
+}
+
+/*--------------------------------------------------------------------------*/
+/* DMA ---------------------------------------------------------------------*/
+
+// Channels only ever pair memory with the SPI data register, so starting a
+// pair runs the whole exchange at once.
+
+typedef struct HostDMAChannel {
+    int claimed;
+    dma_channel_config config;
+    volatile void *write_addr;
+    const volatile void *read_addr;
+    uint transfer_count;
+} HostDMAChannel;
+
+static HostDMAChannel gHostDMAChannels[HOST_DMA_CHANNELS];
+static dma_hw_t gHostDMA;
+dma_hw_t *dma_hw = &gHostDMA;
+static int gHostSnifferChannel = -1;
+
+int dma_claim_unused_channel(bool required)
+{
+    for(int i = 0; i < HOST_DMA_CHANNELS; i++) {
+        if(!gHostDMAChannels[i].claimed) {
+            gHostDMAChannels[i].claimed = 1;
+            return i;
+        }
+    }
+    if(required) {
+        fprintf(stderr, "dma_claim_unused_channel: no channels left\n");
+    }
+    return -1;
+}
+
+void dma_channel_unclaim(uint channel)
+{
+    gHostDMAChannels[channel].claimed = 0;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel)
+{
+    dma_channel_config c = { .read_increment = true, .write_increment = false, .sniff_enable = false, .dreq = 0x3F };
+    return c;
+}
+
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size)
+{
+}
+
+void channel_config_set_read_increment(dma_channel_config *c, bool incr)
+{
+    c->read_increment = incr;
+}
+
+void channel_config_set_write_increment(dma_channel_config *c, bool incr)
+{
+    c->write_increment = incr;
+}
+
+void channel_config_set_dreq(dma_channel_config *c, uint dreq)
+{
+    c->dreq = dreq;
+}
+
+void channel_config_set_sniff_enable(dma_channel_config *c, bool sniff_enable)
+{
+    c->sniff_enable = sniff_enable;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr, const volatile void *read_addr, uint transfer_count, bool trigger)
+{
+    HostDMAChannel *c = &gHostDMAChannels[channel];
+    c->config = *config;
+    c->write_addr = write_addr;
+    c->read_addr = read_addr;
+    c->transfer_count = transfer_count;
+}
+
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable)
+{
+    gHostSnifferChannel = channel;
+    if(force_channel_enable) {
+        gHostDMAChannels[channel].config.sniff_enable = true;
+    }
+}
+
+void dma_sniffer_disable(void)
+{
+    gHostSnifferChannel = -1;
+}
+
+void dma_start_channel_mask(uint32_t chan_mask)
+{
+    int tx = -1, rx = -1;
+
+    for(int i = 0; i < HOST_DMA_CHANNELS; i++) {
+        if(chan_mask & (1u << i)) {
+            if(gHostDMAChannels[i].config.dreq == HOST_DREQ_SPI0_TX) {
+                tx = i;
+            } else if(gHostDMAChannels[i].config.dreq == HOST_DREQ_SPI0_RX) {
+                rx = i;
+            }
+        }
+    }
+    if((tx < 0) || (rx < 0)) {
+        fprintf(stderr, "dma_start_channel_mask: only SPI transmit and receive pairs are modeled\n");
+        return;
+    }
+
+    HostDMAChannel *t = &gHostDMAChannels[tx];
+    HostDMAChannel *r = &gHostDMAChannels[rx];
+    const volatile uint8_t *src = t->read_addr;
+    volatile uint8_t *dst = r->write_addr;
+    int sniff_tx = (gHostSnifferChannel == tx) && t->config.sniff_enable;
+    int sniff_rx = (gHostSnifferChannel == rx) && r->config.sniff_enable;
+    unsigned short crc = dma_hw->sniff_data;
+
+    for(uint i = 0; i < t->transfer_count; i++) {
+        uint8_t out = *src;
+        uint8_t in = SDCARD_model_exchange(out);
+        *dst = in;
+        if(sniff_tx) {
+            crc = crc_itu_t(crc, &out, 1);
+        } else if(sniff_rx) {
+            crc = crc_itu_t(crc, &in, 1);
+        }
+        if(t->config.read_increment) {
+            src++;
+        }
+        if(r->config.write_increment) {
+            dst++;
+        }
+    }
+    dma_hw->sniff_data = crc;
+}
+
+// Transfers finish before dma_start_channel_mask returns.
+bool dma_channel_is_busy(uint channel)
+{
+    return false;
+}
+
+void dma_channel_set_irq1_enabled(uint channel, bool enabled)
+{
+}
+
+void dma_channel_acknowledge_irq1(uint channel)
+{
+}
+
+static armv6m_scb_t gHostSCB;
+armv6m_scb_t *scb_hw = &gHostSCB;
+
+/*--------------------------------------------------------------------------*/
+/* PIO ---------------------------------------------------------------------*/
+
+// No state machines, so SDCARD_use_pio_spi always declines.
+
+static pio_hw_t gHostPIO[2];
+PIO pio0 = &gHostPIO[0];
+PIO pio1 = &gHostPIO[1];
+
+const pio_program_t sd_spi_program = { NULL, 0, -1 };
+
+bool pio_can_add_program(PIO pio, const pio_program_t *program)
+{
+    return false;
+}
+
+uint pio_add_program(PIO pio, const pio_program_t *program)
+{
+    return 0;
+}
+
+void pio_remove_program(PIO pio, const pio_program_t *program, uint loaded_offset)
+{
+}
+
+int pio_claim_unused_sm(PIO pio, bool required)
+{
+    return -1;
+}
+
+void pio_sm_unclaim(PIO pio, uint sm)
+{
+}
+
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx)
+{
+    return 0;
+}
+
+bool pio_sm_is_tx_fifo_full(PIO pio, uint sm)
+{
+    return true;
+}
+
+bool pio_sm_is_rx_fifo_empty(PIO pio, uint sm)
+{
+    return true;
+}
+
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled)
+{
+}
+
+void pio_sm_set_clkdiv_int_frac(PIO pio, uint sm, uint16_t div_int, uint8_t div_frac)
+{
+}
+
+void sd_spi_program_init(PIO pio, uint sm, uint offset, uint pin_sck, uint pin_mosi, uint pin_miso, uint16_t clkdiv)
+{
+}
@@ -0,0 +1,775 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hardware/spi.h"
+#include "pico/time.h"
+#include "rocinante.h"
+#include "sd_spi.h"
+#include "sd_queue.h"
+#include "sd_image.h"
+#include "sd_card_model.h"
+#include "crc7.h"
+
+// Follows the SPI mode chapter of the SD Physical Layer Simplified
+// Specification closely enough to exercise sd_spi.c: command framing and
+// CRC7, R1/R2/R3/R7 responses, Ncr and Nac gaps, data tokens and CRC16,
+// data response tokens, and DO held low while programming.
+
+enum {
+    SD_MODEL_MAX_PACKET = 1 + SD_BLOCK_SIZE + 2,
+    SD_MODEL_V1_SECTOR_SIZE = 127,          /* erase sector of 128 blocks */
+    SD_MODEL_DEFAULT_SPEED_TRAN = 0x32,     /* 25MHz */
+    SD_MODEL_HIGH_SPEED_TRAN = 0x5A,        /* 50MHz */
+};
+
+enum SDModelState {
+    SD_MODEL_COMMAND,           /* waiting for a command */
+    SD_MODEL_READ_SINGLE,       /* CMD17 packet pending */
+    SD_MODEL_READ_MULTIPLE,     /* CMD18 streaming until CMD12 */
+    SD_MODEL_WRITE_TOKEN,       /* CMD24 or CMD25 waiting for a start token */
+    SD_MODEL_WRITE_DATA,        /* receiving a data packet */
+};
+
+// R1 bits
+enum {
+    R1_IDLE = 0x01,
+    R1_ILLEGAL_COMMAND = 0x04,
+    R1_COMMAND_CRC = 0x08,
+    R1_ERASE_SEQUENCE = 0x10,
+    R1_ADDRESS = 0x20,
+    R1_PARAMETER = 0x40,
+};
+
+static SDCardModelConfig gModelConfig = {
+    .version1 = 0,
+    .high_capacity = 1,
+    .high_speed = 1,
+    .init_ms = 50,
+    .signal_limit_hz = 0,
+    .check_crc = 0,
+    .ncr_bytes = 1,
+    .overwrite_busy_us = 0,
+    .au_size = 9,           /* 4MB allocation units */
+};
+
+static SDCardImageTiming gModelTiming = {
+    .clock_hz = 25000000,   /* unused; the driver sets the clock */
+    .read_latency_us = 100,
+    .write_block_busy_us = 100,
+    .write_busy_us = 250,
+    .erase_busy_us = 2000,
+};
+
+static FILE *gModelImage;
+static unsigned long gModelSectors;
+static unsigned char *gModelTouched;   /* one bit per sector */
+static unsigned char *gModelErased;    /* one bit per sector, erased and not written since */
+
+static uint64_t gModelNanos;
+static unsigned long gModelClockHz = 400000;
+static uint64_t gModelByteNanos = 20000;
+
+static int gModelSelected;
+static int gModelIdle;
+static int gModelInitStarted;
+static uint64_t gModelInitStart;
+static int gModelAppCommand;
+static int gModelHighSpeedMode;
+
+static enum SDModelState gModelState;
+static unsigned long gModelBlock;       /* next block to read or write */
+static uint64_t gModelDataReady;        /* next read packet can start */
+static uint64_t gModelBusyUntil;        /* DO low until then */
+static long gModelEraseFirst = -1;      /* from CMD32 */
+static long gModelEraseLast = -1;       /* from CMD33 */
+
+static unsigned char gModelCommand[6];
+static unsigned int gModelCommandLength;
+
+// Bytes the card will send, ahead of anything else.
+static unsigned char gModelOut[2 * SD_MODEL_MAX_PACKET];
+static unsigned int gModelOutHead;
+static unsigned int gModelOutTail;
+
+static unsigned char gModelPacket[SD_BLOCK_SIZE + 2];
+static unsigned int gModelPacketLength;
+
+static SDCardImageStats gModelStats;
+static uint64_t gModelStatsStart;
+static SDCardModelErrors gModelErrors;
+static uint32_t gModelRandom = 1;
+
+unsigned long SDCARD_model_au_sectors(unsigned int au_size)
+{
+    static const unsigned long megabytes[] = { 12, 16, 24, 32, 64 };
+    if(au_size <= 0xA) {
+        return au_size ? 16UL << au_size : 0;
+    }
+    return megabytes[(au_size - 0xB) & 0x7] * 2048;
+}
+
+void SDCARD_model_configure(const SDCardModelConfig *config)
+{
+    gModelConfig = *config;
+}
+
+void SDCARD_model_get_config(SDCardModelConfig *config)
+{
+    *config = gModelConfig;
+}
+
+void SDCARD_model_get_errors(SDCardModelErrors *errors)
+{
+    *errors = gModelErrors;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Clock -------------------------------------------------------------------*/
+
+uint64_t HostGetMicros(void)
+{
+    return gModelNanos / 1000;
+}
+
+uint32_t RoGetMillis(void)
+{
+    return gModelNanos / 1000000;
+}
+
+void RoDelayMillis(uint32_t millis)
+{
+    gModelNanos += (uint64_t)millis * 1000000;
+}
+
+void SDCARD_model_set_clock(unsigned long hz)
+{
+    gModelClockHz = hz;
+    gModelByteNanos = 8000000000ULL / hz;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Registers ---------------------------------------------------------------*/
+
+static int SDModelBlockAddressed(void)
+{
+    return !gModelConfig.version1 && gModelConfig.high_capacity;
+}
+
+static unsigned long SDModelMaxClock(void)
+{
+    return gModelHighSpeedMode ? 50000000 : 25000000;
+}
+
+static void SDModelCSD(unsigned char *csd)
+{
+    memset(csd, 0, 16);
+    csd[3] = gModelHighSpeedMode ? SD_MODEL_HIGH_SPEED_TRAN : SD_MODEL_DEFAULT_SPEED_TRAN;
+    csd[12] = (2 << 2) | (9 >> 2);          /* R2W_FACTOR, WRITE_BL_LEN 512 */
+    csd[13] = (9 & 0x3) << 6;
+
+    if(SDModelBlockAddressed()) {
+        unsigned long c_size = gModelSectors / 1024 - 1;
+        csd[0] = 0x40;                      /* CSD version 2 */
+        csd[1] = 0x0E;                      /* TAAC, fixed */
+        csd[4] = 0x5B;                      /* CCC 0x5B5, READ_BL_LEN 512 */
+        csd[5] = 0x59;
+        csd[7] = (c_size >> 16) & 0x3F;
+        csd[8] = c_size >> 8;
+        csd[9] = c_size;
+        csd[10] = 0x40 | (SD_MODEL_V1_SECTOR_SIZE >> 1);
+        csd[11] = (SD_MODEL_V1_SECTOR_SIZE & 1) << 7;
+    } else {
+        // Capacity is (C_SIZE + 1) << (C_SIZE_MULT + 2) blocks of 512.
+        unsigned int mult = 0;
+        while((mult < 7) && ((gModelSectors >> (mult + 2)) > 4096)) {
+            mult++;
+        }
+        unsigned long c_size = (gModelSectors >> (mult + 2)) - 1;
+        csd[0] = 0x00;                      /* CSD version 1 */
+        csd[1] = 0x26;
+        csd[4] = 0x5F;                      /* CCC 0x5F5, READ_BL_LEN 512 */
+        csd[5] = 0x59;
+        csd[6] = 0x80 | ((c_size >> 10) & 0x3);
+        csd[7] = c_size >> 2;
+        csd[8] = ((c_size & 0x3) << 6) | 0x2D;
+        csd[9] = 0xB4 | (mult >> 1);
+        csd[10] = ((mult & 1) << 7) | 0x40 | (SD_MODEL_V1_SECTOR_SIZE >> 1);
+        csd[11] = (SD_MODEL_V1_SECTOR_SIZE & 1) << 7;
+    }
+    if(!gModelConfig.high_speed) {
+        csd[4] &= ~0x40;                    /* no class 10 */
+    }
+    csd[15] = ((crc7_generate_bytes(csd, 15) & 0x7F) << 1) | 1;
+}
+
+static void SDModelCID(unsigned char *cid)
+{
+    static const unsigned char fixed[15] = {
+        0x52, 'R', 'O', 'M', 'O', 'D', 'E', 'L', 0x10, 0x00, 0x00, 0x15, 0x01, 0x01, 0x6A,
+    };
+    memcpy(cid, fixed, sizeof(fixed));
+    cid[15] = ((crc7_generate_bytes(cid, 15) & 0x7F) << 1) | 1;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Card --------------------------------------------------------------------*/
+
+static void SDModelSend(const unsigned char *bytes, unsigned int length)
+{
+    if(gModelOutHead == gModelOutTail) {
+        gModelOutHead = gModelOutTail = 0;
+    }
+    if(length > sizeof(gModelOut) - gModelOutTail) {
+        length = sizeof(gModelOut) - gModelOutTail;
+    }
+    memcpy(gModelOut + gModelOutTail, bytes, length);
+    gModelOutTail += length;
+}
+
+static void SDModelSendByte(unsigned char byte)
+{
+    SDModelSend(&byte, 1);
+}
+
+// R1 (and any trailing response bytes) after Ncr.
+static void SDModelRespond(const unsigned char *response, unsigned int length)
+{
+    for(unsigned int i = 0; i < gModelConfig.ncr_bytes; i++) {
+        SDModelSendByte(0xFF);
+    }
+    SDModelSend(response, length);
+}
+
+static void SDModelRespondR1(unsigned char r1)
+{
+    SDModelRespond(&r1, 1);
+}
+
+// Start token, data, and CRC16.  Past the card's clock or the board's
+// signal limit a bit of the data gets flipped after the CRC is computed,
+// the way a misread would look to the host.
+static void SDModelSendData(const unsigned char *data, unsigned int length)
+{
+    unsigned char packet[SD_MODEL_MAX_PACKET];
+    unsigned short crc = crc_itu_t(0, data, length);
+
+    packet[0] = 0xFE;
+    memcpy(packet + 1, data, length);
+    packet[1 + length] = crc >> 8;
+    packet[2 + length] = crc & 0xFF;
+
+    unsigned long limit = SDModelMaxClock();
+    if(gModelConfig.signal_limit_hz && (gModelConfig.signal_limit_hz < limit)) {
+        limit = gModelConfig.signal_limit_hz;
+    }
+    if(gModelClockHz > limit) {
+        gModelRandom ^= gModelRandom << 13;
+        gModelRandom ^= gModelRandom >> 17;
+        gModelRandom ^= gModelRandom << 5;
+        packet[1 + gModelRandom % length] ^= 1 << (gModelRandom >> 16) % 8;
+        gModelErrors.corrupted++;
+    }
+    SDModelSend(packet, length + 3);
+}
+
+static void SDModelTouch(unsigned long sector)
+{
+    if(!(gModelTouched[sector / 8] & (1 << (sector % 8)))) {
+        gModelTouched[sector / 8] |= 1 << (sector % 8);
+        gModelStats.sectors_touched++;
+    }
+}
+
+static void SDModelSendBlock(void)
+{
+    unsigned char block[SD_BLOCK_SIZE];
+
+    if(gModelBlock >= gModelSectors) {
+        // A multiple block read ran off the end; stop sending.
+        gModelState = SD_MODEL_COMMAND;
+        return;
+    }
+    fseek(gModelImage, (long)gModelBlock * SD_BLOCK_SIZE, SEEK_SET);
+    if(fread(block, SD_BLOCK_SIZE, 1, gModelImage) != 1) {
+        memset(block, 0, sizeof(block));
+    }
+    SDModelSendData(block, SD_BLOCK_SIZE);
+    gModelStats.sectors_read++;
+    SDModelTouch(gModelBlock);
+
+    if(gModelState == SD_MODEL_READ_SINGLE) {
+        gModelState = SD_MODEL_COMMAND;
+    } else {
+        gModelBlock++;
+        gModelDataReady = gModelNanos + SD_MODEL_MAX_PACKET * gModelByteNanos +
+            gModelTiming.read_latency_us * 1000;
+    }
+}
+
+static void SDModelReceiveBlock(void)
+{
+    int multiple = gModelCommand[0] == (0x40 | 25);
+    unsigned short crc_theirs = (gModelPacket[SD_BLOCK_SIZE] << 8) | gModelPacket[SD_BLOCK_SIZE + 1];
+
+    if(gModelConfig.check_crc && (crc_itu_t(0, gModelPacket, SD_BLOCK_SIZE) != crc_theirs)) {
+        gModelErrors.data_crc++;
+        SDModelSendByte(0x0B);              /* data rejected, CRC error */
+        gModelState = multiple ? SD_MODEL_WRITE_TOKEN : SD_MODEL_COMMAND;
+        return;
+    }
+
+    uint64_t busy = multiple ? gModelTiming.write_block_busy_us : gModelTiming.write_busy_us;
+    if(gModelErased[gModelBlock / 8] & (1 << (gModelBlock % 8))) {
+        gModelErased[gModelBlock / 8] &= ~(1 << (gModelBlock % 8));
+    } else {
+        busy += gModelConfig.overwrite_busy_us;
+    }
+
+    fseek(gModelImage, (long)gModelBlock * SD_BLOCK_SIZE, SEEK_SET);
+    fwrite(gModelPacket, SD_BLOCK_SIZE, 1, gModelImage);
+    gModelStats.sectors_written++;
+    SDModelTouch(gModelBlock);
+    gModelBlock++;
+
+    SDModelSendByte(0xE5);                  /* data accepted */
+    gModelBusyUntil = gModelNanos + gModelByteNanos + busy * 1000;
+    gModelState = multiple ? SD_MODEL_WRITE_TOKEN : SD_MODEL_COMMAND;
+}
+
+// Block number from a read or write argument, or -1 with the R1 error.
+static long SDModelAddress(unsigned long argument, unsigned char *r1)
+{
+    unsigned long block = argument;
+    if(!SDModelBlockAddressed()) {
+        if(argument % SD_BLOCK_SIZE) {
+            *r1 = R1_ADDRESS;
+            return -1;
+        }
+        block = argument / SD_BLOCK_SIZE;
+    }
+    if(block >= gModelSectors) {
+        *r1 = R1_PARAMETER;
+        return -1;
+    }
+    return block;
+}
+
+// CMD38: the range from CMD32 and CMD33 reads back as zeros, with DO
+// held low for erase_busy_us per allocation unit started.
+static void SDModelErase(unsigned char r1)
+{
+    static const unsigned char zeros[SD_BLOCK_SIZE];
+
+    if((gModelEraseFirst < 0) || (gModelEraseLast < gModelEraseFirst)) {
+        gModelEraseFirst = gModelEraseLast = -1;
+        gModelErrors.illegal++;
+        SDModelRespondR1(r1 | R1_ERASE_SEQUENCE);
+        return;
+    }
+
+    fseek(gModelImage, gModelEraseFirst * SD_BLOCK_SIZE, SEEK_SET);
+    for(long sector = gModelEraseFirst; sector <= gModelEraseLast; sector++) {
+        fwrite(zeros, SD_BLOCK_SIZE, 1, gModelImage);
+        gModelErased[sector / 8] |= 1 << (sector % 8);
+    }
+
+    unsigned long au_sectors = SDCARD_model_au_sectors(gModelConfig.au_size);
+    unsigned long units = 1 + (gModelEraseLast - gModelEraseFirst) / au_sectors;
+    SDModelRespondR1(r1);
+    gModelBusyUntil = gModelNanos + (gModelConfig.ncr_bytes + 2) * gModelByteNanos +
+        units * gModelTiming.erase_busy_us * 1000;
+    gModelEraseFirst = gModelEraseLast = -1;
+}
+
+static void SDModelExecute(void)
+{
+    unsigned int index = gModelCommand[0] & 0x3F;
+    unsigned long argument = ((unsigned long)gModelCommand[1] << 24) | (gModelCommand[2] << 16) |
+        (gModelCommand[3] << 8) | gModelCommand[4];
+    int app = gModelAppCommand;
+    unsigned char r1 = gModelIdle ? R1_IDLE : 0;
+    unsigned char response[8];
+    unsigned char data[64];
+
+    gModelAppCommand = 0;
+    gModelStats.commands[index]++;
+    gModelStats.commands_total++;
+
+    // CMD0 and CMD8 are always checked; the rest only with CRC turned on.
+    int crc_ok = (((crc7_generate_bytes(gModelCommand, 5) & 0x7F) << 1) | 1) == gModelCommand[5];
+    if(!crc_ok && (gModelConfig.check_crc || (index == 0) || (index == 8))) {
+        gModelErrors.command_crc++;
+        SDModelRespondR1(r1 | R1_COMMAND_CRC);
+        return;
+    }
+
+    // Until ACMD41 finishes, only the initialization commands are legal.
+    if(gModelIdle && (index != 0) && (index != 8) && (index != 55) && (index != 58) && (index != 59) &&
+        !(app && (index == 41))) {
+        gModelErrors.illegal++;
+        SDModelRespondR1(r1 | R1_ILLEGAL_COMMAND);
+        return;
+    }
+
+    if(app) {
+        switch(index) {
+            case 13:
+                // R2, then the 64-byte SD status
+                memset(data, 0, sizeof(data));
+                data[10] = gModelConfig.au_size << 4;
+                response[0] = r1;
+                response[1] = 0;
+                SDModelRespond(response, 2);
+                SDModelSendByte(0xFF);
+                SDModelSendData(data, 64);
+                return;
+            case 23:
+                SDModelRespondR1(r1);
+                return;
+            case 41:
+                if(!gModelConfig.version1 && gModelConfig.high_capacity && !(argument & 0x40000000)) {
+                    // SDHC never leaves idle for a host without HCS.
+                    SDModelRespondR1(R1_IDLE);
+                    return;
+                }
+                if(!gModelInitStarted) {
+                    gModelInitStarted = 1;
+                    gModelInitStart = gModelNanos;
+                }
+                if(gModelNanos - gModelInitStart >= (uint64_t)gModelConfig.init_ms * 1000000) {
+                    gModelIdle = 0;
+                }
+                SDModelRespondR1(gModelIdle ? R1_IDLE : 0);
+                return;
+        }
+        // Anything else is taken as the plain command.
+    }
+
+    switch(index) {
+        case 0:
+            gModelIdle = 1;
+            gModelInitStarted = 0;
+            gModelHighSpeedMode = 0;
+            gModelState = SD_MODEL_COMMAND;
+            SDModelRespondR1(R1_IDLE);
+            break;
+
+        case 6: {
+            // Only function group 1 (access mode) is modeled.
+            int mode_switch = (argument >> 31) & 1;
+            unsigned int function = argument & 0xF;
+            unsigned int selected = gModelHighSpeedMode ? 1 : 0;
+            if((function == 1) && gModelConfig.high_speed) {
+                selected = 1;
+                if(mode_switch) {
+                    gModelHighSpeedMode = 1;
+                }
+            } else if((function != 0xF) && (function != 0)) {
+                selected = 0xF;
+            }
+            memset(data, 0, sizeof(data));
+            data[1] = 100;                  /* max current, mA */
+            data[12] = 0x80;
+            data[13] = gModelConfig.high_speed ? 0x03 : 0x01;
+            data[16] = selected;
+            data[17] = 1;
+            SDModelRespondR1(r1);
+            SDModelSendByte(0xFF);
+            SDModelSendData(data, 64);
+            break;
+        }
+
+        case 8:
+            if(gModelConfig.version1) {
+                SDModelRespondR1(r1 | R1_ILLEGAL_COMMAND);
+                break;
+            }
+            response[0] = r1;
+            response[1] = 0;
+            response[2] = 0;
+            response[3] = (argument >> 8) & 0xF;    /* 2.7-3.6V accepted */
+            response[4] = argument & 0xFF;          /* check pattern */
+            SDModelRespond(response, 5);
+            break;
+
+        case 9:
+        case 10:
+            if(index == 9) {
+                SDModelCSD(data);
+            } else {
+                SDModelCID(data);
+            }
+            SDModelRespondR1(r1);
+            SDModelSendByte(0xFF);
+            SDModelSendData(data, 16);
+            break;
+
+        case 12:
+            // The byte after the command is a stuff byte; drop whatever
+            // packet was on its way.
+            gModelOutHead = gModelOutTail = 0;
+            if(gModelState == SD_MODEL_READ_MULTIPLE) {
+                gModelState = SD_MODEL_COMMAND;
+            }
+            SDModelSendByte(0xFF);
+            SDModelRespondR1(r1);
+            break;
+
+        case 13:
+            response[0] = r1;
+            response[1] = 0;
+            SDModelRespond(response, 2);
+            break;
+
+        case 16:
+            SDModelRespondR1(r1 | ((argument == SD_BLOCK_SIZE) ? 0 : R1_PARAMETER));
+            break;
+
+        case 17:
+        case 18:
+        case 24:
+        case 25: {
+            long block = SDModelAddress(argument, &response[0]);
+            if(block < 0) {
+                gModelErrors.range++;
+                SDModelRespondR1(r1 | response[0]);
+                break;
+            }
+            gModelBlock = block;
+            SDModelRespondR1(r1);
+            if((index == 17) || (index == 18)) {
+                gModelState = (index == 17) ? SD_MODEL_READ_SINGLE : SD_MODEL_READ_MULTIPLE;
+                gModelDataReady = gModelNanos + (gModelConfig.ncr_bytes + 1) * gModelByteNanos +
+                    gModelTiming.read_latency_us * 1000;
+            } else {
+                gModelState = SD_MODEL_WRITE_TOKEN;
+            }
+            break;
+        }
+
+        case 32:
+        case 33: {
+            long block = SDModelAddress(argument, &response[0]);
+            if(block < 0) {
+                gModelErrors.range++;
+                SDModelRespondR1(r1 | response[0]);
+                break;
+            }
+            if(index == 32) {
+                gModelEraseFirst = block;
+                gModelEraseLast = -1;
+            } else {
+                gModelEraseLast = block;
+            }
+            SDModelRespondR1(r1);
+            break;
+        }
+
+        case 38:
+            SDModelErase(r1);
+            break;
+
+        case 55:
+            gModelAppCommand = 1;
+            SDModelRespondR1(r1);
+            break;
+
+        case 58: {
+            unsigned long ocr = 0x00FF8000;
+            if(!gModelIdle) {
+                ocr |= 0x80000000;
+                if(SDModelBlockAddressed()) {
+                    ocr |= 0x40000000;
+                }
+            }
+            response[0] = r1;
+            response[1] = ocr >> 24;
+            response[2] = ocr >> 16;
+            response[3] = ocr >> 8;
+            response[4] = ocr;
+            SDModelRespond(response, 5);
+            break;
+        }
+
+        case 59:
+            gModelConfig.check_crc = argument & 1;
+            SDModelRespondR1(r1);
+            break;
+
+        default:
+            gModelErrors.illegal++;
+            SDModelRespondR1(r1 | R1_ILLEGAL_COMMAND);
+            break;
+    }
+}
+
+static unsigned char SDModelOutput(void)
+{
+    if(gModelOutHead != gModelOutTail) {
+        return gModelOut[gModelOutHead++];
+    }
+    if(gModelNanos < gModelBusyUntil) {
+        return 0x00;
+    }
+    if(((gModelState == SD_MODEL_READ_SINGLE) || (gModelState == SD_MODEL_READ_MULTIPLE)) &&
+        (gModelNanos >= gModelDataReady)) {
+        SDModelSendBlock();
+        if(gModelOutHead != gModelOutTail) {
+            return gModelOut[gModelOutHead++];
+        }
+    }
+    return 0xFF;
+}
+
+static void SDModelInput(unsigned char mosi)
+{
+    switch(gModelState) {
+        case SD_MODEL_WRITE_TOKEN:
+            if(gModelNanos < gModelBusyUntil) {
+                return;
+            }
+            if(mosi == ((gModelCommand[0] == (0x40 | 25)) ? 0xFC : 0xFE)) {
+                gModelState = SD_MODEL_WRITE_DATA;
+                gModelPacketLength = 0;
+            } else if((mosi == 0xFD) && (gModelCommand[0] == (0x40 | 25))) {
+                // Stop token: one more byte, then busy while programming.
+                gModelState = SD_MODEL_COMMAND;
+                gModelBusyUntil = gModelNanos + gModelByteNanos + gModelTiming.write_busy_us * 1000;
+            }
+            return;
+
+        case SD_MODEL_WRITE_DATA:
+            gModelPacket[gModelPacketLength++] = mosi;
+            if(gModelPacketLength == sizeof(gModelPacket)) {
+                SDModelReceiveBlock();
+            }
+            return;
+
+        default:
+            break;
+    }
+
+    if(gModelNanos < gModelBusyUntil) {
+        return;
+    }
+    if((gModelCommandLength == 0) && ((mosi & 0xC0) != 0x40)) {
+        return;
+    }
+    gModelCommand[gModelCommandLength++] = mosi;
+    if(gModelCommandLength == sizeof(gModelCommand)) {
+        gModelCommandLength = 0;
+        SDModelExecute();
+    }
+}
+
+void SDCARD_model_select(int selected)
+{
+    gModelSelected = selected;
+    gModelCommandLength = 0;
+}
+
+// The card decides what to send before it has seen the byte coming in.
+unsigned char SDCARD_model_exchange(unsigned char mosi)
+{
+    if(!gModelSelected || (gModelImage == NULL)) {
+        gModelNanos += gModelByteNanos;
+        return 0xFF;
+    }
+    unsigned char miso = SDModelOutput();
+    gModelNanos += gModelByteNanos;
+    SDModelInput(mosi);
+    return miso;
+}
+
+/*--------------------------------------------------------------------------*/
+/* sd_image.h --------------------------------------------------------------*/
+
+int SDCARD_image_open(const char *path)
+{
+    gModelImage = fopen(path, "r+b");
+    if(gModelImage == NULL) {
+        perror(path);
+        return 0;
+    }
+    fseek(gModelImage, 0, SEEK_END);
+    gModelSectors = ftell(gModelImage) / SD_BLOCK_SIZE;
+    gModelTouched = calloc((gModelSectors + 7) / 8, 1);
+    gModelErased = calloc((gModelSectors + 7) / 8, 1);
+
+    // Power on.
+    gModelIdle = 1;
+    gModelInitStarted = 0;
+    gModelAppCommand = 0;
+    gModelHighSpeedMode = 0;
+    gModelState = SD_MODEL_COMMAND;
+    gModelBusyUntil = 0;
+    gModelEraseFirst = gModelEraseLast = -1;
+    gModelOutHead = gModelOutTail = 0;
+    gModelCommandLength = 0;
+    memset(&gModelErrors, 0, sizeof(gModelErrors));
+
+    // Bring the card up the way rocinante.c does.
+    uint64_t started = gModelNanos;
+    spi_init(spi0, 400000);
+    if(!SDCARD_init(spi0)) {
+        printf("%s: SDCARD_init failed\n", path);
+        SDCARD_image_close();
+        return 0;
+    }
+    SDCARD_enable_dma();
+    SDCARD_queue_init(spi0);
+    printf("%s: card up in %.1f ms, SPI clock %u Hz\n", path,
+        (gModelNanos - started) / 1000000.0, SDCARD_get_clock());
+
+    SDCARD_image_reset_stats();
+    return 1;
+}
+
+void SDCARD_image_close(void)
+{
+    if(gModelImage) {
+        SDCARD_wait_ready(spi0);
+        fclose(gModelImage);
+        gModelImage = NULL;
+    }
+    free(gModelTouched);
+    gModelTouched = NULL;
+    free(gModelErased);
+    gModelErased = NULL;
+}
+
+void SDCARD_image_set_timing(const SDCardImageTiming *timing)
+{
+    gModelTiming = *timing;
+}
+
+void SDCARD_image_get_stats(SDCardImageStats *stats)
+{
+    *stats = gModelStats;
+    stats->spi_time_us = (gModelNanos - gModelStatsStart) / 1000;
+}
+
+void SDCARD_image_reset_stats(void)
+{
+    memset(&gModelStats, 0, sizeof(gModelStats));
+    gModelStatsStart = gModelNanos;
+    if(gModelTouched) {
+        memset(gModelTouched, 0, (gModelSectors + 7) / 8);
+    }
+}
+
+void SDCARD_image_print_stats(const char *label)
+{
+    SDCardImageStats stats;
+
+    SDCARD_image_get_stats(&stats);
+    printf("%s: %lu commands (%lu CMD17, %lu CMD18, %lu CMD24, %lu CMD25), %lu sectors read, %lu written, %lu touched, %.1f ms SPI time\n",
+        label, stats.commands_total, stats.commands[17], stats.commands[18],
+        stats.commands[24], stats.commands[25], stats.sectors_read,
+        stats.sectors_written, stats.sectors_touched, stats.spi_time_us / 1000.0);
+    if(gModelErrors.command_crc || gModelErrors.data_crc || gModelErrors.illegal || gModelErrors.range || gModelErrors.corrupted) {
+        printf("%s: card saw %lu command CRC errors, %lu data CRC errors, %lu illegal commands, %lu out of range, sent %lu corrupted packets\n",
+            label, gModelErrors.command_crc, gModelErrors.data_crc, gModelErrors.illegal,
+            gModelErrors.range, gModelErrors.corrupted);
+    }
+}
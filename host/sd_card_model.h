@@ -0,0 +1,60 @@
+#ifndef __SD_CARD_MODEL_H__
+#define __SD_CARD_MODEL_H__
+
+#include <stdint.h>
+
+// Byte-level model of an SD card in SPI mode, backed by a raw image file.
+// The host shims for hardware/spi.h and hardware/dma.h feed every byte the
+// driver clocks through SDCARD_model_exchange, so the real sd_spi.c and
+// sd_queue.c run against it unchanged.
+//
+// The model keeps its own clock: every byte costs 8 SPI clocks at the
+// current baud rate, and latency and busy periods come from
+// SDCardImageTiming (sd_image.h).  RoGetMillis, RoDelayMillis and
+// pico/time.h all run on that clock, so timeouts and benchmarks see SPI
+// time only; host CPU time is free.
+//
+// Every sector starts out written, as on a well-used card.  Writing a
+// sector again costs overwrite_busy_us on top of the usual programming
+// time, standing in for the card's garbage collection; CMD38 erases the
+// range and spares its sectors that cost until they are written again.
+//
+// The model also provides the sd_image.h API.  SDCARD_image_open brings the
+// card up with SDCARD_init and starts the request queue, so programs
+// written against the image stand-in run on the real driver as well.
+
+typedef struct SDCardModelConfig {
+    int version1;                   /* predates CMD8, always byte addressed */
+    int high_capacity;              /* SDHC: block addressing, CSD version 2 */
+    int high_speed;                 /* supports the CMD6 switch to 50MHz */
+    unsigned long init_ms;          /* ACMD41 reports idle for this long */
+    unsigned long signal_limit_hz;  /* board limit; faster reads get bit errors, 0 for none */
+    int check_crc;                  /* as if CMD59 turned CRC checking on */
+    unsigned int ncr_bytes;         /* 0xFF bytes before each response */
+    unsigned long overwrite_busy_us; /* extra programming for a sector not erased since it was written */
+    unsigned int au_size;           /* AU_SIZE in the SD status, 0xB and up for SDXC sizes */
+} SDCardModelConfig;
+
+// Allocation unit in sectors for an AU_SIZE, 0 for 0 (not defined).
+unsigned long SDCARD_model_au_sectors(unsigned int au_size);
+
+typedef struct SDCardModelErrors {
+    unsigned long command_crc;      /* bad command CRC7 */
+    unsigned long data_crc;         /* bad write CRC16, counted only with check_crc */
+    unsigned long illegal;          /* unknown command or command out of sequence */
+    unsigned long range;            /* address past the end of the image */
+    unsigned long corrupted;        /* blocks sent with bit errors */
+} SDCardModelErrors;
+
+// Takes effect at the next SDCARD_image_open.
+void SDCARD_model_configure(const SDCardModelConfig *config);
+void SDCARD_model_get_config(SDCardModelConfig *config);
+
+void SDCARD_model_get_errors(SDCardModelErrors *errors);
+
+// Card side of the bus, for the hardware shims.
+void SDCARD_model_select(int selected);
+void SDCARD_model_set_clock(unsigned long hz);
+unsigned char SDCARD_model_exchange(unsigned char mosi);
+
+#endif /* __SD_CARD_MODEL_H__ */
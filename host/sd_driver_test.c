@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sd_spi.h"
+#include "sd_image.h"
+#include "sd_card_model.h"
+
+// Runs the real sd_spi.c against the SD card model: brings up each kind
+// of card, writes, erases, and reads back random runs with every write
+// path, with and without DMA, and then runs the sd_bench.c write
+// benchmarks.  Exits
+// non-zero if anything doesn't read back.
+//
+//   sd_driver_test [scratch image]
+
+extern void BenchmarkSDWrites(spi_inst_t *spi);
+extern void BenchmarkSDWriteLatency(spi_inst_t *spi);
+extern void BenchmarkSDErase(spi_inst_t *spi);
+
+enum {
+    TEST_IMAGE_MEGABYTES = 64,
+    TEST_REGION_SECTORS = 2048,
+    TEST_MAX_RUN = 32,
+    TEST_OPERATIONS = 300,
+};
+
+static uint32_t gRandomState = 1;
+
+static uint32_t Random(void)
+{
+    gRandomState ^= gRandomState << 13;
+    gRandomState ^= gRandomState >> 17;
+    gRandomState ^= gRandomState << 5;
+    return gRandomState;
+}
+
+static unsigned char *gShadow;      /* expected contents of the test region */
+
+static int CreateImage(const char *path)
+{
+    unsigned long size = TEST_IMAGE_MEGABYTES * 1024UL * 1024UL;
+
+    FILE *image = fopen(path, "wb");
+    if(image == NULL) {
+        perror(path);
+        return 0;
+    }
+    for(unsigned long i = 0; i < (unsigned long)TEST_REGION_SECTORS * SD_BLOCK_SIZE; i++) {
+        gShadow[i] = Random();
+    }
+    fwrite(gShadow, SD_BLOCK_SIZE, TEST_REGION_SECTORS, image);
+    fseek(image, size - 1, SEEK_SET);
+    fputc(0, image);
+    fclose(image);
+    return 1;
+}
+
+// Random single, multiple, and list writes and erases, each followed by a
+// read of a random run, checking everything against the shadow copy.
+static int Exercise(void)
+{
+    static unsigned char blocks[TEST_MAX_RUN * SD_BLOCK_SIZE];
+    const unsigned char *list[TEST_MAX_RUN];
+
+    for(int op = 0; op < TEST_OPERATIONS; op++) {
+        unsigned int count = 1 + Random() % TEST_MAX_RUN;
+        unsigned int blocknum = Random() % (TEST_REGION_SECTORS - count);
+        int kind = Random() % 4;
+
+        if(kind == 0) {
+            count = 1;
+        }
+        for(unsigned int i = 0; i < count * SD_BLOCK_SIZE; i++) {
+            blocks[i] = Random();
+        }
+
+        int success;
+        if(kind == 0) {
+            success = SDCARD_writeblock(spi0, blocknum, blocks);
+        } else if(kind == 1) {
+            success = SDCARD_writeblocks(spi0, blocknum, blocks, count);
+        } else if(kind == 2) {
+            // back to front in memory, so adjacency can't be assumed
+            for(unsigned int i = 0; i < count; i++) {
+                list[i] = blocks + SD_BLOCK_SIZE * (count - 1 - i);
+            }
+            success = SDCARD_writeblock_list(spi0, blocknum, list, count);
+        } else {
+            // the model's erased sectors read back as zeros
+            memset(blocks, 0, count * SD_BLOCK_SIZE);
+            success = SDCARD_erase(spi0, blocknum, blocknum + count - 1);
+        }
+        if(!success) {
+            printf("%s of %u at %u failed\n", (kind == 3) ? "erase" : "write", count, blocknum);
+            return 0;
+        }
+        for(unsigned int i = 0; i < count; i++) {
+            const unsigned char *block = (kind == 2) ? list[i] : blocks + SD_BLOCK_SIZE * i;
+            memcpy(gShadow + (size_t)(blocknum + i) * SD_BLOCK_SIZE, block, SD_BLOCK_SIZE);
+        }
+
+        count = 1 + Random() % TEST_MAX_RUN;
+        blocknum = Random() % (TEST_REGION_SECTORS - count);
+        if(!SDCARD_readblocks(spi0, blocknum, blocks, count)) {
+            printf("read of %u at %u failed\n", count, blocknum);
+            return 0;
+        }
+        if(memcmp(blocks, gShadow + (size_t)blocknum * SD_BLOCK_SIZE, count * SD_BLOCK_SIZE) != 0) {
+            printf("read of %u at %u doesn't match what was written\n", count, blocknum);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The image itself, once closed, has to hold what the driver wrote.
+static int CheckImage(const char *path)
+{
+    static unsigned char block[SD_BLOCK_SIZE];
+
+    FILE *image = fopen(path, "rb");
+    if(image == NULL) {
+        perror(path);
+        return 0;
+    }
+    for(unsigned int i = 0; i < TEST_REGION_SECTORS; i++) {
+        if((fread(block, SD_BLOCK_SIZE, 1, image) != 1) ||
+            (memcmp(block, gShadow + (size_t)i * SD_BLOCK_SIZE, SD_BLOCK_SIZE) != 0)) {
+            printf("image sector %u doesn't match\n", i);
+            fclose(image);
+            return 0;
+        }
+    }
+    fclose(image);
+    return 1;
+}
+
+static int RunCard(const char *path, const char *label, const SDCardModelConfig *config, int dma)
+{
+    SDCardModelErrors errors;
+
+    printf("--- %s, %s\n", label, dma ? "DMA" : "no DMA");
+    SDCARD_model_configure(config);
+    if(!CreateImage(path) || !SDCARD_image_open(path)) {
+        return 0;
+    }
+    if(!dma) {
+        SDCARD_disable_dma();
+    }
+
+    int expected_type = config->version1 ? SD_CARD_TYPE_SD1 :
+        (SD_CARD_TYPE_SD2 | (config->high_capacity ? SD_CARD_TYPE_BLOCK : 0));
+    int success = 1;
+    if(SDCARD_get_type() != expected_type) {
+        printf("card type 0x%02X, expected 0x%02X\n", SDCARD_get_type(), expected_type);
+        success = 0;
+    }
+    if(SDCARD_get_sector_count() != TEST_IMAGE_MEGABYTES * 2048UL) {
+        printf("card reports %lu sectors, expected %lu\n", SDCARD_get_sector_count(), TEST_IMAGE_MEGABYTES * 2048UL);
+        success = 0;
+    }
+    unsigned long erase_block = SDCARD_get_erase_block_sectors();
+    if(!config->version1 && (erase_block != SDCARD_model_au_sectors(config->au_size))) {
+        printf("erase block of %lu sectors, expected %lu\n", erase_block, SDCARD_model_au_sectors(config->au_size));
+        success = 0;
+    }
+    if(config->signal_limit_hz && (SDCARD_get_clock() > config->signal_limit_hz)) {
+        printf("clock %u Hz is over the %lu Hz signal limit\n", SDCARD_get_clock(), config->signal_limit_hz);
+        success = 0;
+    }
+
+    success = success && Exercise();
+    SDCARD_image_print_stats(label);
+
+    SDCARD_model_get_errors(&errors);
+    if(errors.command_crc || errors.data_crc || errors.range) {
+        success = 0;
+    }
+
+    if(success) {
+        BenchmarkSDWrites(spi0);
+        BenchmarkSDWriteLatency(spi0);
+        BenchmarkSDErase(spi0);
+    }
+
+    SDCARD_image_close();
+    success = success && CheckImage(path);
+    printf("%s\n", success ? "PASS" : "FAIL");
+    return success;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : "sd_driver_test.img";
+
+    gShadow = malloc((size_t)TEST_REGION_SECTORS * SD_BLOCK_SIZE);
+    if(gShadow == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    SDCardModelConfig sdhc;
+    SDCARD_model_get_config(&sdhc);
+
+    SDCardModelConfig strict = sdhc;
+    strict.check_crc = 1;
+
+    SDCardModelConfig sdsc = sdhc;
+    sdsc.high_capacity = 0;
+
+    SDCardModelConfig v1 = sdhc;
+    v1.version1 = 1;
+    v1.high_speed = 0;
+
+    SDCardModelConfig limited = sdhc;
+    limited.signal_limit_hz = 30000000;
+
+    SDCardModelConfig used = sdhc;
+    used.overwrite_busy_us = 1500;
+
+    SDCardModelConfig sdxc = sdhc;
+    sdxc.au_size = 0xB;                 /* 12MB, not a power of two */
+
+    int failures = 0;
+    failures += !RunCard(path, "SDHC", &sdhc, 1);
+    failures += !RunCard(path, "SDHC", &sdhc, 0);
+    failures += !RunCard(path, "SDHC, CRC checked", &strict, 1);
+    failures += !RunCard(path, "SDSC", &sdsc, 1);
+    failures += !RunCard(path, "SD version 1", &v1, 0);
+    failures += !RunCard(path, "SDHC, 30MHz board", &limited, 1);
+    failures += !RunCard(path, "SDHC, well used", &used, 1);
+    failures += !RunCard(path, "SDXC allocation unit", &sdxc, 1);
+
+    remove(path);
+    free(gShadow);
+    printf("%d failures\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "sd_spi.h"
+#include "sd_queue.h"
+#include "sd_image.h"
+#include "pico/time.h"
+
+// The device gets these from sd_spi.c.
+
+enum DebugLevels {
+    DEBUG_SILENT = 0,
+    DEBUG_ERRORS,
+    DEBUG_WARNINGS,
+    DEBUG_EVENTS,
+    DEBUG_DATA,
+    DEBUG_ALL,
+    DEBUG_INSANE = 99,
+};
+int gDebugLevel = DEBUG_WARNINGS;
+
+void logprintf(int level, char *fmt, ...)
+{
+    va_list args;
+
+    if(level > gDebugLevel)
+        return;
+
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+/*--------------------------------------------------------------------------*/
+/* Image file --------------------------------------------------------------*/
+
+static FILE *gSDImage;
+static unsigned long gSDImageSectors;
+static unsigned char *gSDImageTouched;  /* one bit per sector */
+
+static SDCardImageTiming gSDImageTiming = {
+    .clock_hz = 25000000,
+    .read_latency_us = 100,
+    .write_block_busy_us = 100,
+    .write_busy_us = 250,
+    .erase_busy_us = 2000,
+};
+
+static SDCardImageStats gSDImageStats;
+static SDCardTelemetry gSDImageTelemetry;
+static uint64_t gSDImageMicros;        /* modeled, since start */
+
+// pico/time.h runs on modeled SPI time.
+uint64_t HostGetMicros(void)
+{
+    return gSDImageMicros;
+}
+
+int SDCARD_image_open(const char *path)
+{
+    gSDImage = fopen(path, "r+b");
+    if(gSDImage == NULL) {
+        perror(path);
+        return 0;
+    }
+    fseek(gSDImage, 0, SEEK_END);
+    gSDImageSectors = ftell(gSDImage) / SD_BLOCK_SIZE;
+    gSDImageTouched = calloc((gSDImageSectors + 7) / 8, 1);
+    SDCARD_image_reset_stats();
+    return 1;
+}
+
+void SDCARD_image_close(void)
+{
+    if(gSDImage) {
+        fclose(gSDImage);
+        gSDImage = NULL;
+    }
+    free(gSDImageTouched);
+    gSDImageTouched = NULL;
+}
+
+void SDCARD_image_set_timing(const SDCardImageTiming *timing)
+{
+    gSDImageTiming = *timing;
+}
+
+void SDCARD_image_get_stats(SDCardImageStats *stats)
+{
+    *stats = gSDImageStats;
+}
+
+void SDCARD_image_reset_stats(void)
+{
+    memset(&gSDImageStats, 0, sizeof(gSDImageStats));
+    if(gSDImageTouched) {
+        memset(gSDImageTouched, 0, (gSDImageSectors + 7) / 8);
+    }
+}
+
+void SDCARD_image_print_stats(const char *label)
+{
+    printf("%s: %lu commands (%lu CMD17, %lu CMD18, %lu CMD24, %lu CMD25), %lu sectors read, %lu written, %lu touched, %.1f ms modeled SPI time\n",
+        label, gSDImageStats.commands_total, gSDImageStats.commands[17], gSDImageStats.commands[18],
+        gSDImageStats.commands[24], gSDImageStats.commands[25], gSDImageStats.sectors_read,
+        gSDImageStats.sectors_written, gSDImageStats.sectors_touched, gSDImageStats.spi_time_us / 1000.0);
+}
+
+// Microseconds to move "bytes" over SPI.
+static uint64_t SDImageBytes(unsigned long bytes)
+{
+    return (uint64_t)bytes * 8 * 1000000 / gSDImageTiming.clock_hz;
+}
+
+static void SDImageCharge(uint64_t micros)
+{
+    gSDImageStats.spi_time_us += micros;
+    gSDImageMicros += micros;
+}
+
+// Command frame, a couple of bytes of NCR and the R1 response.
+static void SDImageCommand(int index)
+{
+    gSDImageStats.commands[index]++;
+    gSDImageStats.commands_total++;
+    gSDImageTelemetry.commands++;
+    SDImageCharge(SDImageBytes(6 + 2 + 1));
+}
+
+static void SDImageTouch(unsigned int blocknum, unsigned int count)
+{
+    for(unsigned int i = 0; i < count; i++) {
+        unsigned long sector = blocknum + i;
+        if(!(gSDImageTouched[sector / 8] & (1 << (sector % 8)))) {
+            gSDImageTouched[sector / 8] |= 1 << (sector % 8);
+            gSDImageStats.sectors_touched++;
+        }
+    }
+}
+
+static int SDImageRead(unsigned int blocknum, unsigned char *blocks, unsigned int count)
+{
+    if((gSDImage == NULL) || (blocknum >= gSDImageSectors) || (count > gSDImageSectors - blocknum)) {
+        return 0;
+    }
+
+    SDImageCommand(count == 1 ? 17 : 18);
+    SDImageCharge(count * (gSDImageTiming.read_latency_us + SDImageBytes(1 + SD_BLOCK_SIZE + 2)));
+    gSDImageTelemetry.token_wait_us += count * gSDImageTiming.read_latency_us;
+    gSDImageTelemetry.data_us += count * SDImageBytes(SD_BLOCK_SIZE + 2);
+    gSDImageTelemetry.sectors_read += count;
+    if(count > 1) {
+        SDImageCommand(12);
+        SDImageCharge(SDImageBytes(1));
+    }
+    gSDImageStats.sectors_read += count;
+    SDImageTouch(blocknum, count);
+
+    fseek(gSDImage, (long)blocknum * SD_BLOCK_SIZE, SEEK_SET);
+    return fread(blocks, SD_BLOCK_SIZE, count, gSDImage) == count;
+}
+
+// Block i comes from block_list[i] if block_list isn't NULL, else from
+// blocks + SD_BLOCK_SIZE * i, as in sd_spi.c.
+static int SDImageWrite(unsigned int blocknum, const unsigned char *blocks, const unsigned char *const *block_list, unsigned int count)
+{
+    if((gSDImage == NULL) || (blocknum >= gSDImageSectors) || (count > gSDImageSectors - blocknum)) {
+        return 0;
+    }
+
+    if(count == 1) {
+        SDImageCommand(24);
+        SDImageCharge(SDImageBytes(1 + 1 + SD_BLOCK_SIZE + 2 + 1) + gSDImageTiming.write_busy_us);
+    } else {
+        SDImageCommand(55);
+        SDImageCommand(23);
+        SDImageCommand(25);
+        SDImageCharge(SDImageBytes(1) +
+            count * SDImageBytes(1 + SD_BLOCK_SIZE + 2 + 1) +
+            (count - 1) * gSDImageTiming.write_block_busy_us +
+            SDImageBytes(2) + gSDImageTiming.write_busy_us);
+    }
+    gSDImageStats.sectors_written += count;
+    gSDImageTelemetry.data_us += count * SDImageBytes(SD_BLOCK_SIZE + 2);
+    gSDImageTelemetry.busy_wait_us += (count - 1) * gSDImageTiming.write_block_busy_us + gSDImageTiming.write_busy_us;
+    gSDImageTelemetry.sectors_written += count;
+    SDImageTouch(blocknum, count);
+
+    fseek(gSDImage, (long)blocknum * SD_BLOCK_SIZE, SEEK_SET);
+    for(unsigned int i = 0; i < count; i++) {
+        const unsigned char *block = block_list ? block_list[i] : (blocks + SD_BLOCK_SIZE * i);
+        if(fwrite(block, SD_BLOCK_SIZE, 1, gSDImage) != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Erased sectors read back as zeros, as on most cards.
+static int SDImageErase(unsigned int blocknum, unsigned int count)
+{
+    static const unsigned char zeros[SD_BLOCK_SIZE];
+
+    if((gSDImage == NULL) || (count == 0) || (blocknum >= gSDImageSectors) || (count > gSDImageSectors - blocknum)) {
+        return 0;
+    }
+
+    SDImageCommand(32);
+    SDImageCommand(33);
+    SDImageCommand(38);
+    uint64_t busy = (uint64_t)(1 + (count - 1) / SDCARD_get_erase_block_sectors()) * gSDImageTiming.erase_busy_us;
+    SDImageCharge(busy);
+    gSDImageTelemetry.busy_wait_us += busy;
+
+    fseek(gSDImage, (long)blocknum * SD_BLOCK_SIZE, SEEK_SET);
+    for(unsigned int i = 0; i < count; i++) {
+        if(fwrite(zeros, SD_BLOCK_SIZE, 1, gSDImage) != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------------*/
+/* sd_spi.h ----------------------------------------------------------------*/
+
+// Card-wide values diskio.c asks for; the image looks like a block
+// addressed SDHC card with 4MB allocation units.
+
+static unsigned char gSDImageRegister[16];
+
+int SDCARD_get_type(void)
+{
+    return SD_CARD_TYPE_SD2 | SD_CARD_TYPE_BLOCK;
+}
+
+unsigned long SDCARD_get_ocr(void)
+{
+    return 0xC0FF8000;
+}
+
+const unsigned char *SDCARD_get_csd(void)
+{
+    return gSDImageRegister;
+}
+
+const unsigned char *SDCARD_get_cid(void)
+{
+    return gSDImageRegister;
+}
+
+unsigned long SDCARD_get_sector_count(void)
+{
+    return gSDImageSectors;
+}
+
+unsigned long SDCARD_get_erase_block_sectors(void)
+{
+    return 8192;
+}
+
+void SDCARD_get_telemetry(SDCardTelemetry *telemetry)
+{
+    *telemetry = gSDImageTelemetry;
+}
+
+void SDCARD_reset_telemetry(void)
+{
+    memset(&gSDImageTelemetry, 0, sizeof(gSDImageTelemetry));
+}
+
+/*--------------------------------------------------------------------------*/
+/* sd_queue.h --------------------------------------------------------------*/
+
+// There's no second core, so requests run as soon as they are submitted.
+
+void SDCARD_queue_init(spi_inst_t *spi)
+{
+}
+
+int SDCARD_submit(SDCardRequest *request)
+{
+    if((request->state == SD_REQUEST_QUEUED) || (request->state == SD_REQUEST_ACTIVE)) {
+        return 0;
+    }
+
+    int success;
+    if(request->operation == SD_REQUEST_READ) {
+        success = SDImageRead(request->blocknum, request->buffer, request->count);
+    } else if(request->operation == SD_REQUEST_WRITE_LIST) {
+        success = SDImageWrite(request->blocknum, NULL, request->buffers, request->count);
+    } else if(request->operation == SD_REQUEST_ERASE) {
+        success = SDImageErase(request->blocknum, request->count);
+    } else {
+        success = SDImageWrite(request->blocknum, request->buffer, NULL, request->count);
+    }
+    request->state = success ? SD_REQUEST_SUCCEEDED : SD_REQUEST_FAILED;
+    if(request->callback) {
+        request->callback(request);
+    }
+    return 1;
+}
+
+int SDCARD_request_done(const SDCardRequest *request)
+{
+    return (request->state == SD_REQUEST_SUCCEEDED) || (request->state == SD_REQUEST_FAILED);
+}
+
+int SDCARD_wait(SDCardRequest *request)
+{
+    return request->state == SD_REQUEST_SUCCEEDED;
+}
+
+int SDCARD_service_queue(void)
+{
+    return 0;
+}
+
+int SDCARD_queue_card_busy(void)
+{
+    return 0;
+}
+
+int SDCARD_queue_readblocks(unsigned int blocknum, unsigned char *blocks, unsigned int count)
+{
+    return SDImageRead(blocknum, blocks, count);
+}
+
+int SDCARD_queue_writeblocks(unsigned int blocknum, const unsigned char *blocks, unsigned int count)
+{
+    return SDImageWrite(blocknum, blocks, NULL, count);
+}
+
+int SDCARD_queue_writeblock_list(unsigned int blocknum, const unsigned char *const *blocks, unsigned int count)
+{
+    return SDImageWrite(blocknum, NULL, blocks, count);
+}
+
+int SDCARD_queue_erase(unsigned int blocknum, unsigned int count)
+{
+    return SDImageErase(blocknum, count);
+}
@@ -0,0 +1,38 @@
+#ifndef __SD_IMAGE_H__
+#define __SD_IMAGE_H__
+
+#include <stdint.h>
+
+// Host stand-in for sd_spi.c and sd_queue.c: SD blocks come from a raw
+// disk image file, and every request is counted and charged the SPI time
+// the real driver would spend on it.
+
+// Timing model, in the driver's own terms.  Defaults are a typical SDHC
+// card on a 25MHz SPI clock.
+typedef struct SDCardImageTiming {
+    unsigned long clock_hz;
+    unsigned long read_latency_us;      /* command to data token, per block */
+    unsigned long write_block_busy_us;  /* programming between CMD25 blocks */
+    unsigned long write_busy_us;        /* programming after CMD24 or CMD25 */
+    unsigned long erase_busy_us;        /* CMD38, per started allocation unit */
+} SDCardImageTiming;
+
+typedef struct SDCardImageStats {
+    unsigned long commands[64];         /* by command index, ACMDs included */
+    unsigned long commands_total;
+    unsigned long sectors_read;
+    unsigned long sectors_written;
+    unsigned long sectors_touched;      /* distinct sectors read or written */
+    uint64_t spi_time_us;               /* modeled */
+} SDCardImageStats;
+
+// Open (and keep open) a raw image.  Returns 1 on success.
+int SDCARD_image_open(const char *path);
+void SDCARD_image_close(void);
+
+void SDCARD_image_set_timing(const SDCardImageTiming *timing);
+void SDCARD_image_get_stats(SDCardImageStats *stats);
+void SDCARD_image_reset_stats(void);
+void SDCARD_image_print_stats(const char *label);
+
+#endif /* __SD_IMAGE_H__ */
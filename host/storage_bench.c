@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ff.h"
+#include "diskio.h"
+#include "sd_image.h"
+#include "dir_index.h"
+#include "filename_list.h"
+#include "dir_cursor.h"
+
+// Replays the storage access patterns of the launcher and the emulators
+// against diskio.c and FatFs, with the SD card replaced by a disk image,
+// and reports what the card would have seen.
+//
+//   storage_bench sd.img            run against an existing FAT image
+//   storage_bench -c 64 sd.img      first make a 64MB image with test files
+
+extern void disk_cache_print_stats(void);
+extern void disk_prefetch_print_stats(void);
+extern void disk_cache_pin_volume(const FATFS *fs);
+extern void disk_prefetch_set_volume(const FATFS *fs);
+extern void disk_print_telemetry(void);
+extern void disk_reset_telemetry(void);
+
+enum {
+    DSK_TRACKS = 35,
+    DSK_SECTORS = 16,
+    DSK_SECTOR_SIZE = 256,
+    DSK_SEEKS = 500,
+    SAVE_RAM_SIZE = 32 * 1024,
+    SAVE_RAM_REPEATS = 4,
+    GAME_FILES = 300,
+    CAPTURE_SIZE = 1024 * 1024,
+    CAPTURE_CHUNK = 8 * 1024,
+    STREAM_LARGE_READ = 12,             /* sectors */
+    STREAM_LARGE_SECTORS = 6144,
+};
+
+static uint32_t gRandomState = 1;
+
+static uint32_t Random(void)
+{
+    gRandomState ^= gRandomState << 13;
+    gRandomState ^= gRandomState >> 17;
+    gRandomState ^= gRandomState << 5;
+    return gRandomState;
+}
+
+static int WriteTestFile(const char *path, unsigned long size)
+{
+    static BYTE chunk[4096];
+    FIL file;
+    UINT wrote;
+
+    if(f_open(&file, path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+        printf("couldn't create %s\n", path);
+        return 0;
+    }
+    while(size > 0) {
+        UINT length = size < sizeof(chunk) ? size : sizeof(chunk);
+        for(UINT i = 0; i < length; i++) {
+            chunk[i] = Random();
+        }
+        if((f_write(&file, chunk, length, &wrote) != FR_OK) || (wrote != length)) {
+            printf("couldn't write %s\n", path);
+            f_close(&file);
+            return 0;
+        }
+        size -= length;
+    }
+    return f_close(&file) == FR_OK;
+}
+
+// A fresh image laid out like a Rocinante SD card.
+static int CreateImage(const char *path, unsigned long megabytes)
+{
+    static BYTE work[FF_MAX_SS];
+    static FATFS volume;
+    char name[64];
+
+    FILE *image = fopen(path, "wb");
+    if(image == NULL) {
+        perror(path);
+        return 0;
+    }
+    fseek(image, megabytes * 1024 * 1024 - 1, SEEK_SET);
+    fputc(0, image);
+    fclose(image);
+
+    if(!SDCARD_image_open(path)) {
+        return 0;
+    }
+    const MKFS_PARM options = { FM_ANY | FM_SFD, 0, 0, 0, 0 };
+    if(f_mkfs("0:", &options, work, sizeof(work)) != FR_OK) {
+        printf("couldn't format %s\n", path);
+        return 0;
+    }
+    if(f_mount(&volume, "0:", 1) != FR_OK) {
+        printf("couldn't mount new %s\n", path);
+        return 0;
+    }
+
+    f_mkdir("0:/coleco");
+    f_mkdir("0:/floppies");
+    f_mkdir("0:/music");
+    f_mkdir("0:/saves");
+    int success = WriteTestFile("0:/apple2e.rom", 16 * 1024) &&
+        WriteTestFile("0:/coleco/COLECO.ROM", 8 * 1024) &&
+        WriteTestFile("0:/floppies/LodeRunner.dsk", DSK_TRACKS * DSK_SECTORS * DSK_SECTOR_SIZE) &&
+        WriteTestFile("0:/music/song.mp3", 3 * 1024 * 1024);
+    for(int i = 0; success && (i < GAME_FILES); i++) {
+        sprintf(name, "0:/coleco/Game number %d (1983).rom", i);
+        success = WriteTestFile(name, 8 * 1024 + (Random() % (24 * 1024)));
+    }
+
+    f_unmount("0:");
+    SDCARD_image_close();
+    return success;
+}
+
+// The launcher lists every directory, the way RoFillFilenameList does.
+static int ScanDirectory(const char *path)
+{
+    DIR dir;
+    FILINFO info;
+    char child[256];
+    int entries = 0;
+
+    if(f_opendir(&dir, path) != FR_OK) {
+        return 0;
+    }
+    while((f_readdir(&dir, &info) == FR_OK) && (info.fname[0] != '\0')) {
+        entries++;
+        if(info.fattrib & AM_DIR) {
+            int length = snprintf(child, sizeof(child), "%s/%s", path, info.fname);
+            if((length < 0) || ((size_t)length >= sizeof(child))) {
+                printf("skipping %s/%s: path too long\n", path, info.fname);
+                continue;
+            }
+            entries += ScanDirectory(child);
+        }
+    }
+    f_closedir(&dir);
+    return entries;
+}
+
+static void BenchmarkLauncher(void)
+{
+    int entries = 0;
+    for(int i = 0; i < 3; i++) {
+        entries += ScanDirectory("0:");
+    }
+    printf("launcher scans found %d entries\n", entries);
+}
+
+// Browsing with a cursor before there are indexes: the first screenful
+// of the card's root and then of the ROM directory, and then the rest of
+// the ROM directory, read the way RoDoHousekeeping would.
+static DirCursor gBrowser;
+
+static void BenchmarkBrowseFirstScreen(void)
+{
+    if((DirCursorOpen(&gBrowser, "0:/", ".rom", 1) != FR_OK) || (DirCursorFetch(&gBrowser, 24) != FR_OK)) {
+        printf("couldn't list 0:/\n");
+        return;
+    }
+    size_t root = gBrowser.names.count;
+    if((DirCursorDescend(&gBrowser, "coleco/") != FR_OK) || (DirCursorFetch(&gBrowser, 24) != FR_OK)) {
+        printf("couldn't list 0:/coleco\n");
+        return;
+    }
+    printf("browse: %zu names in 0:, first %zu in %s, first \"%s\"\n", root, gBrowser.names.count,
+        gBrowser.path, FilenameListGet(&gBrowser.names, 0));
+}
+
+static void BenchmarkBrowseRest(void)
+{
+    int fetches = 0;
+    while(!gBrowser.complete && (DirCursorFetch(&gBrowser, 8) == FR_OK)) {
+        fetches++;
+    }
+    printf("browse: %zu names in %s after %d more reads\n", gBrowser.names.count, gBrowser.path, fetches);
+    DirCursorClose(&gBrowser);
+}
+
+// The same lists from dir_index.c's index files, built here first the way
+// RoDoHousekeeping would after the launcher's first visit.
+static const char *gIndexedDirectories[] = { "0:", "0:/coleco", "0:/floppies", "0:/music", "0:/saves" };
+
+static int CountIndexEntry(void *entries, const DirIndexEntry *entry)
+{
+    ++*(int *)entries;
+    return 1;
+}
+
+static void BenchmarkIndexBuild(void)
+{
+    int count = 0;
+    for(size_t i = 0; i < sizeof(gIndexedDirectories) / sizeof(gIndexedDirectories[0]); i++) {
+        DirIndexForEach(gIndexedDirectories[i], CountIndexEntry, &count);
+        while(DirIndexPoll()) {
+        }
+    }
+}
+
+// Each visit lets RoDoHousekeeping finish whatever check it queued before
+// the next, so the background work counts too.
+static int VisitIndexed(int *entries, int *polls)
+{
+    int indexed = 0;
+    for(size_t j = 0; j < sizeof(gIndexedDirectories) / sizeof(gIndexedDirectories[0]); j++) {
+        if(DirIndexForEach(gIndexedDirectories[j], CountIndexEntry, entries)) {
+            indexed++;
+        }
+        while(DirIndexPoll()) {
+            ++*polls;
+        }
+    }
+    return indexed;
+}
+
+static void BenchmarkLauncherIndexed(void)
+{
+    int entries = 0;
+    int polls = 0;
+    int indexed = 0;
+    for(int i = 0; i < 3; i++) {
+        indexed += VisitIndexed(&entries, &polls);
+    }
+    printf("launcher index reads: %d of %d visits indexed, %d entries, %d polls\n",
+        indexed, 3 * (int)(sizeof(gIndexedDirectories) / sizeof(gIndexedDirectories[0])), entries, polls);
+}
+
+// A file copied in from a PC: the visit after falls back to reading the
+// directory and the rebuild that queues counts here too.
+static void BenchmarkLauncherIndexedChanged(void)
+{
+    FIL file;
+    UINT wrote;
+    int entries = 0;
+    int polls = 0;
+
+    if((f_open(&file, "0:/coleco/Game number 301 (1984).rom", FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) ||
+        (f_write(&file, "ROM", 3, &wrote) != FR_OK) || (f_close(&file) != FR_OK)) {
+        printf("couldn't add a ROM\n");
+        return;
+    }
+    SDCARD_image_reset_stats();
+    disk_reset_telemetry();
+    int indexed = VisitIndexed(&entries, &polls);
+    indexed += VisitIndexed(&entries, &polls);
+    printf("launcher index reads after a change: %d of %d visits indexed, %d entries, %d polls\n",
+        indexed, 2 * (int)(sizeof(gIndexedDirectories) / sizeof(gIndexedDirectories[0])), entries, polls);
+}
+
+// The launcher's file chooser: the ROMs in one directory into a
+// FilenameList, then a screenful at a time and a jump by typed prefix.
+static int AddIndexedROM(void *list, const DirIndexEntry *entry)
+{
+    if(!(entry->attrib & AM_DIR) && (entry->suffix == DirIndexSuffixClass(".rom"))) {
+        return FilenameListAdd((FilenameList *)list, entry->name);
+    }
+    return 1;
+}
+
+static void BenchmarkChooser(void)
+{
+    const char *page[20];
+    FilenameList list;
+
+    FilenameListInit(&list);
+    DirIndexForEach("0:/coleco", AddIndexedROM, &list);
+    FilenameListSort(&list);
+    size_t shown = 0;
+    for(size_t first = 0; first < list.count; first += 20) {
+        shown += FilenameListPage(&list, first, 20, page);
+    }
+    size_t found = FilenameListFind(&list, "GAME NUMBER 25");
+    printf("chooser: %zu names in %zu bytes, %zu shown, \"game number 25\" at %zu: %s\n",
+        list.count, list.size, shown, found, found < list.count ? FilenameListGet(&list, found) : "(none)");
+    FilenameListFree(&list);
+}
+
+// Emulators read system ROMs and cartridges whole.
+static void BenchmarkROMLoad(void)
+{
+    static BYTE rom[32 * 1024];
+    const char *roms[] = { "0:/apple2e.rom", "0:/coleco/COLECO.ROM", "0:/coleco/Game number 7 (1983).rom" };
+    FIL file;
+    UINT got;
+
+    for(size_t i = 0; i < sizeof(roms) / sizeof(roms[0]); i++) {
+        if(f_open(&file, roms[i], FA_READ) != FR_OK) {
+            printf("couldn't open %s\n", roms[i]);
+            continue;
+        }
+        f_read(&file, rom, sizeof(rom), &got);
+        f_close(&file);
+    }
+}
+
+// The Apple II disk emulation seeks to a track and sector, reads 256
+// bytes, and writes some back.
+static void BenchmarkDiskImage(void)
+{
+    static BYTE sector[DSK_SECTOR_SIZE];
+    FIL file;
+    UINT count;
+
+    if(f_open(&file, "0:/floppies/LodeRunner.dsk", FA_READ | FA_WRITE) != FR_OK) {
+        printf("couldn't open disk image\n");
+        return;
+    }
+    int track = 0;
+    for(int i = 0; i < DSK_SEEKS; i++) {
+        // mostly step to a neighboring track, sometimes jump
+        if(Random() % 4 == 0) {
+            track = Random() % DSK_TRACKS;
+        } else {
+            track = (track + 1) % DSK_TRACKS;
+        }
+        FSIZE_t offset = ((FSIZE_t)track * DSK_SECTORS + Random() % DSK_SECTORS) * DSK_SECTOR_SIZE;
+        f_lseek(&file, offset);
+        f_read(&file, sector, sizeof(sector), &count);
+        if(i % 8 == 0) {
+            f_lseek(&file, offset);
+            f_write(&file, sector, sizeof(sector), &count);
+        }
+    }
+    f_close(&file);
+}
+
+// mp3player reads sequentially in small chunks.
+static void BenchmarkStream(void)
+{
+    static BYTE chunk[1024];
+    FIL file;
+    UINT got;
+
+    if(f_open(&file, "0:/music/song.mp3", FA_READ) != FR_OK) {
+        printf("couldn't open song\n");
+        return;
+    }
+    do {
+        f_read(&file, chunk, sizeof(chunk), &got);
+    } while(got == sizeof(chunk));
+    f_close(&file);
+}
+
+// FatFs reading a song 6KB at a time on a card formatted with 32KB
+// clusters: each f_read goes to disk_read as one 12-sector read, which
+// starts in the read-ahead ring and runs into sectors still being read
+// ahead.
+static void BenchmarkStreamLargeReads(void)
+{
+    static BYTE chunk[STREAM_LARGE_READ * FF_MAX_SS];
+    FIL file;
+
+    if(f_open(&file, "0:/music/song.mp3", FA_READ) != FR_OK) {
+        printf("couldn't open song\n");
+        return;
+    }
+    LBA_t first = file.obj.fs->database + (LBA_t)file.obj.fs->csize * (file.obj.sclust - 2);
+    f_close(&file);
+    for(LBA_t sector = first; sector < first + STREAM_LARGE_SECTORS; sector += STREAM_LARGE_READ) {
+        disk_read(0, chunk, sector, STREAM_LARGE_READ);
+    }
+}
+
+// Emulator save RAM is written a sector at a time and synced.
+static void BenchmarkSaveRAM(void)
+{
+    static BYTE block[512];
+    FIL file;
+    UINT wrote;
+
+    for(int r = 0; r < SAVE_RAM_REPEATS; r++) {
+        if(f_open(&file, "0:/saves/game.sav", FA_WRITE | FA_OPEN_ALWAYS) != FR_OK) {
+            printf("couldn't open save file\n");
+            return;
+        }
+        for(int i = 0; i < SAVE_RAM_SIZE / (int)sizeof(block); i++) {
+            memset(block, r + i, sizeof(block));
+            f_write(&file, block, sizeof(block), &wrote);
+        }
+        f_sync(&file);
+        f_close(&file);
+    }
+}
+
+// A recording written in chunks as it's made, growing the file as it
+// goes.
+static void BenchmarkCapture(void)
+{
+    static BYTE chunk[CAPTURE_CHUNK];
+    FIL file;
+    UINT wrote;
+
+    if(f_open(&file, "0:/saves/capture.raw", FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+        printf("couldn't create capture file\n");
+        return;
+    }
+    for(int i = 0; i < CAPTURE_SIZE / CAPTURE_CHUNK; i++) {
+        memset(chunk, i, sizeof(chunk));
+        f_write(&file, chunk, sizeof(chunk), &wrote);
+    }
+    f_close(&file);
+}
+
+// The same recording into a file allocated up front, written straight
+// to its sectors.
+static void BenchmarkCaptureContiguous(void)
+{
+    static BYTE chunk[CAPTURE_CHUNK];
+    DiskStream capture;
+
+    if(disk_stream_create(&capture, "0:/saves/capture.raw", CAPTURE_SIZE) != FR_OK) {
+        printf("couldn't create contiguous capture file\n");
+        return;
+    }
+    for(int i = 0; i < CAPTURE_SIZE / CAPTURE_CHUNK; i++) {
+        memset(chunk, i, sizeof(chunk));
+        disk_stream_write(&capture, chunk, sizeof(chunk) / FF_MAX_SS);
+    }
+    disk_stream_close(&capture, CAPTURE_SIZE);
+}
+
+static void Run(const char *label, void (*benchmark)(void))
+{
+    SDCARD_image_reset_stats();
+    disk_reset_telemetry();
+    benchmark();
+    SDCARD_image_print_stats(label);
+    disk_print_telemetry();
+}
+
+int main(int argc, char **argv)
+{
+    static FATFS volume;
+    unsigned long create_megabytes = 0;
+    const char *path = NULL;
+
+    for(int i = 1; i < argc; i++) {
+        if((strcmp(argv[i], "-c") == 0) && (i + 1 < argc)) {
+            create_megabytes = strtoul(argv[++i], NULL, 0);
+        } else if(path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if(path == NULL) {
+        fprintf(stderr, "usage: %s [-c megabytes] image\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if((create_megabytes > 0) && !CreateImage(path, create_megabytes)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if(!SDCARD_image_open(path)) {
+        exit(EXIT_FAILURE);
+    }
+    FRESULT result = f_mount(&volume, "0:", 1);
+    if(result != FR_OK) {
+        printf("ERROR: FATFS mount result is %d\n", result);
+        exit(EXIT_FAILURE);
+    }
+    disk_cache_pin_volume(&volume);
+    disk_prefetch_set_volume(&volume);
+    SDCARD_image_print_stats("mount");
+
+    Run("launcher", BenchmarkLauncher);
+    Run("browse, first screen", BenchmarkBrowseFirstScreen);
+    Run("browse, rest", BenchmarkBrowseRest);
+    Run("directory index build", BenchmarkIndexBuild);
+    Run("launcher, indexed", BenchmarkLauncherIndexed);
+    Run("chooser", BenchmarkChooser);
+    Run("launcher, indexed, after a change", BenchmarkLauncherIndexedChanged);
+    Run("ROM load", BenchmarkROMLoad);
+    Run("disk image", BenchmarkDiskImage);
+    Run("stream", BenchmarkStream);
+    Run("stream, large reads", BenchmarkStreamLargeReads);
+    Run("save RAM", BenchmarkSaveRAM);
+    Run("capture", BenchmarkCapture);
+    Run("capture, contiguous", BenchmarkCaptureContiguous);
+
+    f_unmount("0:");
+
+    disk_cache_print_stats();
+    disk_prefetch_print_stats();
+
+    SDCARD_image_close();
+    return 0;
+}
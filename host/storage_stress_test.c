@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "ff.h"
+#include "diskio.h"
+#include "sd_image.h"
+#include "sd_card_model.h"
+
+// Runs ../storage_stress.c with a second thread standing in for core 1:
+// the thread writes while the main thread reads, both through FatFs,
+// diskio.c, and the real SD request queue and driver, on the card model.
+// Exits non-zero on any failure.
+//
+//   storage_stress_test [scratch image]
+
+extern int StorageStressPrepare(void);
+extern int StorageStressWriter(int iterations);
+extern int StorageStressReader(int iterations);
+extern void disk_print_telemetry(void);
+extern void disk_cache_pin_volume(const FATFS *fs);
+extern int disk_cache_contains(LBA_t sector);
+
+enum {
+    STRESS_IMAGE_MEGABYTES = 64,
+    STRESS_WRITER_ITERATIONS = 60,
+    STRESS_READER_ITERATIONS = 1200,
+    STRESS_CHURN_SECTORS = 64,          // well past the sector cache's size
+};
+
+// The way the launcher sees the card at boot: FAT sectors first while
+// files are walked, then the root directory, then a run of other reads.
+// The root directory's first sector should still be cached afterwards.
+static int CheckRootPinned(FATFS *volume)
+{
+    BYTE sector[FF_MAX_SS];
+    LBA_t root = (volume->fs_type >= FS_FAT32) ?
+        volume->database + (LBA_t)volume->csize * (volume->dirbase - 2) : volume->dirbase;
+    DIR dir;
+    FILINFO info;
+
+    disk_cache_pin_volume(volume);
+    for(int i = 0; (i < STRESS_CHURN_SECTORS) && (i < (int)volume->fsize); i++) {
+        disk_read(0, sector, volume->fatbase + i, 1);
+    }
+    if((f_opendir(&dir, "0:/") != FR_OK) || (f_readdir(&dir, &info) != FR_OK)) {
+        printf("couldn't read the root directory\n");
+        return 0;
+    }
+    f_closedir(&dir);
+    for(int i = 0; i < STRESS_CHURN_SECTORS; i++) {
+        disk_read(0, sector, volume->database + i, 1);
+    }
+    if(!disk_cache_contains(root)) {
+        printf("root directory sector %lu was evicted\n", (unsigned long)root);
+        return 0;
+    }
+    return 1;
+}
+
+static void *Core1(void *failures)
+{
+    *(int *)failures = StorageStressWriter(STRESS_WRITER_ITERATIONS);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : "storage_stress_test.img";
+    static BYTE work[FF_MAX_SS];
+    static FATFS volume;
+
+    FILE *image = fopen(path, "wb");
+    if(image == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(image, STRESS_IMAGE_MEGABYTES * 1024L * 1024L - 1, SEEK_SET);
+    fputc(0, image);
+    fclose(image);
+
+    if(!SDCARD_image_open(path)) {
+        exit(EXIT_FAILURE);
+    }
+    const MKFS_PARM options = { FM_ANY | FM_SFD, 0, 0, 0, 0 };
+    if((f_mkfs("0:", &options, work, sizeof(work)) != FR_OK) ||
+        (f_mount(&volume, "0:", 1) != FR_OK) ||
+        !StorageStressPrepare()) {
+        printf("couldn't set up %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if(!CheckRootPinned(&volume)) {
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t core1;
+    int writer_failures = 0;
+    pthread_create(&core1, NULL, Core1, &writer_failures);
+    int reader_failures = StorageStressReader(STRESS_READER_ITERATIONS);
+    pthread_join(core1, NULL);
+
+    f_unmount("0:");
+    disk_print_telemetry();
+    SDCARD_image_close();
+    remove(path);
+
+    printf("writer: %d failures, reader: %d failures\n", writer_failures, reader_failures);
+    return (writer_failures || reader_failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+
+# Pack a directory into a read-only FAT12 image for the flash volume
+# ("2:") in diskio.c.  Every file and directory is stored in consecutive
+# clusters so disk_flash_map_file() can return pointers straight into XIP
+# flash.  Optionally wraps the image in a UF2 for drag-and-drop flashing.
+#
+#   python3 pack_flash_volume.py roms/ flash_volume.img --uf2 flash_volume.uf2
+
+import argparse
+import os
+import struct
+import sys
+import time
+
+SECTOR_SIZE = 512
+DIR_ENTRY_SIZE = 32
+MAX_FAT12_CLUSTERS = 4084
+
+# Must match FLASH_VOLUME_OFFSET and FLASH_VOLUME_SIZE in diskio.c
+DEFAULT_OFFSET = 1024 * 1024
+DEFAULT_SIZE = 1024 * 1024
+
+XIP_BASE = 0x10000000
+UF2_FAMILY_RP2040 = 0xE48BFF56
+
+ATTR_READ_ONLY = 0x01
+ATTR_DIRECTORY = 0x10
+ATTR_ARCHIVE = 0x20
+ATTR_LFN = 0x0F
+
+SHORT_NAME_CHARS = set("ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789$%'-_@~`!(){}^#&")
+
+
+class Node:
+    def __init__(self, name, path, is_dir):
+        self.name = name
+        self.path = path
+        self.is_dir = is_dir
+        self.children = []
+        self.short_name = None
+        self.size = 0
+        self.cluster = 0
+        self.mtime = os.path.getmtime(path)
+
+
+def scan(path, name=""):
+    node = Node(name, path, os.path.isdir(path))
+    if node.is_dir:
+        for child in sorted(os.listdir(path)):
+            node.children.append(scan(os.path.join(path, child), child))
+    else:
+        node.size = os.path.getsize(path)
+    return node
+
+
+def split_name(name):
+    if "." in name[1:]:
+        base, ext = name.rsplit(".", 1)
+    else:
+        base, ext = name, ""
+    return base, ext
+
+
+def clean(part):
+    return "".join(c for c in part.upper() if c in SHORT_NAME_CHARS)
+
+
+def needs_long_name(name):
+    base, ext = split_name(name)
+    return (name != name.upper() or len(base) > 8 or len(ext) > 3 or
+            clean(base) != base or clean(ext) != ext or base == "")
+
+
+def assign_short_names(directory):
+    used = set()
+    for child in directory.children:
+        base, ext = split_name(child.name)
+        base, ext = clean(base), clean(ext)[:3]
+        if not needs_long_name(child.name):
+            short = (base, ext)
+        else:
+            base = base or "_"
+            n = 1
+            while True:
+                tail = "~%d" % n
+                short = (base[:8 - len(tail)] + tail, ext)
+                if short not in used:
+                    break
+                n += 1
+        if short in used:
+            sys.exit("duplicate name %s in %s" % (child.name, directory.path))
+        used.add(short)
+        child.short_name = short[0].ljust(8).encode("ascii") + short[1].ljust(3).encode("ascii")
+
+
+def long_name_entry_count(node):
+    if not needs_long_name(node.name):
+        return 0
+    return (len(node.name.encode("utf-16-le")) // 2 + 12) // 13
+
+
+def directory_entry_count(directory, is_root):
+    count = 0 if is_root else 2  # "." and ".."
+    for child in directory.children:
+        count += 1 + long_name_entry_count(child)
+    return count
+
+
+def short_name_checksum(short_name):
+    total = 0
+    for c in short_name:
+        total = (((total & 1) << 7) + (total >> 1) + c) & 0xFF
+    return total
+
+
+def fat_time(mtime):
+    t = time.localtime(mtime)
+    year = min(max(t.tm_year, 1980), 2107)
+    date = ((year - 1980) << 9) | (t.tm_mon << 5) | t.tm_mday
+    clock = (t.tm_hour << 11) | (t.tm_min << 5) | (t.tm_sec // 2)
+    return date, clock
+
+
+def short_entry(short_name, attr, cluster, size, mtime):
+    date, clock = fat_time(mtime)
+    return struct.pack("<11sBBBHHHHHHHI", short_name, attr, 0, 0, clock, date, date, 0,
+                       clock, date, cluster, size)
+
+
+def long_entries(node):
+    units = list(struct.unpack("<%dH" % (len(node.name.encode("utf-16-le")) // 2),
+                               node.name.encode("utf-16-le")))
+    count = long_name_entry_count(node)
+    if len(units) < count * 13:
+        units.append(0)
+    units += [0xFFFF] * (count * 13 - len(units))
+    checksum = short_name_checksum(node.short_name)
+    entries = []
+    for i in range(count):
+        chunk = units[i * 13:(i + 1) * 13]
+        order = (i + 1) | (0x40 if i == count - 1 else 0)
+        entries.append(struct.pack("<B5HBBB6HH2H", order, *chunk[0:5], ATTR_LFN, 0, checksum,
+                                   *chunk[5:11], 0, *chunk[11:13]))
+    return b"".join(reversed(entries))
+
+
+def directory_contents(directory, parent_cluster, is_root):
+    data = b""
+    if not is_root:
+        dot = b".".ljust(11)
+        dotdot = b"..".ljust(11)
+        data += short_entry(dot, ATTR_DIRECTORY, directory.cluster, 0, directory.mtime)
+        data += short_entry(dotdot, ATTR_DIRECTORY, parent_cluster, 0, directory.mtime)
+    for child in directory.children:
+        if long_name_entry_count(child):
+            data += long_entries(child)
+        if child.is_dir:
+            data += short_entry(child.short_name, ATTR_DIRECTORY | ATTR_READ_ONLY, child.cluster, 0, child.mtime)
+        else:
+            data += short_entry(child.short_name, ATTR_ARCHIVE | ATTR_READ_ONLY, child.cluster, child.size, child.mtime)
+    return data
+
+
+def layout(total_sectors, root_entries):
+    root_sectors = root_entries * DIR_ENTRY_SIZE // SECTOR_SIZE
+    for sectors_per_cluster in (1, 2, 4, 8, 16, 32, 64):
+        fat_sectors = 1
+        while True:
+            data_sectors = total_sectors - 1 - fat_sectors - root_sectors
+            clusters = data_sectors // sectors_per_cluster
+            needed = ((clusters + 2) * 3 // 2 + SECTOR_SIZE - 1) // SECTOR_SIZE
+            if needed <= fat_sectors:
+                break
+            fat_sectors = needed
+        if 0 < clusters <= MAX_FAT12_CLUSTERS:
+            return sectors_per_cluster, fat_sectors, root_sectors, clusters
+    sys.exit("volume of %d sectors is too big for FAT12" % total_sectors)
+
+
+def boot_sector(total_sectors, sectors_per_cluster, fat_sectors, root_entries):
+    sector = bytearray(SECTOR_SIZE)
+    sector[0:3] = b"\xEB\x3C\x90"
+    struct.pack_into("<8sHBHBHHBHHHII", sector, 3, b"ROCINANT", SECTOR_SIZE, sectors_per_cluster,
+                     1, 1, root_entries, total_sectors if total_sectors < 0x10000 else 0, 0xF8,
+                     fat_sectors, 63, 255, 0, total_sectors if total_sectors >= 0x10000 else 0)
+    struct.pack_into("<BBBI11s8s", sector, 36, 0x80, 0, 0x29, int(time.time()) & 0xFFFFFFFF,
+                     b"ROCINANTE  ", b"FAT12   ")
+    sector[510:512] = b"\x55\xAA"
+    return sector
+
+
+def uf2(image, address):
+    blocks = []
+    payload = 256
+    count = (len(image) + payload - 1) // payload
+    for i in range(count):
+        data = image[i * payload:(i + 1) * payload].ljust(476, b"\0")
+        blocks.append(struct.pack("<IIIIIIII", 0x0A324655, 0x9E5D5157, 0x00002000,
+                                  address + i * payload, payload, i, count, UF2_FAMILY_RP2040) +
+                      data + struct.pack("<I", 0x0AB16F30))
+    return b"".join(blocks)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Pack a directory into a Rocinante flash volume image.")
+    parser.add_argument("directory")
+    parser.add_argument("image")
+    parser.add_argument("--size", type=int, default=DEFAULT_SIZE, help="volume size in bytes")
+    parser.add_argument("--offset", type=int, default=DEFAULT_OFFSET, help="volume offset in flash, for --uf2")
+    parser.add_argument("--root-entries", type=int, default=256)
+    parser.add_argument("--uf2", help="also write a UF2 file for the volume")
+    args = parser.parse_args()
+
+    total_sectors = args.size // SECTOR_SIZE
+    sectors_per_cluster, fat_sectors, root_sectors, clusters = layout(total_sectors, args.root_entries)
+    cluster_bytes = sectors_per_cluster * SECTOR_SIZE
+    data_start = 1 + fat_sectors + root_sectors
+
+    root = scan(args.directory)
+    if not root.is_dir:
+        sys.exit("%s is not a directory" % args.directory)
+
+    # Give every directory and file a run of consecutive clusters.
+    fat = [0] * (clusters + 2)
+    fat[0] = 0xFF8
+    fat[1] = 0xFFF
+    next_cluster = [2]
+
+    def allocate(node, is_root):
+        if node.is_dir:
+            assign_short_names(node)
+            entries = directory_entry_count(node, is_root)
+            if is_root:
+                if entries > args.root_entries:
+                    sys.exit("too many entries in the root directory; raise --root-entries")
+                length = 0
+            else:
+                length = entries * DIR_ENTRY_SIZE
+        else:
+            length = node.size
+        run = (length + cluster_bytes - 1) // cluster_bytes
+        if run > 0:
+            if next_cluster[0] + run > clusters + 2:
+                sys.exit("%s doesn't fit; raise --size" % node.path)
+            node.cluster = next_cluster[0]
+            for c in range(node.cluster, node.cluster + run - 1):
+                fat[c] = c + 1
+            fat[node.cluster + run - 1] = 0xFFF
+            next_cluster[0] += run
+        for child in node.children:
+            allocate(child, False)
+
+    allocate(root, True)
+
+    image = bytearray(total_sectors * SECTOR_SIZE)
+    image[0:SECTOR_SIZE] = boot_sector(total_sectors, sectors_per_cluster, fat_sectors, args.root_entries)
+
+    packed = bytearray(fat_sectors * SECTOR_SIZE)
+    for i in range(0, len(fat), 2):
+        first = fat[i]
+        second = fat[i + 1] if i + 1 < len(fat) else 0
+        offset = i * 3 // 2
+        packed[offset] = first & 0xFF
+        packed[offset + 1] = (first >> 8) | ((second & 0xF) << 4)
+        packed[offset + 2] = second >> 4
+    image[SECTOR_SIZE:SECTOR_SIZE + len(packed)] = packed
+
+    def cluster_offset(cluster):
+        return (data_start + (cluster - 2) * sectors_per_cluster) * SECTOR_SIZE
+
+    def write(node, parent_cluster, is_root):
+        if node.is_dir:
+            data = directory_contents(node, parent_cluster, is_root)
+            if is_root:
+                offset = (1 + fat_sectors) * SECTOR_SIZE
+            else:
+                offset = cluster_offset(node.cluster)
+            image[offset:offset + len(data)] = data
+            for child in node.children:
+                write(child, 0 if is_root else node.cluster, False)
+        elif node.size > 0:
+            with open(node.path, "rb") as f:
+                data = f.read()
+            offset = cluster_offset(node.cluster)
+            image[offset:offset + len(data)] = data
+
+    write(root, 0, True)
+
+    with open(args.image, "wb") as f:
+        f.write(image)
+    used = (next_cluster[0] - 2) * cluster_bytes
+    print("%s: %d of %d bytes used, %d byte clusters" % (args.image, used, clusters * cluster_bytes, cluster_bytes))
+
+    if args.uf2:
+        with open(args.uf2, "wb") as f:
+            f.write(uf2(bytes(image), XIP_BASE + args.offset))
+        print("%s: flash at 0x%08X" % (args.uf2, XIP_BASE + args.offset))
+
+
+if __name__ == "__main__":
+    main()
@@ -17,6 +17,7 @@
 
 #include "byte_queue.h"
 #include "sd_spi.h"
+#include "sd_queue.h"
 
 #include "rocinante.h"
 #include "ntsc-kit.h"
@@ -24,6 +25,9 @@
 #include "text-mode.h"
 
 #include "ff.h"
+#include "dir_index.h"
+#include "filename_list.h"
+#include "dir_cursor.h"
 
 extern void enqueue_serial_input(uint8_t c);
 
@@ -41,13 +45,35 @@ const uint32_t NTSC_PIN_COUNT = 8;
 #define SD_MISO 4
 #define SD_CS 5
 
+// Drive the SD card from a PIO state machine instead of the spi0 peripheral.
+// It isn't faster: at 262MHz the PIO program's clocks are 87, 43.7, and
+// 29MHz, and with the card's 50MHz limit that's 43.7MHz, which spi0 gets
+// too from clk_peri / 6.  So it's off unless BenchmarkSDBackends shows
+// otherwise on a particular board.
+#define SD_USE_PIO_SPI 0
+
+// Size of the scratch RAM disk mounted as "1:", in 512-byte sectors; 0 for
+// none.  It's malloced at boot and comes out of the emulators' heap, so
+// it's off unless a build asks for it.  f_mkfs won't make a volume
+// smaller than 128 sectors (64KB).
+#ifndef RAM_DISK_SECTORS
+#define RAM_DISK_SECTORS 0
+#endif
+
 enum {
     CORE1_OPERATION_SUCCEEDED = 1,
     CORE1_ENABLE_VIDEO_ISR,
     CORE1_DISABLE_VIDEO_ISR,
     CORE1_AUDIO_TEST,
+    CORE1_STORAGE_STRESS,
+    CORE1_OPERATION_FAILED,
 };
 
+// storage_stress.c; core 1 writes while core 0 reads
+extern int StorageStressPrepare(void);
+extern int StorageStressWriter(int iterations);
+extern int StorageStressReader(int iterations);
+
 volatile int core1_line = 0;
 
 void core1_main()
@@ -55,6 +81,16 @@ void core1_main()
     for(;;)
     {
         core1_line = __LINE__;
+        if(!multicore_fifo_rvalid())
+        {
+            // Between commands from core 0, run queued SD requests.
+            // SDCARD_submit and multicore_fifo_push_blocking both __sev().
+            if(!SDCARD_service_queue())
+            {
+                __wfe();
+            }
+            continue;
+        }
         uint32_t request = multicore_fifo_pop_blocking();
         core1_line = __LINE__;
         switch(request)
@@ -69,6 +105,15 @@ void core1_main()
                 irq_set_enabled(DMA_IRQ_0, false);
                 core1_line = __LINE__;
                 break;
+            case CORE1_STORAGE_STRESS :
+                core1_line = __LINE__;
+                if(StorageStressWriter(60) != 0)
+                {
+                    multicore_fifo_push_blocking(CORE1_OPERATION_FAILED);
+                    continue;
+                }
+                core1_line = __LINE__;
+                break;
             case CORE1_AUDIO_TEST :
             {
                 // approximately 440Hz tone test
@@ -434,13 +479,75 @@ void RoDelayMillis(uint32_t millis)
     sleep_ms(millis);
 }
 
+// In a build with ROCINANTE_STORAGE_STATS_KEYS, Control-] then 't' on the
+// stdio console prints storage statistics, like BSD's SIGINFO, and
+// Control-] then 'r' zeroes the I/O telemetry so the next status covers
+// just what happened in between.  Control-] twice sends one Control-],
+// and any other key after it is sent along too, so nothing an emulator
+// might want is lost.  The UART interrupt passes every key through
+// untouched.
+#ifndef ROCINANTE_STORAGE_STATS_KEYS
+#define ROCINANTE_STORAGE_STATS_KEYS 0
+#endif
+
+#define SERIAL_ESCAPE_KEY 0x1D
+#define SERIAL_STATUS_KEY 't'
+#define SERIAL_RESET_STATS_KEY 'r'
+
+extern void disk_cache_print_stats(void);
+extern void disk_cache_poll(void);
+extern void disk_prefetch_print_stats(void);
+extern void disk_print_telemetry(void);
+extern void disk_reset_telemetry(void);
+extern void print_open_file_stats(void);
+
+static void RoPollDirCursor(void);
+
+void PrintStorageStats(void)
+{
+    disk_cache_print_stats();
+    disk_prefetch_print_stats();
+    disk_print_telemetry();
+    print_open_file_stats();
+}
+
+// Returns 1 if c was part of a storage stats command.
+static int RoStorageStatsKey(int c)
+{
+    static int escaped = 0;
+
+    if(!ROCINANTE_STORAGE_STATS_KEYS) {
+        return 0;
+    }
+    if(!escaped) {
+        escaped = (c == SERIAL_ESCAPE_KEY);
+        return escaped;
+    }
+    escaped = 0;
+    if(c == SERIAL_STATUS_KEY) {
+        PrintStorageStats();
+        return 1;
+    } else if(c == SERIAL_RESET_STATS_KEY) {
+        disk_reset_telemetry();
+        printf("storage telemetry reset\n");
+        return 1;
+    }
+    enqueue_serial_input(SERIAL_ESCAPE_KEY);
+    return (c == SERIAL_ESCAPE_KEY);
+}
+
 int RoDoHousekeeping(void)
 {
     int c;
     // while((c = getchar_timeout_us(0)) != -1) {
     if((c = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT) {
-        enqueue_serial_input(c);
+        if(!RoStorageStatsKey(c)) {
+            enqueue_serial_input(c);
+        }
     }
+    disk_cache_poll();
+    DirIndexPoll();
+    RoPollDirCursor();
     return 0;
 }
 
@@ -563,63 +670,190 @@ void RoSetClipboardString([[maybe_unused]] char *str)
 {
 }
 
-Status RoFillFilenameList(const char* dirName, uint32_t flags, const char* optionalFilterSuffix, size_t maxNames, char **filenames, size_t* filenamesSize)
+static int RoFilenameWanted(const char *name, BYTE attrib, uint32_t flags, const char* optionalFilterSuffix)
 {
+    if (attrib & AM_DIR) {                    /* It is a directory */
+        // Directories are only listed by RoOpenDirCursor.
+        return 0;
+    } else if((name[0] == '.') && (flags & CHOOSE_FILE_IGNORE_DOTFILES)) {
+        return 0;
+    } else if(optionalFilterSuffix) {
+        size_t nameLength = strlen(name);
+        size_t suffixLength = strlen(optionalFilterSuffix);
+        if((nameLength < suffixLength) || (strcmp(optionalFilterSuffix, name + nameLength - suffixLength) != 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Where RoVisitFilenames puts each wanted name: add returns 0 when it has
+// no room.
+typedef struct FilenameListFill {
+    uint32_t flags;
+    const char* optionalFilterSuffix;
+    uint32_t suffixClass;
+    int (*add)(void *destination, const char *name);
+    void *destination;
     Status status;
+} FilenameListFill;
+
+static int RoAddIndexedFilename(void *user, const DirIndexEntry *entry)
+{
+    FilenameListFill *fill = (FilenameListFill *)user;
+
+    // Names ending in the filter suffix have its suffix class, so most
+    // names are turned away without looking at them.
+    if(fill->suffixClass && (entry->suffix != fill->suffixClass)) {
+        return 1;
+    }
+    if(!RoFilenameWanted(entry->name, entry->attrib, fill->flags, fill->optionalFilterSuffix)) {
+        return 1;
+    }
+    if(!fill->add(fill->destination, entry->name)) {
+        fill->status = RO_RESOURCE_EXHAUSTED;
+        return 0;
+    }
+    return 1;
+}
 
+// Lists from the directory's index (dir_index.c) when it has one, which
+// is one file read, and otherwise reads the directory.  Either way the
+// index is checked or built in the background from RoDoHousekeeping.
+static Status RoVisitFilenames(const char* dirName, FilenameListFill *fill)
+{
     FRESULT res;
     DIR dir;
     static FILINFO fno;
 
+    if(fill->optionalFilterSuffix && strchr(fill->optionalFilterSuffix, '.')) {
+        fill->suffixClass = DirIndexSuffixClass(fill->optionalFilterSuffix);
+    }
+    if(DirIndexForEach(dirName, RoAddIndexedFilename, fill)) {
+        return fill->status;
+    }
+
     res = f_opendir(&dir, dirName);                       /* Open the directory */
-    if (res == FR_OK) {
+    if (res != FR_OK) {
+        return RO_RESOURCE_NOT_FOUND;
+    }
+    for (;;) {
+        res = f_readdir(&dir, &fno);                   /* Read a directory item */
+        if(res != FR_OK) {
+            printf("failed to readdir - %d\n", res);
+            break;
+        }
+        if (fno.fname[0] == 0) break;  /* Break on end of dir */
 
-        for (;;) {
-            res = f_readdir(&dir, &fno);                   /* Read a directory item */
-            if(res != FR_OK) {
-                printf("failed to readdir - %d\n", res);
+        if(RoFilenameWanted(fno.fname, fno.fattrib, fill->flags, fill->optionalFilterSuffix)) {
+            if(!fill->add(fill->destination, fno.fname)) {
+                fill->status = RO_RESOURCE_EXHAUSTED;
                 break;
             }
-            if (fno.fname[0] == 0) break;  /* Break on end of dir */
-
-            // if (fno.fattrib & AM_DIR) {                    /* It is a directory */
-                // printf("%s/\n", fno.fname);
-            // }
-
-            int addToList = 1;
+        }
+    }
+    f_closedir(&dir);
+    return fill->status;
+}
 
-            if (fno.fattrib & AM_DIR) {                    /* It is a directory */
-                // XXX Really should have a way to descend into directories.
-                addToList = 0;
-            } else if((fno.fname[0] == '.') && (flags & CHOOSE_FILE_IGNORE_DOTFILES)) {
-                addToList = 0;
-            } else if(optionalFilterSuffix && (strcmp(optionalFilterSuffix, fno.fname + strlen(fno.fname) - strlen(optionalFilterSuffix)) != 0)) {
-                addToList = 0;
-            }
+typedef struct FilenameArray {
+    size_t maxNames;
+    char **filenames;
+    size_t* filenamesSize;
+} FilenameArray;
 
-            if(addToList) {
-                if(*filenamesSize > maxNames - 1) {
-                    return RO_RESOURCE_EXHAUSTED;
-                }
-                filenames[(*filenamesSize)++] = strdup(fno.fname);
-            }
-        }
-        f_closedir(&dir);
-        status = RO_SUCCESS;
+static int RoAddFilenameToArray(void *destination, const char *name)
+{
+    FilenameArray *array = (FilenameArray *)destination;
+    if(*array->filenamesSize > array->maxNames - 1) {
+        return 0;
+    }
+    array->filenames[(*array->filenamesSize)++] = strdup(name);
+    return 1;
+}
 
-    } else {
+// Each name is strdup'd and the caller frees them one by one; see
+// RoFillFilenameArena for a list that's one allocation.
+Status RoFillFilenameList(const char* dirName, uint32_t flags, const char* optionalFilterSuffix, size_t maxNames, char **filenames, size_t* filenamesSize)
+{
+    FilenameArray array = { maxNames, filenames, filenamesSize };
+    FilenameListFill fill = { flags, optionalFilterSuffix, 0, RoAddFilenameToArray, &array, RO_SUCCESS };
 
+    Status status = RoVisitFilenames(dirName, &fill);
+    if(status == RO_RESOURCE_NOT_FOUND) {
         if(*filenamesSize > maxNames - 1) {
             return RO_RESOURCE_EXHAUSTED;
         }
         filenames[(*filenamesSize)++] = strdup("failed to f_opendir");
-        status = RO_RESOURCE_NOT_FOUND;
-
     }
+    return status;
+}
+
+static int RoAddFilenameToArena(void *destination, const char *name)
+{
+    return FilenameListAdd((FilenameList *)destination, name);
+}
 
+// Like RoFillFilenameList, but the names are packed into list's one
+// allocation (filename_list.c) and sorted, so a large directory doesn't
+// scatter little allocations through the heap before an emulator asks
+// for its RAM.  Release with FilenameListFree.  Needs a prototype in
+// rosa's rocinante.h next to RoFillFilenameList's.
+Status RoFillFilenameArena(const char* dirName, uint32_t flags, const char* optionalFilterSuffix, FilenameList *list)
+{
+    FilenameListFill fill = { flags, optionalFilterSuffix, 0, RoAddFilenameToArena, list, RO_SUCCESS };
+
+    Status status = RoVisitFilenames(dirName, &fill);
+    FilenameListSort(list);
     return status;
 }
 
+// The launcher's browsing cursor (dir_cursor.h).  Opening it reads the
+// first screenful; after that RoDoHousekeeping reads a little more each
+// time until the directory is done, so names can move in memory between
+// housekeeping calls.  Unlike RoFillFilenameList it lists subdirectories,
+// with a '/' on the end, and DirCursorDescend and DirCursorAscend move
+// around.  These need prototypes in rosa's rocinante.h.
+#define RO_DIR_CURSOR_FIRST_PAGE 24
+#define RO_DIR_CURSOR_NAMES_PER_POLL 8
+
+static DirCursor *gBrowsingCursor;
+
+static Status RoStatusFromFRESULT(FRESULT result)
+{
+    if(result == FR_OK) {
+        return RO_SUCCESS;
+    } else if(result == FR_NOT_ENOUGH_CORE) {
+        return RO_RESOURCE_EXHAUSTED;
+    }
+    return RO_RESOURCE_NOT_FOUND;
+}
+
+Status RoOpenDirCursor(DirCursor *cursor, const char* dirName, uint32_t flags, const char* optionalFilterSuffix)
+{
+    FRESULT result = DirCursorOpen(cursor, dirName, optionalFilterSuffix, (flags & CHOOSE_FILE_IGNORE_DOTFILES) != 0);
+    if(result == FR_OK) {
+        result = DirCursorFetch(cursor, RO_DIR_CURSOR_FIRST_PAGE);
+    }
+    gBrowsingCursor = cursor;
+    return RoStatusFromFRESULT(result);
+}
+
+void RoCloseDirCursor(DirCursor *cursor)
+{
+    if(gBrowsingCursor == cursor) {
+        gBrowsingCursor = NULL;
+    }
+    DirCursorClose(cursor);
+}
+
+static void RoPollDirCursor(void)
+{
+    if(gBrowsingCursor && !gBrowsingCursor->complete) {
+        DirCursorFetch(gBrowsingCursor, RO_DIR_CURSOR_NAMES_PER_POLL);
+    }
+}
+
 #define BAUD_RATE 115200
 #define DATA_BITS 8
 #define PARITY    UART_PARITY_NONE
@@ -789,6 +1023,35 @@ void spi_disable_cs()
 }
 
 extern void set_ff_spi_inst(spi_inst_t *spi);
+extern void disk_cache_pin_volume(const FATFS *fs);
+extern void disk_prefetch_set_volume(const FATFS *fs);
+extern int disk_ramdisk_create(UINT sectors);
+extern const void *disk_flash_map_file(const TCHAR *path, FSIZE_t *size);
+
+void MountRAMDisk(void)
+{
+    static FATFS gRAMVolume;
+    static BYTE work[FF_MAX_SS];
+    const MKFS_PARM options = { FM_FAT | FM_SFD, 1, 0, 64, 0 };
+
+    if(!disk_ramdisk_create(RAM_DISK_SECTORS)) {
+        printf("couldn't create RAM disk\n");
+        return;
+    }
+    FRESULT result = f_mkfs("1:", &options, work, sizeof(work));
+    if(result == FR_OK) {
+        result = f_mount(&gRAMVolume, "1:", 1);
+    }
+    if(result != FR_OK) {
+        printf("ERROR: RAM disk format or mount result is %d\n", result);
+    } else {
+        printf("Mounted %dKB RAM disk as 1:\n", RAM_DISK_SECTORS * FF_MAX_SS / 1024);
+    }
+}
+extern void BenchmarkSDWrites(spi_inst_t *spi);
+extern void BenchmarkSDWriteLatency(spi_inst_t *spi);
+extern void BenchmarkSDErase(spi_inst_t *spi);
+extern void BenchmarkSDBackends(spi_inst_t *spi, PIO pio, uint pin_sck, uint pin_mosi, uint pin_miso);
 
 int launcher_main(int argc, const char **argv);
 int coleco_main(int argc, const char **argv);
@@ -855,12 +1118,23 @@ int main()
     spi_set_format(spi, 8, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
     set_ff_spi_inst(spi);
 
+    if(SD_USE_PIO_SPI && !SDCARD_use_pio_spi(pio1, SD_SCK, SD_MOSI, SD_MISO))
+    {
+        printf("couldn't start PIO SPI, using spi0\n");
+    }
+
     int success = SDCARD_init(spi);
     if(!success)
     {
         printf("couldn't initialize SD\n");
         for(;;);
     }
+    printf("SD SPI clock = %u\n", SDCARD_get_clock());
+
+    if(!SDCARD_enable_dma())
+    {
+        printf("SD block transfers will not use DMA\n");
+    }
 
     if(false)
     {
@@ -886,6 +1160,14 @@ int main()
         }
     }
 
+    if(0)
+    {
+        BenchmarkSDWrites(spi);
+        BenchmarkSDWriteLatency(spi);
+        BenchmarkSDErase(spi);
+        BenchmarkSDBackends(spi, pio1, SD_SCK, SD_MOSI, SD_MISO);
+    }
+
     static FATFS gFATVolume;
     gpio_put(SD_CS, 0);
     RoDelayMillis(1);
@@ -895,6 +1177,29 @@ int main()
         for(;;);
     } else {
         printf("Mounted FATFS from SD card successfully.\n");
+        disk_cache_pin_volume(&gFATVolume);
+        disk_prefetch_set_volume(&gFATVolume);
+    }
+
+    if(RAM_DISK_SECTORS > 0)
+    {
+        MountRAMDisk();
+    }
+
+    // ROMs and other assets packed into flash by pack_flash_volume.py
+    static FATFS gFlashVolume;
+    result = f_mount(&gFlashVolume, "2:", 1);
+    if(result != FR_OK) {
+        printf("no flash volume (mount result %d)\n", result);
+    } else {
+        printf("Mounted flash volume as 2:\n");
+    }
+
+    if(0)
+    {
+        FSIZE_t size;
+        const void *rom = disk_flash_map_file("2:/apple2e.rom", &size);
+        printf("2:/apple2e.rom is %lu bytes at %p\n", (unsigned long)size, rom);
     }
 
     multicore_launch_core1(core1_main);
@@ -903,6 +1208,18 @@ int main()
 
     AudioStart();
 
+    if(0)
+    {
+        if(StorageStressPrepare())
+        {
+            multicore_fifo_push_blocking(CORE1_STORAGE_STRESS);
+            int failures = StorageStressReader(1200);
+            uint32_t result = multicore_fifo_pop_blocking();
+            printf("storage stress: core 0 reader %d failures, core 1 writer %s\n", failures,
+                (result == CORE1_OPERATION_SUCCEEDED) ? "passed" : "failed");
+        }
+    }
+
     if(0)
     {
         multicore_fifo_push_blocking(CORE1_AUDIO_TEST);
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "pico/time.h"
+#include "sd_spi.h"
+
+// Raw SD throughput measurements.  Blocks are read first and then written
+// back unchanged, so running these against a formatted card is harmless.
+
+enum {
+    BENCHMARK_FIRST_BLOCK = 0x10000,
+    BENCHMARK_MAX_BLOCKS = 64,
+    BENCHMARK_REPEATS = 4,
+};
+
+static const unsigned int gBenchmarkSizes[] = { 1, 8, 64 };
+
+static unsigned long KBPerSecond(unsigned long bytes, uint64_t micros)
+{
+    if(micros == 0) {
+        return 0;
+    }
+    return (unsigned long)((uint64_t)bytes * 1000000 / 1024 / micros);
+}
+
+// Put back the blocks a failed benchmark may have left erased or half
+// rewritten.
+static void RestoreBlocks(spi_inst_t *spi, const unsigned char *blocks, const char *who)
+{
+    printf("%s: writing blocks back\n", who);
+    if(!SDCARD_writeblocks(spi, BENCHMARK_FIRST_BLOCK, blocks, BENCHMARK_MAX_BLOCKS) ||
+        !SDCARD_wait_ready(spi)) {
+        printf("%s: couldn't write back blocks %d through %d; the card may be corrupt\n", who,
+            BENCHMARK_FIRST_BLOCK, BENCHMARK_FIRST_BLOCK + BENCHMARK_MAX_BLOCKS - 1);
+    }
+}
+
+void BenchmarkSDWrites(spi_inst_t *spi)
+{
+    unsigned char *blocks = malloc(SD_BLOCK_SIZE * BENCHMARK_MAX_BLOCKS);
+    if(blocks == NULL) {
+        printf("BenchmarkSDWrites: couldn't allocate block buffer\n");
+        return;
+    }
+
+    if(!SDCARD_readblocks(spi, BENCHMARK_FIRST_BLOCK, blocks, BENCHMARK_MAX_BLOCKS)) {
+        printf("BenchmarkSDWrites: couldn't read blocks to write back\n");
+        free(blocks);
+        return;
+    }
+
+    int failed = 0;
+    for(unsigned int s = 0; !failed && (s < sizeof(gBenchmarkSizes) / sizeof(gBenchmarkSizes[0])); s++) {
+        unsigned int count = gBenchmarkSizes[s];
+        unsigned long bytes = SD_BLOCK_SIZE * count * BENCHMARK_REPEATS;
+
+        // before: one CMD24 per sector
+        uint64_t started = time_us_64();
+        for(int r = 0; !failed && (r < BENCHMARK_REPEATS); r++) {
+            for(unsigned int i = 0; !failed && (i < count); i++) {
+                if(!SDCARD_writeblock(spi, BENCHMARK_FIRST_BLOCK + i, blocks + SD_BLOCK_SIZE * i)) {
+                    printf("BenchmarkSDWrites: single block write failed\n");
+                    failed = 1;
+                }
+            }
+        }
+        if(failed) {
+            break;
+        }
+        SDCARD_wait_ready(spi);
+        uint64_t single = time_us_64() - started;
+
+        // after: one CMD25 for the whole run
+        started = time_us_64();
+        for(int r = 0; !failed && (r < BENCHMARK_REPEATS); r++) {
+            if(!SDCARD_writeblocks(spi, BENCHMARK_FIRST_BLOCK, blocks, count)) {
+                printf("BenchmarkSDWrites: multiple block write failed\n");
+                failed = 1;
+            }
+        }
+        if(failed) {
+            break;
+        }
+        SDCARD_wait_ready(spi);
+        uint64_t multiple = time_us_64() - started;
+
+        printf("%2u sector writes: CMD24 %lu KB/s, CMD25 %lu KB/s\n", count,
+            KBPerSecond(bytes, single), KBPerSecond(bytes, multiple));
+    }
+
+    // Every write put back what was read, so only a failure leaves the
+    // blocks to restore.
+    if(failed) {
+        RestoreBlocks(spi, blocks, "BenchmarkSDWrites");
+    }
+    free(blocks);
+}
+
+// Writes return once the card accepts the data and the card's programming
+// time is paid at the start of the next command.  Measure how much of each
+// single-sector write that moves off the caller's path.
+void BenchmarkSDWriteLatency(spi_inst_t *spi)
+{
+    unsigned char *blocks = malloc(SD_BLOCK_SIZE * BENCHMARK_MAX_BLOCKS);
+    if(blocks == NULL) {
+        printf("BenchmarkSDWriteLatency: couldn't allocate block buffer\n");
+        return;
+    }
+
+    if(!SDCARD_readblocks(spi, BENCHMARK_FIRST_BLOCK, blocks, BENCHMARK_MAX_BLOCKS)) {
+        printf("BenchmarkSDWriteLatency: couldn't read blocks to write back\n");
+        free(blocks);
+        return;
+    }
+
+    uint64_t accepted = 0;
+    uint64_t busy = 0;
+    for(unsigned int i = 0; i < BENCHMARK_MAX_BLOCKS; i++) {
+        uint64_t started = time_us_64();
+        if(!SDCARD_writeblock(spi, BENCHMARK_FIRST_BLOCK + i, blocks + SD_BLOCK_SIZE * i)) {
+            printf("BenchmarkSDWriteLatency: write failed\n");
+            RestoreBlocks(spi, blocks, "BenchmarkSDWriteLatency");
+            free(blocks);
+            return;
+        }
+        uint64_t returned = time_us_64();
+        SDCARD_wait_ready(spi);
+        uint64_t ready = time_us_64();
+        accepted += returned - started;
+        busy += ready - returned;
+    }
+
+    printf("per sector write: %lu us until accepted, %lu us of card busy deferred\n",
+        (unsigned long)(accepted / BENCHMARK_MAX_BLOCKS), (unsigned long)(busy / BENCHMARK_MAX_BLOCKS));
+
+    free(blocks);
+}
+
+static unsigned long MeasureReadKBPerSecond(spi_inst_t *spi, unsigned char *blocks)
+{
+    uint64_t started = time_us_64();
+    for(int r = 0; r < BENCHMARK_REPEATS; r++) {
+        if(!SDCARD_readblocks(spi, BENCHMARK_FIRST_BLOCK, blocks, BENCHMARK_MAX_BLOCKS)) {
+            return 0;
+        }
+    }
+    return KBPerSecond(SD_BLOCK_SIZE * BENCHMARK_MAX_BLOCKS * BENCHMARK_REPEATS, time_us_64() - started);
+}
+
+// Compare 64-sector CMD18 throughput through the spi0 peripheral and through
+// the sd_spi PIO program, each at the fastest clock it verifies at.  Leaves
+// the backend that was in use when called.
+void BenchmarkSDBackends(spi_inst_t *spi, PIO pio, uint pin_sck, uint pin_mosi, uint pin_miso)
+{
+    unsigned char *blocks = malloc(SD_BLOCK_SIZE * BENCHMARK_MAX_BLOCKS);
+    if(blocks == NULL) {
+        printf("BenchmarkSDBackends: couldn't allocate block buffer\n");
+        return;
+    }
+
+    int was_pio = SDCARD_using_pio_spi();
+
+    SDCARD_use_hardware_spi(spi);
+    SDCARD_select_clock(spi);
+    unsigned int hardware_clock = SDCARD_get_clock();
+    unsigned long hardware_rate = MeasureReadKBPerSecond(spi, blocks);
+
+    if(!SDCARD_use_pio_spi(pio, pin_sck, pin_mosi, pin_miso)) {
+        printf("BenchmarkSDBackends: couldn't start PIO SPI\n");
+        free(blocks);
+        return;
+    }
+    SDCARD_select_clock(spi);
+    unsigned int pio_clock = SDCARD_get_clock();
+    unsigned long pio_rate = MeasureReadKBPerSecond(spi, blocks);
+
+    printf("hardware SPI: %u Hz, %lu KB/s\n", hardware_clock, hardware_rate);
+    printf("PIO SPI:      %u Hz, %lu KB/s\n", pio_clock, pio_rate);
+
+    if(!was_pio) {
+        SDCARD_use_hardware_spi(spi);
+        SDCARD_select_clock(spi);
+    }
+
+    free(blocks);
+}
+
+// Time each single-sector write through the end of programming, as the
+// average and the worst sector.  Returns 0 if a write fails.
+static int MeasureWriteLatency(spi_inst_t *spi, const unsigned char *blocks, unsigned long *average, unsigned long *worst)
+{
+    uint64_t total = 0;
+    uint64_t longest = 0;
+    for(unsigned int i = 0; i < BENCHMARK_MAX_BLOCKS; i++) {
+        uint64_t started = time_us_64();
+        if(!SDCARD_writeblock(spi, BENCHMARK_FIRST_BLOCK + i, blocks + SD_BLOCK_SIZE * i) ||
+            !SDCARD_wait_ready(spi)) {
+            return 0;
+        }
+        uint64_t elapsed = time_us_64() - started;
+        total += elapsed;
+        if(elapsed > longest) {
+            longest = elapsed;
+        }
+    }
+    *average = total / BENCHMARK_MAX_BLOCKS;
+    *worst = longest;
+    return 1;
+}
+
+// Write latency on sectors that have been written before, then on the
+// same sectors right after CMD38 erased them, which is what FatFs's
+// CTRL_TRIM buys freed clusters.  The blocks are written back afterwards.
+void BenchmarkSDErase(spi_inst_t *spi)
+{
+    unsigned long before_average, before_worst, after_average, after_worst;
+
+    unsigned char *blocks = malloc(SD_BLOCK_SIZE * BENCHMARK_MAX_BLOCKS);
+    if(blocks == NULL) {
+        printf("BenchmarkSDErase: couldn't allocate block buffer\n");
+        return;
+    }
+
+    if(!SDCARD_readblocks(spi, BENCHMARK_FIRST_BLOCK, blocks, BENCHMARK_MAX_BLOCKS)) {
+        printf("BenchmarkSDErase: couldn't read blocks to write back\n");
+        free(blocks);
+        return;
+    }
+
+    if(!MeasureWriteLatency(spi, blocks, &before_average, &before_worst)) {
+        printf("BenchmarkSDErase: write failed\n");
+        RestoreBlocks(spi, blocks, "BenchmarkSDErase");
+        free(blocks);
+        return;
+    }
+
+    uint64_t started = time_us_64();
+    if(!SDCARD_erase(spi, BENCHMARK_FIRST_BLOCK, BENCHMARK_FIRST_BLOCK + BENCHMARK_MAX_BLOCKS - 1) ||
+        !SDCARD_wait_ready(spi)) {
+        printf("BenchmarkSDErase: erase failed\n");
+        RestoreBlocks(spi, blocks, "BenchmarkSDErase");
+        free(blocks);
+        return;
+    }
+    uint64_t erase = time_us_64() - started;
+
+    if(!MeasureWriteLatency(spi, blocks, &after_average, &after_worst)) {
+        printf("BenchmarkSDErase: write after erase failed\n");
+        RestoreBlocks(spi, blocks, "BenchmarkSDErase");
+        free(blocks);
+        return;
+    }
+
+    printf("erase of %d sectors: %lu us\n", BENCHMARK_MAX_BLOCKS, (unsigned long)erase);
+    printf("per sector write: %lu us average, %lu us worst before erase; %lu us average, %lu us worst after\n",
+        before_average, before_worst, after_average, after_worst);
+
+    free(blocks);
+}
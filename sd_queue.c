@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include "pico/sync.h"
+#include "sd_spi.h"
+#include "sd_queue.h"
+
+/*--------------------------------------------------------------------------*/
+/* Asynchronous SD block requests ------------------------------------------*/
+
+// Requests are kept in FIFO order on a singly-linked list.  Core 1 drains
+// the list from its idle loop; a core blocked in SDCARD_wait drains it too,
+// so the queue also works before core 1 is launched.  gSDCardBusMutex makes
+// sure only one core at a time drives the SPI.
+
+static spi_inst_t *gSDCardQueueSPI;
+static critical_section_t gSDCardQueueLock;
+static mutex_t gSDCardBusMutex;
+static SDCardRequest *gSDCardQueueHead;
+static SDCardRequest *gSDCardQueueTail;
+
+void SDCARD_queue_init(spi_inst_t *spi)
+{
+    gSDCardQueueSPI = spi;
+    critical_section_init(&gSDCardQueueLock);
+    mutex_init(&gSDCardBusMutex);
+    gSDCardQueueHead = NULL;
+    gSDCardQueueTail = NULL;
+}
+
+int SDCARD_submit(SDCardRequest *request)
+{
+    if((request->state == SD_REQUEST_QUEUED) || (request->state == SD_REQUEST_ACTIVE)) {
+        return 0;
+    }
+
+    request->next = NULL;
+    request->state = SD_REQUEST_QUEUED;
+
+    critical_section_enter_blocking(&gSDCardQueueLock);
+    if(gSDCardQueueTail) {
+        gSDCardQueueTail->next = request;
+    } else {
+        gSDCardQueueHead = request;
+    }
+    gSDCardQueueTail = request;
+    critical_section_exit(&gSDCardQueueLock);
+
+    // Wake core 1 if it is waiting for work.
+    __sev();
+
+    return 1;
+}
+
+int SDCARD_request_done(const SDCardRequest *request)
+{
+    return (request->state == SD_REQUEST_SUCCEEDED) || (request->state == SD_REQUEST_FAILED);
+}
+
+int SDCARD_service_queue(void)
+{
+    if(!mutex_try_enter(&gSDCardBusMutex, NULL)) {
+        return 0;
+    }
+
+    critical_section_enter_blocking(&gSDCardQueueLock);
+    SDCardRequest *request = gSDCardQueueHead;
+    if(request) {
+        gSDCardQueueHead = request->next;
+        if(!gSDCardQueueHead) {
+            gSDCardQueueTail = NULL;
+        }
+        request->state = SD_REQUEST_ACTIVE;
+    }
+    critical_section_exit(&gSDCardQueueLock);
+
+    if(!request) {
+        mutex_exit(&gSDCardBusMutex);
+        return 0;
+    }
+
+    int success;
+    if(request->operation == SD_REQUEST_READ) {
+        success = SDCARD_readblocks(gSDCardQueueSPI, request->blocknum, request->buffer, request->count);
+    } else if(request->operation == SD_REQUEST_WRITE_LIST) {
+        success = SDCARD_writeblock_list(gSDCardQueueSPI, request->blocknum, request->buffers, request->count);
+    } else if(request->operation == SD_REQUEST_ERASE) {
+        success = SDCARD_erase(gSDCardQueueSPI, request->blocknum, request->blocknum + request->count - 1);
+    } else {
+        success = SDCARD_writeblocks(gSDCardQueueSPI, request->blocknum, request->buffer, request->count);
+    }
+
+    mutex_exit(&gSDCardBusMutex);
+
+    // The submitter may reuse the request as soon as state changes, so
+    // pick up the callback first.
+    SDCardRequestCallback callback = request->callback;
+    request->state = success ? SD_REQUEST_SUCCEEDED : SD_REQUEST_FAILED;
+    __sev();
+
+    if(callback) {
+        callback(request);
+    }
+
+    return 1;
+}
+
+int SDCARD_queue_card_busy(void)
+{
+    // Someone is using the bus, so the card is certainly not free.
+    if(!mutex_try_enter(&gSDCardBusMutex, NULL)) {
+        return 1;
+    }
+    int busy = SDCARD_busy(gSDCardQueueSPI);
+    mutex_exit(&gSDCardBusMutex);
+    return busy;
+}
+
+int SDCARD_wait(SDCardRequest *request)
+{
+    while(!SDCARD_request_done(request)) {
+        if(!SDCARD_service_queue()) {
+            tight_loop_contents();
+        }
+    }
+    return request->state == SD_REQUEST_SUCCEEDED;
+}
+
+int SDCARD_queue_readblocks(unsigned int blocknum, unsigned char *blocks, unsigned int count)
+{
+    SDCardRequest request = {
+        .operation = SD_REQUEST_READ,
+        .blocknum = blocknum,
+        .count = count,
+        .buffer = blocks,
+    };
+    SDCARD_submit(&request);
+    return SDCARD_wait(&request);
+}
+
+int SDCARD_queue_writeblocks(unsigned int blocknum, const unsigned char *blocks, unsigned int count)
+{
+    SDCardRequest request = {
+        .operation = SD_REQUEST_WRITE,
+        .blocknum = blocknum,
+        .count = count,
+        .buffer = (unsigned char *)blocks,
+    };
+    SDCARD_submit(&request);
+    return SDCARD_wait(&request);
+}
+
+int SDCARD_queue_writeblock_list(unsigned int blocknum, const unsigned char *const *blocks, unsigned int count)
+{
+    SDCardRequest request = {
+        .operation = SD_REQUEST_WRITE_LIST,
+        .blocknum = blocknum,
+        .count = count,
+        .buffers = blocks,
+    };
+    SDCARD_submit(&request);
+    return SDCARD_wait(&request);
+}
+
+int SDCARD_queue_erase(unsigned int blocknum, unsigned int count)
+{
+    SDCardRequest request = {
+        .operation = SD_REQUEST_ERASE,
+        .blocknum = blocknum,
+        .count = count,
+    };
+    SDCARD_submit(&request);
+    return SDCARD_wait(&request);
+}
@@ -0,0 +1,74 @@
+#ifndef __SD_QUEUE_H__
+#define __SD_QUEUE_H__
+
+#include "hardware/spi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+enum SDCardRequestOperation {
+    SD_REQUEST_READ,
+    SD_REQUEST_WRITE,
+    SD_REQUEST_WRITE_LIST,              /* blocks from "buffers" */
+    SD_REQUEST_ERASE,                   /* no buffer */
+};
+
+enum SDCardRequestState {
+    SD_REQUEST_IDLE = 0,
+    SD_REQUEST_QUEUED,
+    SD_REQUEST_ACTIVE,
+    SD_REQUEST_SUCCEEDED,
+    SD_REQUEST_FAILED,
+};
+
+struct SDCardRequest;
+typedef void (*SDCardRequestCallback)(struct SDCardRequest *request);
+
+// Caller owns the request and its buffer until the request completes.
+// The callback (optional) runs on whichever core serviced the request,
+// after "state" has its final value; a request with a callback must stay
+// valid until the callback has run.
+typedef struct SDCardRequest {
+    enum SDCardRequestOperation operation;
+    unsigned int blocknum;
+    unsigned int count;
+    unsigned char *buffer;              /* count * SD_BLOCK_SIZE bytes */
+    const unsigned char *const *buffers; /* SD_REQUEST_WRITE_LIST: count blocks */
+    SDCardRequestCallback callback;
+    void *user;
+    volatile enum SDCardRequestState state;
+    struct SDCardRequest *next;         /* private */
+} SDCardRequest;
+
+void SDCARD_queue_init(spi_inst_t *spi);
+
+// Returns 0 if the request is already queued or active.
+int SDCARD_submit(SDCardRequest *request);
+
+// Returns 1 once the request has succeeded or failed.
+int SDCARD_request_done(const SDCardRequest *request);
+
+// Block until the request completes, servicing the queue from this core
+// if nobody else is.  Returns 1 on success.
+int SDCARD_wait(SDCardRequest *request);
+
+// Run the request at the head of the queue if the SD bus is free.
+// Returns 1 if a request was run.  Called from core 1's idle loop.
+int SDCARD_service_queue(void);
+
+// Returns 1 while a request is running or the card is still programming
+// the last write.
+int SDCARD_queue_card_busy(void);
+
+// Blocking wrappers used by diskio.c.
+int SDCARD_queue_readblocks(unsigned int blocknum, unsigned char *blocks, unsigned int count);
+int SDCARD_queue_writeblocks(unsigned int blocknum, const unsigned char *blocks, unsigned int count);
+int SDCARD_queue_writeblock_list(unsigned int blocknum, const unsigned char *const *blocks, unsigned int count);
+int SDCARD_queue_erase(unsigned int blocknum, unsigned int count);
+
+#ifdef __cplusplus
+};
+#endif /* __cplusplus */
+
+#endif /* __SD_QUEUE_H__ */
@@ -1,6 +1,16 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include "hardware/dma.h"
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
+#include "hardware/structs/scb.h"
+#include "pico/sync.h"
+#include "pico/time.h"
+#include "rocinante.pio.h"
 #include "sd_spi.h"
 #include "crc7.h"
 #include "rocinante.h"
@@ -34,6 +44,157 @@ void logprintf(int level, char *fmt, ...)
     }
 }
 
+/*--------------------------------------------------------------------------*/
+/* SPI backend -------------------------------------------------------------*/
+
+// The card is normally driven by the spi_inst_t handed to every SDCARD_
+// function.  SDCARD_use_pio_spi switches to the sd_spi PIO program instead,
+// after which that argument is ignored.
+static PIO gSDCardPIO = NULL;
+static uint gSDCardPIOSM;
+static uint gSDCardPIOOffset;
+static uint gSDCardPIOPins[3]; /* SCK, MOSI, MISO */
+static unsigned int gSDCardClockHz;
+
+enum {
+    SD_INIT_CLOCK_HZ = 400000,
+    SD_PIO_CYCLES_PER_BIT = 3,
+};
+
+// Exchange len bytes with the PIO state machine.  tx NULL sends tx_repeat,
+// rx NULL drops what comes back.
+static void SDCARD_pio_transfer(const unsigned char *tx, unsigned char tx_repeat, unsigned char *rx, size_t len)
+{
+    io_rw_8 *txfifo = (io_rw_8 *)&gSDCardPIO->txf[gSDCardPIOSM];
+    io_rw_8 *rxfifo = (io_rw_8 *)&gSDCardPIO->rxf[gSDCardPIOSM];
+    size_t tx_remain = len;
+    size_t rx_remain = len;
+
+    while(tx_remain || rx_remain) {
+        if(tx_remain && !pio_sm_is_tx_fifo_full(gSDCardPIO, gSDCardPIOSM)) {
+            *txfifo = tx ? *tx++ : tx_repeat;
+            tx_remain--;
+        }
+        if(rx_remain && !pio_sm_is_rx_fifo_empty(gSDCardPIO, gSDCardPIOSM)) {
+            unsigned char c = *rxfifo;
+            if(rx) *rx++ = c;
+            rx_remain--;
+        }
+    }
+}
+
+static void SDCARD_spi_read(spi_inst_t *spi, unsigned char repeated_tx, unsigned char *dst, size_t len)
+{
+    if(gSDCardPIO) {
+        SDCARD_pio_transfer(NULL, repeated_tx, dst, len);
+    } else {
+        spi_read_blocking(spi, repeated_tx, dst, len);
+    }
+}
+
+static void SDCARD_spi_write(spi_inst_t *spi, const unsigned char *src, size_t len)
+{
+    if(gSDCardPIO) {
+        SDCARD_pio_transfer(src, 0, NULL, len);
+    } else {
+        spi_write_blocking(spi, src, len);
+    }
+}
+
+static void SDCARD_spi_write_read(spi_inst_t *spi, const unsigned char *src, unsigned char *dst, size_t len)
+{
+    if(gSDCardPIO) {
+        SDCARD_pio_transfer(src, 0, dst, len);
+    } else {
+        spi_write_read_blocking(spi, src, dst, len);
+    }
+}
+
+static unsigned int SDCARD_spi_set_baudrate(spi_inst_t *spi, unsigned int baudrate)
+{
+    if(gSDCardPIO) {
+        uint32_t per_bit = clock_get_hz(clk_sys) / baudrate;
+        uint32_t clkdiv = (per_bit + SD_PIO_CYCLES_PER_BIT - 1) / SD_PIO_CYCLES_PER_BIT;
+        if(clkdiv < 1) clkdiv = 1;
+        if(clkdiv > 0xFFFF) clkdiv = 0xFFFF;
+        pio_sm_set_clkdiv_int_frac(gSDCardPIO, gSDCardPIOSM, clkdiv, 0);
+        gSDCardClockHz = clock_get_hz(clk_sys) / (SD_PIO_CYCLES_PER_BIT * clkdiv);
+    } else {
+        gSDCardClockHz = spi_set_baudrate(spi, baudrate);
+    }
+    return gSDCardClockHz;
+}
+
+// Step "step" (1 is fastest) of the clocks the current backend can make.
+// The hardware SPI divides clk_peri by an even number; the PIO program
+// divides clk_sys by SD_PIO_CYCLES_PER_BIT times an integer clkdiv.
+static unsigned int SDCARD_spi_clock_step(unsigned int step)
+{
+    if(gSDCardPIO) {
+        return clock_get_hz(clk_sys) / (SD_PIO_CYCLES_PER_BIT * step);
+    } else {
+        return clock_get_hz(clk_peri) / (2 * step);
+    }
+}
+
+unsigned int SDCARD_get_clock(void)
+{
+    return gSDCardClockHz;
+}
+
+int SDCARD_using_pio_spi(void)
+{
+    return gSDCardPIO != NULL;
+}
+
+int SDCARD_use_pio_spi(PIO pio, uint pin_sck, uint pin_mosi, uint pin_miso)
+{
+    if(gSDCardPIO) {
+        return 1;
+    }
+    if(!pio_can_add_program(pio, &sd_spi_program)) {
+        logprintf(DEBUG_WARNINGS, "SDCARD_use_pio_spi: no room for the sd_spi program\n");
+        return 0;
+    }
+    int sm = pio_claim_unused_sm(pio, false);
+    if(sm < 0) {
+        logprintf(DEBUG_WARNINGS, "SDCARD_use_pio_spi: no free state machine\n");
+        return 0;
+    }
+
+    unsigned int baudrate = gSDCardClockHz ? gSDCardClockHz : SD_INIT_CLOCK_HZ;
+    uint32_t clkdiv = (clock_get_hz(clk_sys) / baudrate + SD_PIO_CYCLES_PER_BIT - 1) / SD_PIO_CYCLES_PER_BIT;
+
+    gSDCardPIOSM = sm;
+    gSDCardPIOOffset = pio_add_program(pio, &sd_spi_program);
+    gSDCardPIOPins[0] = pin_sck;
+    gSDCardPIOPins[1] = pin_mosi;
+    gSDCardPIOPins[2] = pin_miso;
+    sd_spi_program_init(pio, sm, gSDCardPIOOffset, pin_sck, pin_mosi, pin_miso, clkdiv);
+    gSDCardPIO = pio;
+    gSDCardClockHz = clock_get_hz(clk_sys) / (SD_PIO_CYCLES_PER_BIT * clkdiv);
+
+    return 1;
+}
+
+void SDCARD_use_hardware_spi(spi_inst_t *spi)
+{
+    if(!gSDCardPIO) {
+        return;
+    }
+    pio_sm_set_enabled(gSDCardPIO, gSDCardPIOSM, false);
+    pio_remove_program(gSDCardPIO, &sd_spi_program, gSDCardPIOOffset);
+    pio_sm_unclaim(gSDCardPIO, gSDCardPIOSM);
+    // sd_spi_program_init bypassed MISO's input synchronizer; another
+    // program given the pin later would expect it back.
+    hw_clear_bits(&gSDCardPIO->input_sync_bypass, 1u << gSDCardPIOPins[2]);
+    for(int i = 0; i < 3; i++) {
+        gpio_set_function(gSDCardPIOPins[i], GPIO_FUNC_SPI);
+    }
+    gSDCardPIO = NULL;
+    gSDCardClockHz = spi_get_baudrate(spi);
+}
+
 /*--------------------------------------------------------------------------*/
 /* SD card -----------------------------------------------------------------*/
 extern void spi_enable_cs();
@@ -45,16 +206,112 @@ const unsigned char gSPIReadDummy = 0xFF;
 // cribbed somewhat from http://elm-chan.org/docs/mmc/mmc_e.html
 enum SDCardCommand {
     CMD0 = 0,    // init; go to idle state
+    CMD6 = 6,    // check or switch card function (high speed)
     CMD8 = 8,    // send interface condition
+    CMD9 = 9,    // send card-specific data (CSD)
+    CMD10 = 10,  // send card identification (CID)
+    CMD12 = 12,  // stop transmission (ends CMD18)
+    CMD13 = 13,  // send status; as ACMD13, send SD status
+    CMD16 = 16,  // set block length (byte-addressed cards)
     CMD17 = 17,  // read single block
+    CMD18 = 18,  // read multiple blocks
     CMD24 = 24,  // write single block
+    CMD25 = 25,  // write multiple blocks
+    CMD32 = 32,  // set first block to erase
+    CMD33 = 33,  // set last block to erase
+    CMD38 = 38,  // erase the blocks set by CMD32 and CMD33
     CMD55 = 55,  // prefix command for application command
+    CMD58 = 58,  // read OCR
+    ACMD13 = 13, // application command to send SD status
+    ACMD23 = 23, // application command to set number of blocks to pre-erase
     ACMD41 = 41, // application command to send operating condition
 };
 const unsigned char gSDCardResponseIDLE = 0x01;
+const unsigned char gSDCardResponseILLEGAL_COMMAND = 0x04;
 const unsigned char gSDCardResponseSUCCESS = 0x00;
 const unsigned char gSDCardResponseDATA_ACCEPTED = 0xE5;
 const unsigned char gSDCardToken_17_18_24 = 0xFE;
+const unsigned char gSDCardToken_25 = 0xFC;
+const unsigned char gSDCardToken_StopTran = 0xFD;
+
+// Counted from whichever core is driving the card, so a snapshot taken on
+// the other core can be a transfer out of date.
+static SDCardTelemetry gSDCardTelemetry;
+
+void SDCARD_get_telemetry(SDCardTelemetry *telemetry)
+{
+    *telemetry = gSDCardTelemetry;
+}
+
+void SDCARD_reset_telemetry(void)
+{
+    memset(&gSDCardTelemetry, 0, sizeof(gSDCardTelemetry));
+}
+
+// Wait for DO to go high.  Polls in small bursts and only looks at the
+// clock between bursts, since each byte is well under a microsecond.
+static int SDCARD_wait_not_busy(spi_inst_t *spi, const char *who, int timeout_millis)
+{
+    static unsigned char response[8];
+    int count = 0;
+    uint64_t started = time_us_64();
+
+    int then = RoGetMillis();
+    for(;;) {
+        SDCARD_spi_read(spi, gSPIReadDummy, response, sizeof(response));
+        logprintf(DEBUG_ALL, "%s response 0x%02X\n", who, response[sizeof(response) - 1]);
+        count += sizeof(response);
+        if(response[sizeof(response) - 1] == 0xFF) {
+            break;
+        }
+        int now = RoGetMillis();
+        if(now - then > timeout_millis) {
+            logprintf(DEBUG_ERRORS, "%s: timed out waiting on completion\n", who);
+            gSDCardTelemetry.timeouts++;
+            gSDCardTelemetry.busy_wait_us += time_us_64() - started;
+            return 0;
+        }
+    }
+    logprintf(DEBUG_DATA, "read %d SPI bytes waiting on %s to complete.\n", count, who);
+    gSDCardTelemetry.busy_wait_us += time_us_64() - started;
+
+    return 1;
+}
+
+// A write returns as soon as the card has accepted the data, leaving the
+// card programming (holding DO low).  The next command waits for it, so the
+// caller can do other work in the meantime.  An erase does the same, and
+// may take much longer than gSDCardTimeoutMillis.
+static int gSDCardBusyAfterWrite = 0;
+static int gSDCardBusyExtraMillis = 0;
+
+int SDCARD_busy(spi_inst_t *spi)
+{
+    static unsigned char response[1];
+
+    if(!gSDCardBusyAfterWrite) {
+        return 0;
+    }
+    SDCARD_spi_read(spi, gSPIReadDummy, response, 1);
+    if(response[0] == 0xFF) {
+        gSDCardBusyAfterWrite = 0;
+        gSDCardBusyExtraMillis = 0;
+    }
+    return gSDCardBusyAfterWrite;
+}
+
+int SDCARD_wait_ready(spi_inst_t *spi)
+{
+    if(!gSDCardBusyAfterWrite) {
+        return 1;
+    }
+    if(!SDCARD_wait_not_busy(spi, "SDCARD_wait_ready", gSDCardTimeoutMillis + gSDCardBusyExtraMillis)) {
+        return 0;
+    }
+    gSDCardBusyAfterWrite = 0;
+    gSDCardBusyExtraMillis = 0;
+    return 1;
+}
 
 // response length must include initial R1, so 1 for CMD0
 int SDCARD_send_command(spi_inst_t *spi, enum SDCardCommand command, unsigned long parameter, unsigned char *response, int response_length)
@@ -63,8 +320,15 @@ int SDCARD_send_command(spi_inst_t *spi, enum SDCardCommand command, unsigned lo
     static unsigned char command_buffer_read[6];
 
     // command_buffer[0] = 0xff;
-    // spi_write_blocking(spi, command_buffer, 1);
+    // SDCARD_spi_write(spi, command_buffer, 1);
+
+    // Finish any programming left over from the last write.
+    if(!SDCARD_wait_ready(spi)) {
+        logprintf(DEBUG_ERRORS, "SDCARD_send_command: card still busy from previous write\n");
+        return 0;
+    }
 
+    gSDCardTelemetry.commands++;
     command_buffer[0] = 0x40 | command;
     command_buffer[1] = (parameter >> 24) & 0xff;
     command_buffer[2] = (parameter >> 16) & 0xff;
@@ -76,30 +340,60 @@ int SDCARD_send_command(spi_inst_t *spi, enum SDCardCommand command, unsigned lo
         command_buffer[0] & 0x3F, command_buffer[0], command_buffer[1], command_buffer[2],
         command_buffer[3], command_buffer[4], command_buffer[5]);
 
-    spi_write_read_blocking(spi, command_buffer, command_buffer_read, sizeof(command_buffer));
+    SDCARD_spi_write_read(spi, command_buffer, command_buffer_read, sizeof(command_buffer));
     logprintf(DEBUG_ALL, "returned in buffer: %02X %02X %02X %02X %02X %02X\n",
         command_buffer_read[0], command_buffer_read[1], command_buffer_read[2],
         command_buffer_read[3], command_buffer_read[4], command_buffer_read[5]);
 
+    // The card is still streaming data when CMD12 arrives, so the byte
+    // after the command is a stuff byte and not the start of R1.
+    if(command == CMD12) {
+        SDCARD_spi_read(spi, gSPIReadDummy, response, 1);
+    }
+
     int then = RoGetMillis();
     do {
         int now = RoGetMillis();
         if(now - then > gSDCardTimeoutMillis) {
             logprintf(DEBUG_ERRORS, "SDCARD_send_command: timed out waiting on response\n");
-            panic("SD timeout");
+            gSDCardTelemetry.timeouts++;
+            return 0;
         }
         response[0] = 0xff;
-        spi_read_blocking(spi, gSPIReadDummy, response, 1);
+        SDCARD_spi_read(spi, gSPIReadDummy, response, 1);
         logprintf(DEBUG_ALL, "response 0x%02X\n", response[0]);
     } while(response[0] & 0x80);
 
     if(response_length > 1) {
-        spi_read_blocking(spi, gSPIReadDummy, response + 1, response_length - 1);
+        SDCARD_spi_read(spi, gSPIReadDummy, response + 1, response_length - 1);
     }
 
     return 1;
 }
 
+static int gSDCardType = 0;
+static unsigned long gSDCardOCR = 0;
+
+int SDCARD_get_type(void)
+{
+    return gSDCardType;
+}
+
+unsigned long SDCARD_get_ocr(void)
+{
+    return gSDCardOCR;
+}
+
+// Command argument for a block: SDHC/SDXC take the block number, SDSC
+// takes a byte offset.
+static unsigned long SDCARD_address(unsigned int blocknum)
+{
+    return (gSDCardType & SD_CARD_TYPE_BLOCK) ? blocknum : (unsigned long)blocknum * SD_BLOCK_SIZE;
+}
+
+static int SDCARD_read_registers(spi_inst_t *spi);
+static int SDCARD_switch_high_speed(spi_inst_t *spi);
+
 // precondition: SD card CS is high (disabled)
 // postcondition: SD card CS is low (enabled)
 int SDCARD_init(spi_inst_t *spi)
@@ -107,12 +401,15 @@ int SDCARD_init(spi_inst_t *spi)
     static unsigned char response[8];
     unsigned long OCR;
 
+    // Cards start out in open-drain mode and need 400KHz or less.
+    SDCARD_spi_set_baudrate(spi, SD_INIT_CLOCK_HZ);
+
     spi_disable_cs();
     /* CS false, 80 clk pulses (read 10 bytes) */
     static unsigned char buffer[10];
     for(unsigned int u = 0; u < sizeof(buffer); u++)
         buffer[u] = 0xff;
-    spi_write_blocking(spi, buffer, sizeof(buffer));
+    SDCARD_spi_write(spi, buffer, sizeof(buffer));
 
     spi_enable_cs();
     /* interface init */
@@ -127,14 +424,17 @@ int SDCARD_init(spi_inst_t *spi)
     /* check voltage */
     if(!SDCARD_send_command(spi, CMD8, 0x000001AA, response, 5))
         return 0;
-    if(response[0] != gSDCardResponseIDLE) {
+    if(response[0] == (gSDCardResponseIDLE | gSDCardResponseILLEGAL_COMMAND)) {
+        // Version 1 card; these predate CMD8 and are always byte-addressed.
+        gSDCardType = SD_CARD_TYPE_SD1;
+    } else if(response[0] != gSDCardResponseIDLE) {
         logprintf(DEBUG_WARNINGS, "SDCARD_init: failed to get OCR, response was 0x%02X\n", response[0]);
         return 0;
+    } else {
+        gSDCardType = SD_CARD_TYPE_SD2;
+        OCR = (((unsigned long)response[1]) << 24) | (((unsigned long)response[2]) << 16) | (((unsigned long)response[3]) << 8) | (((unsigned long)response[4]) << 0);
+        logprintf(DEBUG_DATA, "SDCARD_init: OCR response is 0x%08lX\n", OCR);
     }
-    OCR = (((unsigned long)response[1]) << 24) | (((unsigned long)response[2]) << 16) | (((unsigned long)response[3]) << 8) | (((unsigned long)response[4]) << 0);
-    logprintf(DEBUG_DATA, "SDCARD_init: OCR response is 0x%08lX\n", OCR);
-
-    // should get CSD, CID, print information about them
 
     // Ask the card to initialize itself, and wait for it to get out of idle mode.
     int then = RoGetMillis();
@@ -151,99 +451,350 @@ int SDCARD_init(spi_inst_t *spi)
             logprintf(DEBUG_WARNINGS, "SDCARD_init: not in IDLE mode for CMD55, response was 0x%02X\n", response[0]);
             return 0;
         }
-        /* start initialization process, set HCS (high-capacity) */
-        if(!SDCARD_send_command(spi, ACMD41, 0x40000000, response, 1))
+        /* start initialization process, set HCS (high-capacity) if card knows about it */
+        if(!SDCARD_send_command(spi, ACMD41, (gSDCardType & SD_CARD_TYPE_SD2) ? 0x40000000 : 0, response, 1))
             return 0;
     } while(response[0] != gSDCardResponseSUCCESS);
     logprintf(DEBUG_ALL, "returned from ACMD41: %02X\n", response[0]);
 
-    // After init, we should be able to set the clock as
-    // high as 25MHz.
-    spi_set_baudrate(spi, 25000000);
+    // Card Capacity Status in the real OCR says whether the card takes
+    // block numbers (SDHC/SDXC) or byte offsets (SDSC) as addresses.
+    if(gSDCardType & SD_CARD_TYPE_SD2) {
+        if(!SDCARD_send_command(spi, CMD58, 0, response, 5))
+            return 0;
+        if(response[0] != gSDCardResponseSUCCESS) {
+            logprintf(DEBUG_WARNINGS, "SDCARD_init: failed to read OCR, response was 0x%02X\n", response[0]);
+            return 0;
+        }
+        gSDCardOCR = (((unsigned long)response[1]) << 24) | (((unsigned long)response[2]) << 16) | (((unsigned long)response[3]) << 8) | (((unsigned long)response[4]) << 0);
+        if(gSDCardOCR & 0x40000000) {
+            gSDCardType |= SD_CARD_TYPE_BLOCK;
+        }
+    }
+    if(!(gSDCardType & SD_CARD_TYPE_BLOCK)) {
+        // Byte-addressed cards can have other block lengths; insist on ours.
+        if(!SDCARD_send_command(spi, CMD16, SD_BLOCK_SIZE, response, 1))
+            return 0;
+        if(response[0] != gSDCardResponseSUCCESS) {
+            logprintf(DEBUG_WARNINGS, "SDCARD_init: failed to set block length, response was 0x%02X\n", response[0]);
+            return 0;
+        }
+    }
+    logprintf(DEBUG_EVENTS, "SDCARD_init: SD%s card, %s addressing\n",
+        (gSDCardType & SD_CARD_TYPE_SD2) ? "v2" : "v1",
+        (gSDCardType & SD_CARD_TYPE_BLOCK) ? "block" : "byte");
+
+    // Read CSD and CID at the init clock, try for high speed mode, and then
+    // go as fast as the card and clk_peri allow.
+    if(!SDCARD_read_registers(spi))
+        return 0;
+    SDCARD_switch_high_speed(spi);
+    SDCARD_select_clock(spi);
+
+    return 1;
+}
+
+/*--------------------------------------------------------------------------*/
+/* DMA data phase ----------------------------------------------------------*/
+
+// When enabled, the SD_BLOCK_SIZE payload of each data packet is clocked by a
+// pair of DMA channels instead of the CPU.  The channels are claimed at normal
+// priority so the NTSC scanout stream (high priority) always wins arbitration.
+// The receive channel raises DMA_IRQ_1 when it's done.  No core enables that
+// IRQ; it only wakes the waiting core from __wfe, so DMA_IRQ_0 stays with
+// the video ISR.
+static int gSDCardDMATxChannel = -1;
+static int gSDCardDMARxChannel = -1;
+static unsigned char gSDCardDMASink;
+
+int SDCARD_enable_dma(void)
+{
+    if(gSDCardDMATxChannel >= 0) {
+        return 1;
+    }
 
+    int tx = dma_claim_unused_channel(false);
+    int rx = dma_claim_unused_channel(false);
+    if((tx < 0) || (rx < 0)) {
+        logprintf(DEBUG_WARNINGS, "SDCARD_enable_dma: no free DMA channels, staying with programmed I/O\n");
+        if(tx >= 0) dma_channel_unclaim(tx);
+        if(rx >= 0) dma_channel_unclaim(rx);
+        return 0;
+    }
+
+    gSDCardDMATxChannel = tx;
+    gSDCardDMARxChannel = rx;
+    dma_channel_set_irq1_enabled(rx, true);
     return 1;
 }
 
+void SDCARD_disable_dma(void)
+{
+    if(gSDCardDMATxChannel < 0) {
+        return;
+    }
+    dma_channel_set_irq1_enabled(gSDCardDMARxChannel, false);
+    dma_channel_acknowledge_irq1(gSDCardDMARxChannel);
+    dma_channel_unclaim(gSDCardDMATxChannel);
+    dma_channel_unclaim(gSDCardDMARxChannel);
+    gSDCardDMATxChannel = -1;
+    gSDCardDMARxChannel = -1;
+}
+
+// Move one block through the SPI data register.  For a read, "tx" is NULL and
+// 0xFF is clocked out; for a write, "rx" is NULL and received bytes are
+// dropped.  The DMA sniffer watches the channel carrying the payload and
+// returns its CRC16-CCITT, which is the SD data CRC.
+//
+// The calling core sleeps in __wfe until the block is through instead of
+// spinning on the channel's busy bit.  It still waits the whole transfer;
+// the emulator only runs alongside because SD requests are serviced on
+// core 1 (sd_queue.c).
+static unsigned short SDCARD_dma_transfer(spi_inst_t *spi, const unsigned char *tx, unsigned char *rx)
+{
+    uint tx_chan = gSDCardDMATxChannel;
+    uint rx_chan = gSDCardDMARxChannel;
+
+    volatile void *tx_fifo;
+    const volatile void *rx_fifo;
+    uint tx_dreq, rx_dreq;
+    if(gSDCardPIO) {
+        tx_fifo = (io_rw_8 *)&gSDCardPIO->txf[gSDCardPIOSM];
+        rx_fifo = (io_rw_8 *)&gSDCardPIO->rxf[gSDCardPIOSM];
+        tx_dreq = pio_get_dreq(gSDCardPIO, gSDCardPIOSM, true);
+        rx_dreq = pio_get_dreq(gSDCardPIO, gSDCardPIOSM, false);
+    } else {
+        tx_fifo = &spi_get_hw(spi)->dr;
+        rx_fifo = &spi_get_hw(spi)->dr;
+        tx_dreq = spi_get_dreq(spi, true);
+        rx_dreq = spi_get_dreq(spi, false);
+    }
+
+    dma_channel_config tx_config = dma_channel_get_default_config(tx_chan);
+    channel_config_set_transfer_data_size(&tx_config, DMA_SIZE_8);
+    channel_config_set_dreq(&tx_config, tx_dreq);
+    channel_config_set_read_increment(&tx_config, tx != NULL);
+    channel_config_set_write_increment(&tx_config, false);
+    channel_config_set_sniff_enable(&tx_config, tx != NULL);
+
+    dma_channel_config rx_config = dma_channel_get_default_config(rx_chan);
+    channel_config_set_transfer_data_size(&rx_config, DMA_SIZE_8);
+    channel_config_set_dreq(&rx_config, rx_dreq);
+    channel_config_set_read_increment(&rx_config, false);
+    channel_config_set_write_increment(&rx_config, rx != NULL);
+    channel_config_set_sniff_enable(&rx_config, rx != NULL);
+
+    dma_channel_configure(tx_chan, &tx_config, tx_fifo,
+        tx ? tx : &gSPIReadDummy, SD_BLOCK_SIZE, false);
+    dma_channel_configure(rx_chan, &rx_config,
+        rx ? rx : &gSDCardDMASink, rx_fifo, SD_BLOCK_SIZE, false);
+
+    dma_hw->sniff_data = 0;
+    dma_sniffer_enable(tx ? tx_chan : rx_chan, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
+
+    // SEVONPEND makes DMA_IRQ_1 becoming pending a wakeup event, even
+    // though it's disabled.  It has to be clear beforehand to become
+    // pending again.
+    dma_channel_acknowledge_irq1(rx_chan);
+    irq_clear(DMA_IRQ_1);
+    hw_set_bits(&scb_hw->scr, M0PLUS_SCR_SEVONPEND_BITS);
+
+    dma_start_channel_mask((1u << tx_chan) | (1u << rx_chan));
+    while(dma_channel_is_busy(rx_chan)) {
+        __wfe();
+    }
+
+    dma_sniffer_disable();
+    return dma_hw->sniff_data & 0xFFFF;
+}
+
+// Read SD_BLOCK_SIZE payload bytes and return our CRC of them.
+static unsigned short SDCARD_receive_data(spi_inst_t *spi, unsigned char *block)
+{
+    uint64_t started = time_us_64();
+    unsigned short crc;
+
+    if(gSDCardDMARxChannel >= 0) {
+        crc = SDCARD_dma_transfer(spi, NULL, block);
+    } else {
+        SDCARD_spi_read(spi, gSPIReadDummy, block, SD_BLOCK_SIZE);
+        crc = crc_itu_t(0, block, SD_BLOCK_SIZE);
+    }
+    gSDCardTelemetry.data_us += time_us_64() - started;
+    return crc;
+}
+
+// Send SD_BLOCK_SIZE payload bytes followed by the data CRC.
+static void SDCARD_send_data(spi_inst_t *spi, const unsigned char *block)
+{
+    static unsigned char crc[2];
+    uint64_t started = time_us_64();
+
+    if(gSDCardDMATxChannel >= 0) {
+        // The sniffer gives us the real CRC for free.
+        unsigned short crc_ours = SDCARD_dma_transfer(spi, block, NULL);
+        crc[0] = crc_ours >> 8;
+        crc[1] = crc_ours & 0xff;
+    } else {
+        SDCARD_spi_write(spi, block, SD_BLOCK_SIZE);
+        // junk CRC
+        crc[0] = 0xff;
+        crc[1] = 0xff;
+    }
+    SDCARD_spi_write(spi, crc, 2);
+    gSDCardTelemetry.data_us += time_us_64() - started;
+}
+
 void dump_more_spi_bytes(spi_inst_t *spi, const char *why)
 {
     static unsigned char response[8];
-    spi_read_blocking(spi, gSPIReadDummy, response, sizeof(response));
+    SDCARD_spi_read(spi, gSPIReadDummy, response, sizeof(response));
     printf("trailing %s: %02X %02X %02X %02X %02X %02X %02X %02X\n", why,
         response[0], response[1], response[2], response[3],
         response[4], response[5], response[6], response[7]);
 }
 
-/* precondition: SDcard CS is low (active) */
-int SDCARD_readblock(spi_inst_t *spi, unsigned int blocknum, unsigned char *block)
+// Wait for the start block token that precedes every data packet from the card.
+static int SDCARD_wait_for_data_token(spi_inst_t *spi, const char *who)
 {
-    static unsigned char response[8];
+    static unsigned char response[1];
+    uint64_t started = time_us_64();
 
-    // Send read block command.
-    response[0] = 0xff;
-    if(!SDCARD_send_command(spi, CMD17, blocknum, response, 1))
-        return 0;
-    if(response[0] != gSDCardResponseSUCCESS) {
-        logprintf(DEBUG_ERRORS, "SDCARD_readblock: failed to respond with SUCCESS, response was 0x%02X\n", response[0]);
-        return 0;
-    }
-
-    // Wait for the data token.
     int then = RoGetMillis();
     do {
         int now = RoGetMillis();
         if(now - then > gSDCardTimeoutMillis) {
-            logprintf(DEBUG_ERRORS, "SDCARD_readblock: timed out waiting for data token\n");
+            logprintf(DEBUG_ERRORS, "%s: timed out waiting for data token\n", who);
+            gSDCardTelemetry.timeouts++;
+            gSDCardTelemetry.token_wait_us += time_us_64() - started;
             return 0;
         }
-        spi_read_blocking(spi, gSPIReadDummy, response, 1);
-        logprintf(DEBUG_ALL, "readblock response 0x%02X\n", response[0]);
+        SDCARD_spi_read(spi, gSPIReadDummy, response, 1);
+        logprintf(DEBUG_ALL, "%s response 0x%02X\n", who, response[0]);
     } while(response[0] != gSDCardToken_17_18_24);
 
-    // Read data.
-    spi_read_blocking(spi, gSPIReadDummy, block, SD_BLOCK_SIZE);
+    gSDCardTelemetry.token_wait_us += time_us_64() - started;
+    return 1;
+}
+
+// Read one data packet (token, SD_BLOCK_SIZE bytes, CRC) following CMD17
+// or during CMD18.
+static int SDCARD_read_data_packet(spi_inst_t *spi, unsigned char *block, const char *who)
+{
+    static unsigned char response[8];
+
+    if(!SDCARD_wait_for_data_token(spi, who))
+        return 0;
+
+    // Read data, calculating our version of CRC.
+    unsigned short crc_ours = SDCARD_receive_data(spi, block);
 
     // Read CRC
-    spi_read_blocking(spi, gSPIReadDummy, response, 2);
+    SDCARD_spi_read(spi, gSPIReadDummy, response, 2);
     logprintf(DEBUG_DATA, "CRC is 0x%02X%02X\n", response[0], response[1]);
 
     unsigned short crc_theirs = response[0] * 256 + response[1];
 
-    // calculate our version of CRC and compare
-    unsigned short crc_ours = crc_itu_t(0, block, SD_BLOCK_SIZE);
+    // compare
 
     if(crc_theirs != crc_ours) {
         logprintf(DEBUG_ERRORS, "CRC mismatch (theirs %04X versus ours %04X, reporting failure)\n", crc_theirs, crc_ours);
+        gSDCardTelemetry.crc_failures++;
         return 0;
     } else {
         logprintf(DEBUG_DATA, "CRC matches\n");
     }
+    gSDCardTelemetry.sectors_read++;
+
+    return 1;
+}
+
+/* precondition: SDcard CS is low (active) */
+int SDCARD_readblock(spi_inst_t *spi, unsigned int blocknum, unsigned char *block)
+{
+    static unsigned char response[8];
+
+    // Send read block command.
+    response[0] = 0xff;
+    if(!SDCARD_send_command(spi, CMD17, SDCARD_address(blocknum), response, 1))
+        return 0;
+    if(response[0] != gSDCardResponseSUCCESS) {
+        logprintf(DEBUG_ERRORS, "SDCARD_readblock: failed to respond with SUCCESS, response was 0x%02X\n", response[0]);
+        return 0;
+    }
+
+    if(!SDCARD_read_data_packet(spi, block, "SDCARD_readblock"))
+        return 0;
 
     // Wait for DO to go high. I don't think we need to do this for block reads,
     // but I don't think it'll hurt.
-    then = RoGetMillis();
-    do {
-        int now = RoGetMillis();
-        if(now - then > gSDCardTimeoutMillis) {
-            logprintf(DEBUG_ERRORS, "SDCARD_readblock: timed out waiting on completion\n");
-            return 0;
-        }
-        spi_read_blocking(spi, gSPIReadDummy, response, 1);
-        logprintf(DEBUG_ALL, "readblock response 0x%02X\n", response[0]);
-    } while(response[0] != 0xFF);
+    if(!SDCARD_wait_not_busy(spi, "SDCARD_readblock", gSDCardTimeoutMillis))
+        return 0;
 
     if(gDebugLevel >= DEBUG_ALL) dump_more_spi_bytes(spi, "read completion");
 
     return 1;
 }
 
+/* precondition: SDcard CS is low (active) */
+int SDCARD_readblocks(spi_inst_t *spi, unsigned int blocknum, unsigned char *blocks, unsigned int count)
+{
+    static unsigned char response[8];
+
+    if(count == 1) {
+        return SDCARD_readblock(spi, blocknum, blocks);
+    }
+
+    // Send read multiple block command.
+    if(!SDCARD_send_command(spi, CMD18, SDCARD_address(blocknum), response, 1))
+        return 0;
+    if(response[0] != gSDCardResponseSUCCESS) {
+        logprintf(DEBUG_ERRORS, "SDCARD_readblocks: failed to respond with SUCCESS, response was 0x%02X\n", response[0]);
+        return 0;
+    }
+
+    // Card streams packets back to back until it sees CMD12.
+    int success = 1;
+    for(unsigned int i = 0; i < count; i++) {
+        if(!SDCARD_read_data_packet(spi, blocks + SD_BLOCK_SIZE * i, "SDCARD_readblocks")) {
+            logprintf(DEBUG_ERRORS, "SDCARD_readblocks: failed on block %u of %u\n", i, count);
+            success = 0;
+            break;
+        }
+    }
+
+    // Stop transmission even on failure so the card goes back to transfer state.
+    if(!SDCARD_send_command(spi, CMD12, 0, response, 1))
+        return 0;
+    if(response[0] != gSDCardResponseSUCCESS) {
+        logprintf(DEBUG_ERRORS, "SDCARD_readblocks: CMD12 failed to respond with SUCCESS, response was 0x%02X\n", response[0]);
+        return 0;
+    }
+
+    // R1b; card holds DO low while busy.
+    if(!SDCARD_wait_not_busy(spi, "SDCARD_readblocks", gSDCardTimeoutMillis))
+        return 0;
+
+    if(gDebugLevel >= DEBUG_ALL) dump_more_spi_bytes(spi, "read multiple completion");
+
+    return success;
+}
+
+// Data response 0bxxx0sss1 with status 101 means the card saw a bad CRC.
+static void SDCARD_count_rejected_data(unsigned char response)
+{
+    if((response & 0x1F) == 0x0B) {
+        gSDCardTelemetry.crc_failures++;
+    }
+}
+
 /* precondition: SDcard CS is low (active) */
 int SDCARD_writeblock(spi_inst_t *spi, unsigned int blocknum, const unsigned char *block)
 {
-    int count;
     static unsigned char response[8];
 
     // Send write block command.
-    if(!SDCARD_send_command(spi, CMD24, blocknum, response, 1))
+    if(!SDCARD_send_command(spi, CMD24, SDCARD_address(blocknum), response, 1))
         return 0;
     if(response[0] != gSDCardResponseSUCCESS) {
         logprintf(DEBUG_ERRORS, "SDCARD_writeblock: failed to respond with SUCCESS, response was 0x%02X\n", response[0]);
@@ -253,40 +804,447 @@ int SDCARD_writeblock(spi_inst_t *spi, unsigned int blocknum, const unsigned cha
 
     // Data token.
     response[0] = gSDCardToken_17_18_24;
-    spi_write_blocking(spi, response, 1);
+    SDCARD_spi_write(spi, response, 1);
 
-    // Send data.
-    spi_write_blocking(spi, block, SD_BLOCK_SIZE);
-
-    // junk CRC
-    response[0] = 0xff;
-    response[1] = 0xff;
-    spi_write_blocking(spi, response, 2);
+    // Send data and CRC.
+    SDCARD_send_data(spi, block);
 
     // Get DATA_ACCEPTED response from WRITE
-    spi_read_blocking(spi, gSPIReadDummy, response, 1);
+    SDCARD_spi_read(spi, gSPIReadDummy, response, 1);
     logprintf(DEBUG_DATA, "writeblock response 0x%02X\n", response[0]);
     if(response[0] != gSDCardResponseDATA_ACCEPTED) {
         logprintf(DEBUG_ERRORS, "SDCARD_writeblock: failed to respond with DATA_ACCEPTED, response was 0x%02X\n", response[0]);
+        SDCARD_count_rejected_data(response[0]);
         return 0;
     }
+    gSDCardTelemetry.sectors_written++;
 
-    // Wait while busy (DO = low).
-    int then = RoGetMillis();
-    count = 0;
-    do {
-        int now = RoGetMillis();
-        if(now - then > gSDCardTimeoutMillis) {
-            logprintf(DEBUG_ERRORS, "SDCARD_writeblock: timed out waiting on completion\n");
-            panic("SD timeout");
-        }
-        spi_read_blocking(spi, gSPIReadDummy, response, 1);
-        logprintf(DEBUG_ALL, "writeblock completion 0x%02X\n", response[0]);
-        count++;
-    } while(response[0] != 0xFF);
-    logprintf(DEBUG_DATA, "read %d SPI bytes waiting on write to complete.\n", count);
+    // Don't wait while busy (DO = low); the next command will.
+    gSDCardBusyAfterWrite = 1;
 
     if(gDebugLevel >= DEBUG_ALL) dump_more_spi_bytes(spi, "write completion");
 
     return 1;
 }
+
+// Send one data packet (token, SD_BLOCK_SIZE bytes, CRC) during CMD25 and
+// wait for the card to finish programming it.
+static int SDCARD_write_data_packet(spi_inst_t *spi, const unsigned char *block, const char *who)
+{
+    static unsigned char response[2];
+
+    // Data token.
+    response[0] = gSDCardToken_25;
+    SDCARD_spi_write(spi, response, 1);
+
+    // Send data and CRC.
+    SDCARD_send_data(spi, block);
+
+    // Get DATA_ACCEPTED response
+    SDCARD_spi_read(spi, gSPIReadDummy, response, 1);
+    logprintf(DEBUG_DATA, "%s response 0x%02X\n", who, response[0]);
+    if(response[0] != gSDCardResponseDATA_ACCEPTED) {
+        logprintf(DEBUG_ERRORS, "%s: failed to respond with DATA_ACCEPTED, response was 0x%02X\n", who, response[0]);
+        SDCARD_count_rejected_data(response[0]);
+        return 0;
+    }
+    gSDCardTelemetry.sectors_written++;
+
+    // Card must finish programming before it takes the next token.
+    return SDCARD_wait_not_busy(spi, who, gSDCardTimeoutMillis);
+}
+
+// Write "count" consecutive blocks starting at blocknum, taking block i
+// from block_list[i] if block_list is not NULL and from
+// blocks + SD_BLOCK_SIZE * i otherwise.
+static int SDCARD_write_multiple(spi_inst_t *spi, unsigned int blocknum, const unsigned char *blocks, const unsigned char *const *block_list, unsigned int count)
+{
+    static unsigned char response[8];
+
+    if(count == 1) {
+        return SDCARD_writeblock(spi, blocknum, block_list ? block_list[0] : blocks);
+    }
+
+    // Tell the card how many blocks are coming so it can pre-erase them.
+    // This is only a hint, so a failure here is not fatal.
+    if(!SDCARD_send_command(spi, CMD55, 0x00000000, response, 1))
+        return 0;
+    if(response[0] == gSDCardResponseSUCCESS) {
+        if(!SDCARD_send_command(spi, ACMD23, count, response, 1))
+            return 0;
+        if(response[0] != gSDCardResponseSUCCESS) {
+            logprintf(DEBUG_WARNINGS, "SDCARD_writeblocks: ACMD23 response was 0x%02X\n", response[0]);
+        }
+    } else {
+        logprintf(DEBUG_WARNINGS, "SDCARD_writeblocks: CMD55 response was 0x%02X\n", response[0]);
+    }
+
+    // Send write multiple block command.
+    if(!SDCARD_send_command(spi, CMD25, SDCARD_address(blocknum), response, 1))
+        return 0;
+    if(response[0] != gSDCardResponseSUCCESS) {
+        logprintf(DEBUG_ERRORS, "SDCARD_writeblocks: failed to respond with SUCCESS, response was 0x%02X\n", response[0]);
+        return 0;
+    }
+
+    // One byte gap before the first data token.
+    SDCARD_spi_read(spi, gSPIReadDummy, response, 1);
+
+    int success = 1;
+    for(unsigned int i = 0; i < count; i++) {
+        const unsigned char *block = block_list ? block_list[i] : (blocks + SD_BLOCK_SIZE * i);
+        if(!SDCARD_write_data_packet(spi, block, "SDCARD_writeblocks")) {
+            logprintf(DEBUG_ERRORS, "SDCARD_writeblocks: failed on block %u of %u\n", i, count);
+            success = 0;
+            break;
+        }
+    }
+
+    // Stop transmission even on failure so the card goes back to transfer state.
+    response[0] = gSDCardToken_StopTran;
+    SDCARD_spi_write(spi, response, 1);
+
+    // Card starts signalling busy one byte after the stop token; leave
+    // that for the next command.
+    SDCARD_spi_read(spi, gSPIReadDummy, response, 1);
+    gSDCardBusyAfterWrite = 1;
+
+    if(gDebugLevel >= DEBUG_ALL) dump_more_spi_bytes(spi, "write multiple completion");
+
+    return success;
+}
+
+/* precondition: SDcard CS is low (active) */
+int SDCARD_writeblocks(spi_inst_t *spi, unsigned int blocknum, const unsigned char *blocks, unsigned int count)
+{
+    return SDCARD_write_multiple(spi, blocknum, blocks, NULL, count);
+}
+
+// Like SDCARD_writeblocks, but the blocks don't have to be adjacent in memory.
+/* precondition: SDcard CS is low (active) */
+int SDCARD_writeblock_list(spi_inst_t *spi, unsigned int blocknum, const unsigned char *const *blocks, unsigned int count)
+{
+    return SDCARD_write_multiple(spi, blocknum, NULL, blocks, count);
+}
+
+/*--------------------------------------------------------------------------*/
+/* Card registers and clock selection --------------------------------------*/
+
+static unsigned char gSDCardCSD[16];
+static unsigned char gSDCardCID[16];
+static unsigned long gSDCardSectorCount;
+static unsigned long gSDCardEraseBlockSectors;
+
+// The SPI clock comes in steps set by the backend (see
+// SDCARD_spi_clock_step).  Anything the card allows is tried from fastest
+// down, and the first one that reads back the reference blocks correctly is
+// kept.
+enum {
+    SD_DEFAULT_SPEED_HZ = 25000000,
+    SD_HIGH_SPEED_HZ = 50000000,
+    SD_SLOWEST_TRIED_HZ = 5000000,
+    SD_VERIFY_BLOCKS = 4,
+    SD_VERIFY_PASSES = 4,
+};
+
+const unsigned char *SDCARD_get_csd(void)
+{
+    return gSDCardCSD;
+}
+
+const unsigned char *SDCARD_get_cid(void)
+{
+    return gSDCardCID;
+}
+
+unsigned long SDCARD_get_sector_count(void)
+{
+    return gSDCardSectorCount;
+}
+
+unsigned long SDCARD_get_erase_block_sectors(void)
+{
+    return gSDCardEraseBlockSectors;
+}
+
+// Read a short data packet (CSD, CID, switch status) sent in response to command.
+static int SDCARD_read_short_data(spi_inst_t *spi, enum SDCardCommand command, unsigned long parameter, unsigned char *data, int length, const char *who)
+{
+    static unsigned char response[2];
+
+    if(!SDCARD_send_command(spi, command, parameter, response, 1))
+        return 0;
+    if(response[0] != gSDCardResponseSUCCESS) {
+        logprintf(DEBUG_WARNINGS, "%s: failed to respond with SUCCESS, response was 0x%02X\n", who, response[0]);
+        return 0;
+    }
+    if(!SDCARD_wait_for_data_token(spi, who))
+        return 0;
+
+    SDCARD_spi_read(spi, gSPIReadDummy, data, length);
+    SDCARD_spi_read(spi, gSPIReadDummy, response, 2);
+
+    unsigned short crc_theirs = response[0] * 256 + response[1];
+    unsigned short crc_ours = crc_itu_t(0, data, length);
+    if(crc_theirs != crc_ours) {
+        logprintf(DEBUG_ERRORS, "%s: CRC mismatch (theirs %04X versus ours %04X)\n", who, crc_theirs, crc_ours);
+        gSDCardTelemetry.crc_failures++;
+        return 0;
+    }
+
+    return 1;
+}
+
+// Maximum clock from the CSD TRAN_SPEED field.
+static unsigned long SDCARD_csd_max_clock(void)
+{
+    static const unsigned long unit[8] = { 10000, 100000, 1000000, 10000000, 0, 0, 0, 0 };
+    static const unsigned char value_x10[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+
+    unsigned char tran_speed = gSDCardCSD[3];
+    return unit[tran_speed & 0x7] * value_x10[(tran_speed >> 3) & 0xF];
+}
+
+// Capacity in SD_BLOCK_SIZE sectors from C_SIZE (and C_SIZE_MULT, READ_BL_LEN
+// on version 1 CSDs).
+static unsigned long SDCARD_csd_sector_count(void)
+{
+    const unsigned char *csd = gSDCardCSD;
+
+    if((csd[0] >> 6) == 1) {
+        unsigned long c_size = ((unsigned long)(csd[7] & 0x3F) << 16) | (csd[8] << 8) | csd[9];
+        return (c_size + 1) << 10;
+    } else {
+        unsigned long c_size = ((csd[6] & 0x3) << 10) | (csd[7] << 2) | (csd[8] >> 6);
+        unsigned int c_size_mult = ((csd[9] & 0x3) << 1) | (csd[10] >> 7);
+        unsigned int read_bl_len = csd[5] & 0xF;
+        return (c_size + 1) << (c_size_mult + 2 + read_bl_len - 9);
+    }
+}
+
+// AU_SIZE from the SD status, in sectors, per the Physical Layer spec:
+// 16KB doubling up to 8MB, then 12, 16, 24, 32, and 64MB for SDXC.
+static const unsigned long SDCARD_au_sectors[16] = {
+    0, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384,
+    24576, 32768, 49152, 65536, 131072,
+};
+
+// Erase unit in sectors.  Version 2 cards report the allocation unit in the
+// SD status (ACMD13); version 1 cards have SECTOR_SIZE in the CSD.
+static unsigned long SDCARD_erase_block_sectors(spi_inst_t *spi)
+{
+    static unsigned char status[64];
+    static unsigned char response[1];
+    const unsigned char *csd = gSDCardCSD;
+
+    if(gSDCardType & SD_CARD_TYPE_SD2) {
+        // ACMD13 answers with R2; the second status byte is skipped while
+        // looking for the data token.
+        if(SDCARD_send_command(spi, CMD55, 0, response, 1) && (response[0] == gSDCardResponseSUCCESS) &&
+            SDCARD_read_short_data(spi, ACMD13, 0, status, sizeof(status), "SDCARD_erase_block_sectors")) {
+            return SDCARD_au_sectors[status[10] >> 4];
+        }
+        return 0;
+    } else {
+        unsigned int sector_size = ((csd[10] & 0x3F) << 1) | (csd[11] >> 7);
+        unsigned int write_bl_len = ((csd[12] & 0x3) << 2) | (csd[13] >> 6);
+        return (unsigned long)(sector_size + 1) << (write_bl_len - 9);
+    }
+}
+
+static int SDCARD_read_registers(spi_inst_t *spi)
+{
+    if(!SDCARD_read_short_data(spi, CMD9, 0, gSDCardCSD, sizeof(gSDCardCSD), "SDCARD_read_registers (CSD)"))
+        return 0;
+    if(!SDCARD_read_short_data(spi, CMD10, 0, gSDCardCID, sizeof(gSDCardCID), "SDCARD_read_registers (CID)"))
+        return 0;
+
+    logprintf(DEBUG_EVENTS, "SD card: manufacturer 0x%02X, OEM %c%c, product %c%c%c%c%c rev %d.%d, serial 0x%02X%02X%02X%02X, made %d/%d\n",
+        gSDCardCID[0], gSDCardCID[1], gSDCardCID[2],
+        gSDCardCID[3], gSDCardCID[4], gSDCardCID[5], gSDCardCID[6], gSDCardCID[7],
+        gSDCardCID[8] >> 4, gSDCardCID[8] & 0xF,
+        gSDCardCID[9], gSDCardCID[10], gSDCardCID[11], gSDCardCID[12],
+        gSDCardCID[14] & 0xF, 2000 + (((gSDCardCID[13] & 0xF) << 4) | (gSDCardCID[14] >> 4)));
+    logprintf(DEBUG_EVENTS, "SD card: CSD version %d, TRAN_SPEED 0x%02X (%lu Hz)\n",
+        (gSDCardCSD[0] >> 6) + 1, gSDCardCSD[3], SDCARD_csd_max_clock());
+
+    gSDCardSectorCount = SDCARD_csd_sector_count();
+    gSDCardEraseBlockSectors = SDCARD_erase_block_sectors(spi);
+    logprintf(DEBUG_EVENTS, "SD card: %lu sectors, erase block %lu sectors\n",
+        gSDCardSectorCount, gSDCardEraseBlockSectors);
+
+    return 1;
+}
+
+// Ask for function group 1 function 1 (high speed, 50MHz) with CMD6.
+static int SDCARD_switch_high_speed(spi_inst_t *spi)
+{
+    static unsigned char status[64];
+
+    // Card command class 10 (switch) is CCC bit 10.
+    unsigned int ccc = (gSDCardCSD[4] << 4) | (gSDCardCSD[5] >> 4);
+    if(!(ccc & (1 << 10))) {
+        logprintf(DEBUG_EVENTS, "SDCARD_switch_high_speed: card does not support CMD6\n");
+        return 0;
+    }
+
+    // Check mode first so a card that can't do it is left untouched.
+    if(!SDCARD_read_short_data(spi, CMD6, 0x00FFFFF1, status, sizeof(status), "SDCARD_switch_high_speed (check)"))
+        return 0;
+    if(!(status[13] & 0x02)) {
+        logprintf(DEBUG_EVENTS, "SDCARD_switch_high_speed: card does not support high speed\n");
+        return 0;
+    }
+
+    if(!SDCARD_read_short_data(spi, CMD6, 0x80FFFFF1, status, sizeof(status), "SDCARD_switch_high_speed (switch)"))
+        return 0;
+    if((status[16] & 0xF) != 1) {
+        logprintf(DEBUG_WARNINGS, "SDCARD_switch_high_speed: switch refused, function 0x%X\n", status[16] & 0xF);
+        return 0;
+    }
+
+    // Switch takes effect within 8 clocks; CSD TRAN_SPEED now reflects it.
+    SDCARD_spi_read(spi, gSPIReadDummy, status, 1);
+    if(!SDCARD_read_short_data(spi, CMD9, 0, gSDCardCSD, sizeof(gSDCardCSD), "SDCARD_switch_high_speed (CSD)"))
+        return 0;
+
+    logprintf(DEBUG_EVENTS, "SDCARD_switch_high_speed: now in high speed mode, TRAN_SPEED 0x%02X\n", gSDCardCSD[3]);
+    return 1;
+}
+
+// Put the card back in transfer state after a garbled exchange.
+static void SDCARD_recover(spi_inst_t *spi)
+{
+    static unsigned char response[1];
+
+    SDCARD_spi_set_baudrate(spi, SD_INIT_CLOCK_HZ);
+    gSDCardBusyAfterWrite = 0;
+    gSDCardBusyExtraMillis = 0;
+    if(SDCARD_send_command(spi, CMD12, 0, response, 1)) {
+        SDCARD_wait_not_busy(spi, "SDCARD_recover", gSDCardTimeoutMillis);
+    }
+}
+
+unsigned int SDCARD_select_clock(spi_inst_t *spi)
+{
+    unsigned long card_hz = SDCARD_csd_max_clock();
+    if((card_hz == 0) || (card_hz > SD_HIGH_SPEED_HZ)) {
+        card_hz = SD_DEFAULT_SPEED_HZ;
+    }
+
+    unsigned char *reference = malloc(2 * SD_VERIFY_BLOCKS * SD_BLOCK_SIZE);
+    if(reference == NULL) {
+        logprintf(DEBUG_WARNINGS, "SDCARD_select_clock: no memory to verify, using %lu Hz\n", card_hz);
+        return SDCARD_spi_set_baudrate(spi, card_hz);
+    }
+    unsigned char *readback = reference + SD_VERIFY_BLOCKS * SD_BLOCK_SIZE;
+
+    // Reference copy at the init clock, which is known to work.
+    if(!SDCARD_readblocks(spi, 0, reference, SD_VERIFY_BLOCKS)) {
+        logprintf(DEBUG_WARNINGS, "SDCARD_select_clock: couldn't read reference blocks, using %lu Hz\n", card_hz);
+        free(reference);
+        return SDCARD_spi_set_baudrate(spi, card_hz);
+    }
+
+    unsigned int chosen = 0;
+    for(unsigned int step = 1; SDCARD_spi_clock_step(step) >= SD_SLOWEST_TRIED_HZ; step++) {
+        if(SDCARD_spi_clock_step(step) > card_hz) {
+            continue;
+        }
+        unsigned int actual = SDCARD_spi_set_baudrate(spi, SDCARD_spi_clock_step(step));
+
+        int good = 1;
+        for(int pass = 0; good && (pass < SD_VERIFY_PASSES); pass++) {
+            good = SDCARD_readblocks(spi, 0, readback, SD_VERIFY_BLOCKS) &&
+                (memcmp(reference, readback, SD_VERIFY_BLOCKS * SD_BLOCK_SIZE) == 0);
+        }
+        if(good) {
+            chosen = actual;
+            break;
+        }
+
+        logprintf(DEBUG_WARNINGS, "SDCARD_select_clock: read verify failed at %u Hz\n", actual);
+        SDCARD_recover(spi);
+    }
+
+    free(reference);
+
+    if(chosen == 0) {
+        logprintf(DEBUG_WARNINGS, "SDCARD_select_clock: no clock verified, staying at %d Hz\n", SD_INIT_CLOCK_HZ);
+        return SDCARD_spi_set_baudrate(spi, SD_INIT_CLOCK_HZ);
+    }
+
+    logprintf(DEBUG_EVENTS, "SDCARD_select_clock: SPI clock %u Hz (card allows %lu Hz)\n", chosen, card_hz);
+    return chosen;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Erase -------------------------------------------------------------------*/
+
+enum {
+    SD_ERASE_MILLIS_PER_AU = 250, /* SD spec allowance when the card doesn't say */
+};
+
+// Erase blocks first through last with CMD32, CMD33, and CMD38, so later
+// writes there skip the card's read-modify-write.  Erased blocks read back
+// as all zeros or all ones, depending on the card.  Like a write this
+// returns once the card has the command and leaves it busy; the next
+// command waits.
+//
+// Byte-addressed cards without ERASE_BLK_EN can only erase whole erase
+// sectors (CSD SECTOR_SIZE), so the range shrinks to the sectors inside it
+// and may come out empty.
+int SDCARD_erase(spi_inst_t *spi, unsigned int first, unsigned int last)
+{
+    static unsigned char response[1];
+    const unsigned char *csd = gSDCardCSD;
+
+    if(last < first) {
+        return 0;
+    }
+
+    // Card command class 5 (erase) is CCC bit 5.
+    unsigned int ccc = (csd[4] << 4) | (csd[5] >> 4);
+    if(!(ccc & (1 << 5))) {
+        logprintf(DEBUG_WARNINGS, "SDCARD_erase: card does not support erase\n");
+        return 0;
+    }
+
+    if(((csd[0] >> 6) == 0) && !(csd[10] & 0x40)) {
+        unsigned int write_bl_len = ((csd[12] & 0x3) << 2) | (csd[13] >> 6);
+        unsigned long unit = ((((csd[10] & 0x3F) << 1) | (csd[11] >> 7)) + 1UL) << (write_bl_len - 9);
+        unsigned long start = (first + unit - 1) / unit * unit;
+        unsigned long end = ((unsigned long)last + 1) / unit * unit;
+        if(start >= end) {
+            return 1;
+        }
+        first = start;
+        last = end - 1;
+    }
+
+    if(!SDCARD_send_command(spi, CMD32, SDCARD_address(first), response, 1))
+        return 0;
+    if(response[0] != gSDCardResponseSUCCESS) {
+        logprintf(DEBUG_ERRORS, "SDCARD_erase: CMD32 failed to respond with SUCCESS, response was 0x%02X\n", response[0]);
+        return 0;
+    }
+    if(!SDCARD_send_command(spi, CMD33, SDCARD_address(last), response, 1))
+        return 0;
+    if(response[0] != gSDCardResponseSUCCESS) {
+        logprintf(DEBUG_ERRORS, "SDCARD_erase: CMD33 failed to respond with SUCCESS, response was 0x%02X\n", response[0]);
+        return 0;
+    }
+    if(!SDCARD_send_command(spi, CMD38, 0, response, 1))
+        return 0;
+    if(response[0] != gSDCardResponseSUCCESS) {
+        logprintf(DEBUG_ERRORS, "SDCARD_erase: CMD38 failed to respond with SUCCESS, response was 0x%02X\n", response[0]);
+        return 0;
+    }
+
+    // R1b; the card holds DO low until the erase is done.
+    unsigned long unit = gSDCardEraseBlockSectors ? gSDCardEraseBlockSectors : 8192;
+    gSDCardBusyExtraMillis = SD_ERASE_MILLIS_PER_AU * (1 + (last - first) / unit);
+    gSDCardBusyAfterWrite = 1;
+
+    return 1;
+}
@@ -1,12 +1,52 @@
 #ifndef __SD_SPI_H__
 #define __SD_SPI_H__
 
+#include <stdint.h>
 #include "hardware/spi.h"
+#include "hardware/pio.h"
 
 #define SD_BLOCK_SIZE 512 // XXX can actually be something different?
 
+/* SDCARD_get_type() flags */
+#define SD_CARD_TYPE_SD1    0x02    /* SD version 1 */
+#define SD_CARD_TYPE_SD2    0x04    /* SD version 2 or later */
+#define SD_CARD_TYPE_BLOCK  0x08    /* block addressing (SDHC/SDXC) */
+
+/* SDCARD_get_telemetry() counters, since boot or the last reset */
+typedef struct SDCardTelemetry {
+    unsigned long commands;
+    unsigned long sectors_read;
+    unsigned long sectors_written;
+    unsigned long crc_failures;     /* read CRC mismatches and writes rejected for CRC */
+    unsigned long timeouts;
+    uint64_t token_wait_us;         /* waiting for the card to start a data packet */
+    uint64_t data_us;               /* clocking data packets */
+    uint64_t busy_wait_us;          /* waiting for the card to release DO */
+} SDCardTelemetry;
+
 int SDCARD_readblock(spi_inst_t *spi, unsigned int blocknum, unsigned char *block);
+int SDCARD_readblocks(spi_inst_t *spi, unsigned int blocknum, unsigned char *blocks, unsigned int count);
 int SDCARD_writeblock(spi_inst_t *spi, unsigned int blocknum, const unsigned char *block);
+int SDCARD_writeblocks(spi_inst_t *spi, unsigned int blocknum, const unsigned char *blocks, unsigned int count);
+int SDCARD_writeblock_list(spi_inst_t *spi, unsigned int blocknum, const unsigned char *const *blocks, unsigned int count);
+int SDCARD_erase(spi_inst_t *spi, unsigned int first, unsigned int last);
 int SDCARD_init(spi_inst_t *spi);
+const unsigned char *SDCARD_get_csd(void);
+const unsigned char *SDCARD_get_cid(void);
+int SDCARD_get_type(void);
+unsigned long SDCARD_get_ocr(void);
+unsigned long SDCARD_get_sector_count(void);
+unsigned long SDCARD_get_erase_block_sectors(void);
+int SDCARD_busy(spi_inst_t *spi);
+int SDCARD_wait_ready(spi_inst_t *spi);
+int SDCARD_enable_dma(void);
+void SDCARD_disable_dma(void);
+int SDCARD_use_pio_spi(PIO pio, uint pin_sck, uint pin_mosi, uint pin_miso);
+void SDCARD_use_hardware_spi(spi_inst_t *spi);
+int SDCARD_using_pio_spi(void);
+unsigned int SDCARD_select_clock(spi_inst_t *spi);
+unsigned int SDCARD_get_clock(void);
+void SDCARD_get_telemetry(SDCardTelemetry *telemetry);
+void SDCARD_reset_telemetry(void);
 
 #endif /* __SD_SPI_H__ */
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "ff.h"
+
+// FatFs stress test for running the filesystem on both cores at once.
+// One core writes, reads back, and deletes files in STRESS_DIR while the
+// other seeks around in and reads files that StorageStressPrepare made,
+// and lists the directory.  Every byte read is checked.  Each side
+// returns the number of failures it saw.
+
+#define STRESS_DIR "0:/stress"
+
+enum {
+    STRESS_READER_FILES = 4,
+    STRESS_READER_FILE_SIZE = 16 * 1024,
+    STRESS_WRITER_FILES = 4,
+    STRESS_WRITER_FILE_SIZE = 24 * 1024,
+    STRESS_CHUNK = 1024,
+};
+
+static unsigned char StressByte(unsigned int seed, unsigned long offset)
+{
+    return (seed * 131 + offset * 7 + (offset >> 8)) & 0xFF;
+}
+
+static void StressFill(unsigned char *buffer, unsigned int seed, unsigned long offset, unsigned int length)
+{
+    for(unsigned int i = 0; i < length; i++) {
+        buffer[i] = StressByte(seed, offset + i);
+    }
+}
+
+static int StressCheck(const unsigned char *buffer, unsigned int seed, unsigned long offset, unsigned int length)
+{
+    for(unsigned int i = 0; i < length; i++) {
+        if(buffer[i] != StressByte(seed, offset + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint32_t StressRandom(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int StressWriteFile(const char *path, unsigned int seed, unsigned long size)
+{
+    static unsigned char chunk[STRESS_CHUNK];
+    FIL file;
+    UINT wrote;
+
+    if(f_open(&file, path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+        return 0;
+    }
+    for(unsigned long offset = 0; offset < size; offset += STRESS_CHUNK) {
+        StressFill(chunk, seed, offset, STRESS_CHUNK);
+        if((f_write(&file, chunk, STRESS_CHUNK, &wrote) != FR_OK) || (wrote != STRESS_CHUNK)) {
+            f_close(&file);
+            return 0;
+        }
+    }
+    return f_close(&file) == FR_OK;
+}
+
+// Make the reader's files.  Call before starting either side.
+int StorageStressPrepare(void)
+{
+    char path[32];
+
+    FRESULT result = f_mkdir(STRESS_DIR);
+    if((result != FR_OK) && (result != FR_EXIST)) {
+        printf("StorageStressPrepare: couldn't make %s, result %d\n", STRESS_DIR, result);
+        return 0;
+    }
+    for(int i = 0; i < STRESS_READER_FILES; i++) {
+        sprintf(path, STRESS_DIR "/r%d.bin", i);
+        if(!StressWriteFile(path, i, STRESS_READER_FILE_SIZE)) {
+            printf("StorageStressPrepare: couldn't write %s\n", path);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Write, verify, and now and then delete the writer's files.
+int StorageStressWriter(int iterations)
+{
+    static unsigned char chunk[STRESS_CHUNK];
+    char path[32];
+    int failures = 0;
+
+    for(int i = 0; i < iterations; i++) {
+        unsigned int seed = 1000 + i;
+        sprintf(path, STRESS_DIR "/w%d.bin", i % STRESS_WRITER_FILES);
+        if(!StressWriteFile(path, seed, STRESS_WRITER_FILE_SIZE)) {
+            printf("StorageStressWriter: couldn't write %s\n", path);
+            failures++;
+            continue;
+        }
+
+        FIL file;
+        UINT got;
+        if(f_open(&file, path, FA_READ) != FR_OK) {
+            printf("StorageStressWriter: couldn't reopen %s\n", path);
+            failures++;
+            continue;
+        }
+        for(unsigned long offset = 0; offset < STRESS_WRITER_FILE_SIZE; offset += STRESS_CHUNK) {
+            if((f_read(&file, chunk, STRESS_CHUNK, &got) != FR_OK) || (got != STRESS_CHUNK) ||
+                !StressCheck(chunk, seed, offset, STRESS_CHUNK)) {
+                printf("StorageStressWriter: %s doesn't read back at %lu\n", path, offset);
+                failures++;
+                break;
+            }
+        }
+        f_close(&file);
+
+        if((i % 3) == 2) {
+            if(f_unlink(path) != FR_OK) {
+                printf("StorageStressWriter: couldn't remove %s\n", path);
+                failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+// Random seeks and reads in the reader's files, with a directory listing
+// every so often.
+int StorageStressReader(int iterations)
+{
+    static unsigned char chunk[STRESS_CHUNK];
+    char path[32];
+    uint32_t random = 1;
+    int failures = 0;
+
+    for(int i = 0; i < iterations; i++) {
+        if((i % 16) == 15) {
+            DIR dir;
+            FILINFO info;
+            int entries = 0;
+            if(f_opendir(&dir, STRESS_DIR) != FR_OK) {
+                printf("StorageStressReader: couldn't open %s\n", STRESS_DIR);
+                failures++;
+                continue;
+            }
+            while((f_readdir(&dir, &info) == FR_OK) && (info.fname[0] != '\0')) {
+                entries++;
+            }
+            f_closedir(&dir);
+            if(entries < STRESS_READER_FILES) {
+                printf("StorageStressReader: only %d entries in %s\n", entries, STRESS_DIR);
+                failures++;
+            }
+            continue;
+        }
+
+        unsigned int which = StressRandom(&random) % STRESS_READER_FILES;
+        unsigned long offset = StressRandom(&random) % (STRESS_READER_FILE_SIZE - STRESS_CHUNK);
+        FIL file;
+        UINT got;
+        sprintf(path, STRESS_DIR "/r%u.bin", which);
+        if(f_open(&file, path, FA_READ) != FR_OK) {
+            printf("StorageStressReader: couldn't open %s\n", path);
+            failures++;
+            continue;
+        }
+        if((f_lseek(&file, offset) != FR_OK) ||
+            (f_read(&file, chunk, STRESS_CHUNK, &got) != FR_OK) || (got != STRESS_CHUNK) ||
+            !StressCheck(chunk, which, offset, STRESS_CHUNK)) {
+            printf("StorageStressReader: %s doesn't read back at %lu\n", path, offset);
+            failures++;
+        }
+        f_close(&file);
+    }
+    return failures;
+}
@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
@@ -16,6 +17,7 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <pico/stdio.h>
+#include <pico/sync.h>
 
 #include "ff.h"
 
@@ -43,10 +45,174 @@ void _exit (int status)
 
 #ifdef USE_FATFS
 
-#define MAX_FILES 4
-enum { FD_OFFSET = 3 };
-static FIL files[MAX_FILES];    /* starting with fd=3, so fd 3 through 3 + MAX_FILES - 1 */
-static int filesOpened[MAX_FILES];
+/* With FF_FS_TINY a FIL has no sector buffer of its own; partial-sector
+   file data goes through the volume's window, and the sector cache in
+   diskio.c is the pool behind it.  So an idle open file costs only its
+   FIL, and RAM for file buffers follows I/O rather than open files. */
+
+/* Descriptor fd is files[fd - FD_OFFSET].  The table grows FILES_GROW_BY
+   entries at a time as files are opened, and each OpenFile is allocated
+   the first time its slot is used and kept for reuse.  FatFs's FF_FS_LOCK
+   counts open directories as well as files, so MAX_FILES leaves room for
+   the ones that can be open at once: a launcher listing, a dir_cursor.c
+   cursor, and dir_index.c's check and fingerprint. */
+enum { FD_OFFSET = 3, FILES_GROW_BY = 4, OPEN_DIRECTORIES = 4, FILE_STATS_NAME_LENGTH = 24 };
+
+#if FF_FS_LOCK
+#define MAX_FILES (FF_FS_LOCK - OPEN_DIRECTORIES)
+#else
+#define MAX_FILES 32
+#endif
+
+typedef struct OpenFile {
+    FIL fil;
+    int opened;
+#if FF_USE_FASTSEEK
+    DWORD *linkMap;
+#endif /* FF_USE_FASTSEEK */
+    /* Statistics since the file was opened, for print_open_file_stats */
+    char name[FILE_STATS_NAME_LENGTH];
+    unsigned long reads, writes, seeks;
+    unsigned long long bytesRead, bytesWritten;
+} OpenFile;
+
+static OpenFile **files;
+static int filesAllocated;
+auto_init_mutex(filesLock);     /* either core may open files */
+
+/* The open file for a descriptor, or NULL with errno set. */
+static OpenFile *lookupFile(int file)
+{
+    OpenFile *openFile = NULL;
+    int myFile = file - FD_OFFSET;
+
+    mutex_enter_blocking(&filesLock);
+    if((myFile >= 0) && (myFile < filesAllocated) && files[myFile] && files[myFile]->opened) {
+        openFile = files[myFile];
+    }
+    mutex_exit(&filesLock);
+    if(openFile == NULL) {
+        errno = EBADF;
+    }
+    return openFile;
+}
+
+/* Claim a free slot, growing the table if need be.  Returns the slot's
+   file and sets *which to its index, or returns NULL with errno set. */
+static OpenFile *claimFile(int *which)
+{
+    OpenFile *openFile;
+    int i;
+
+    mutex_enter_blocking(&filesLock);
+    for(i = 0; i < filesAllocated; i++) {
+        if(!files[i] || !files[i]->opened) {
+            break;
+        }
+    }
+    if(i == filesAllocated) {
+        OpenFile **grown = NULL;
+        if(filesAllocated + FILES_GROW_BY <= MAX_FILES) {
+            grown = realloc(files, (filesAllocated + FILES_GROW_BY) * sizeof(OpenFile *));
+        }
+        if(grown == NULL) {
+            mutex_exit(&filesLock);
+            errno = ENFILE;
+            return NULL;
+        }
+        memset(grown + filesAllocated, 0, FILES_GROW_BY * sizeof(OpenFile *));
+        files = grown;
+        filesAllocated += FILES_GROW_BY;
+    }
+    if(!files[i]) {
+        files[i] = malloc(sizeof(OpenFile));
+        if(!files[i]) {
+            mutex_exit(&filesLock);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    openFile = files[i];
+    memset(openFile, 0, sizeof(OpenFile));
+    openFile->opened = 1;       /* claimed; released again if f_open fails */
+    mutex_exit(&filesLock);
+    *which = i;
+    return openFile;
+}
+
+static void releaseFile(OpenFile *openFile)
+{
+    mutex_enter_blocking(&filesLock);
+    openFile->opened = 0;
+    mutex_exit(&filesLock);
+}
+
+#if FF_USE_FASTSEEK
+
+/* Cluster link map for each open file that won't grow, so f_lseek finds
+   the cluster for an offset without walking the FAT chain from the start
+   of the file.  A map takes two DWORDs per fragment plus two; files with
+   more than FASTSEEK_MAX_FRAGMENTS fragments seek the slow way. */
+enum { FASTSEEK_MAX_FRAGMENTS = 64 };
+
+static void startFastSeek(OpenFile *openFile)
+{
+    FIL *fp = &openFile->fil;
+    DWORD probe[4];     /* room for one fragment */
+
+    probe[0] = sizeof(probe) / sizeof(probe[0]);
+    fp->cltbl = probe;
+    FRESULT result = f_lseek(fp, CREATE_LINKMAP);
+    DWORD needed = probe[0];
+    fp->cltbl = NULL;
+    if(((result != FR_OK) && (result != FR_NOT_ENOUGH_CORE)) || (needed > 2 + 2 * FASTSEEK_MAX_FRAGMENTS)) {
+        return;
+    }
+
+    DWORD *map = malloc(needed * sizeof(DWORD));
+    if(map == NULL) {
+        return;
+    }
+    if(result == FR_OK) {
+        memcpy(map, probe, needed * sizeof(DWORD));
+    } else {
+        map[0] = needed;
+        fp->cltbl = map;
+        if(f_lseek(fp, CREATE_LINKMAP) != FR_OK) {
+            fp->cltbl = NULL;
+            free(map);
+            return;
+        }
+    }
+    fp->cltbl = map;
+    openFile->linkMap = map;
+}
+
+/* FatFs can't extend a file in fast seek mode. */
+static void stopFastSeek(OpenFile *openFile)
+{
+    openFile->fil.cltbl = NULL;
+    free(openFile->linkMap);
+    openFile->linkMap = NULL;
+}
+
+#endif /* FF_USE_FASTSEEK */
+
+/* Control-T on the serial console prints these with the storage stats. */
+void print_open_file_stats(void)
+{
+    mutex_enter_blocking(&filesLock);
+    for(int i = 0; i < filesAllocated; i++) {
+        const OpenFile *openFile = files[i];
+        if(openFile && openFile->opened) {
+            printf("fd %d %s: %lu reads (%llu bytes), %lu writes (%llu bytes), %lu seeks, at %lu of %lu\n",
+                i + FD_OFFSET, openFile->name, openFile->reads, openFile->bytesRead,
+                openFile->writes, openFile->bytesWritten, openFile->seeks,
+                (unsigned long)f_tell(&openFile->fil), (unsigned long)f_size(&openFile->fil));
+        }
+    }
+    mutex_exit(&filesLock);
+}
 
 #endif /* USE_FATFS */
 
@@ -65,20 +231,26 @@ int _write(int file, char *ptr, int len)
 		}
 	return len;
     } else {
-        int myFile = file - FD_OFFSET;
-        if(!filesOpened[myFile]) {
+#ifdef USE_FATFS
+        OpenFile *openFile = lookupFile(file);
+        if(!openFile) {
             printf("XXX write: file not opened\n");
-            errno = EBADF;
             return -1;
         }
-#ifdef USE_FATFS
+#if FF_USE_FASTSEEK
+        if(openFile->linkMap && (f_tell(&openFile->fil) + len > f_size(&openFile->fil))) {
+            stopFastSeek(openFile);
+        }
+#endif /* FF_USE_FASTSEEK */
         unsigned int wrote;
-        FRESULT result = f_write(&files[myFile], ptr, len, &wrote);
+        FRESULT result = f_write(&openFile->fil, ptr, len, &wrote);
         if(result != FR_OK) {
             printf("XXX write: file result %d\n", result);
             errno = EIO;
             return -1;
         }
+        openFile->writes++;
+        openFile->bytesWritten += wrote;
         return wrote;
 #else /* not USE_FATFS */
         errno = EIO;
@@ -89,16 +261,26 @@ int _write(int file, char *ptr, int len)
 
 int _close(int file)
 {
-    int myFile = file - FD_OFFSET;
-    if(!filesOpened[myFile]) {
-        errno = EBADF;
+#ifdef USE_FATFS
+    OpenFile *openFile = lookupFile(file);
+    if(!openFile) {
+        return -1;
+    }
+    FRESULT result = f_close(&openFile->fil);
+#if FF_USE_FASTSEEK
+    stopFastSeek(openFile);
+#endif /* FF_USE_FASTSEEK */
+    releaseFile(openFile);
+    if(result != FR_OK) {
+        printf("XXX close: result not OK %d\n", result);
+        errno = EIO;
         return -1;
     }
-#ifdef USE_FATFS
-    f_close(&files[myFile]);
-#endif /* USE_FATFS */
-    filesOpened[myFile] = 0;
     return 0;
+#else /* not USE_FATFS */
+    errno = EBADF;
+    return -1;
+#endif /* USE_FATFS */
 }
 
 int _fstat(int file, struct stat *st)
@@ -120,29 +302,45 @@ int _lseek(int file, int ptr, int dir)
 	return 0;
     } else {
 
-        int myFile = file - FD_OFFSET;
-        if(!filesOpened[myFile]) {
-            printf("XXX lseek: file not opened %d\n", myFile);
-            errno = EBADF;
+#ifdef USE_FATFS
+
+        OpenFile *openFile = lookupFile(file);
+        if(!openFile) {
+            printf("XXX lseek: file not opened %d\n", file);
             return -1;
         }
 
-#ifdef USE_FATFS
-
-        FRESULT result;
+        /* Signed, so a seek before the start of the file can be refused
+           rather than wrapping around to somewhere near 4GB. */
+        long long offset;
         if(dir == SEEK_SET) {
-            result = f_lseek(&files[myFile], ptr);
+            offset = ptr;
         } else if(dir == SEEK_CUR) {
-            result = f_lseek(&files[myFile], ptr + f_tell(&files[myFile]));
-        } else /* SEEK_END */ {
-            result = f_lseek(&files[myFile], f_size(&files[myFile]) - 1 - ptr);
+            offset = (long long)f_tell(&openFile->fil) + ptr;
+        } else if(dir == SEEK_END) {
+            offset = (long long)f_size(&openFile->fil) + ptr;
+        } else {
+            errno = EINVAL;
+            return -1;
         }
+        if(offset < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+#if FF_USE_FASTSEEK
+        /* Fast seek stops at the end of the file. */
+        if(openFile->linkMap && (offset > f_size(&openFile->fil))) {
+            stopFastSeek(openFile);
+        }
+#endif /* FF_USE_FASTSEEK */
+        FRESULT result = f_lseek(&openFile->fil, offset);
         if(result != FR_OK) {
             printf("XXX lseek: result not OK %d\n", result);
             errno = EIO;
             return -1;
         }
-        return f_tell(&files[myFile]);
+        openFile->seeks++;
+        return f_tell(&openFile->fil);
 
 #else /* not USE_FATFS */
         errno = EIO;
@@ -164,20 +362,21 @@ int _read(int file, char *ptr, int len)
 	}
         return len;
     } else {
-        int myFile = file - FD_OFFSET;
-        if(!filesOpened[myFile]) {
-            printf("XXX read: file not opened %d\n", myFile);
-            errno = EBADF;
+#ifdef USE_FATFS
+        OpenFile *openFile = lookupFile(file);
+        if(!openFile) {
+            printf("XXX read: file not opened %d\n", file);
             return -1;
         }
         unsigned int wasRead;
-#ifdef USE_FATFS
-        FRESULT result = f_read(&files[myFile], ptr, len, &wasRead);
+        FRESULT result = f_read(&openFile->fil, ptr, len, &wasRead);
         if(result != FR_OK) {
             printf("XXX read: result not OK %d\n", result);
             errno = EIO;
             return -1;
         }
+        openFile->reads++;
+        openFile->bytesRead += wasRead;
         return wasRead;
 #else /* not USE_FATFS */
         errno = EIO;
@@ -193,16 +392,13 @@ int _open(char *path, int flags, ...)
         return -1;
     }
 
-    int which = 0;
-    while(which < MAX_FILES && filesOpened[which]) {
-        which++;
-    }
-    if(which >= MAX_FILES) {
-        errno = ENFILE;
+#ifdef USE_FATFS
+    int which;
+    OpenFile *openFile = claimFile(&which);
+    if(!openFile) {
         return -1;
     }
 
-#ifdef USE_FATFS
     int FatFSFlags = 0;
 
     if((flags & O_ACCMODE) == O_RDONLY) {
@@ -223,13 +419,32 @@ int _open(char *path, int flags, ...)
         FatFSFlags |= FA_CREATE_ALWAYS;
     }
     errno = 0;
-    FRESULT result = f_open (&files[which], path, FatFSFlags);
+    FRESULT result = f_open (&openFile->fil, path, FatFSFlags);
     if(result) {
         printf("XXX open couldn't open \"%s\" for reading, FatFS result %d\n", path, result);
-        errno = EIO;
+        releaseFile(openFile);
+        if((result == FR_NO_FILE) || (result == FR_NO_PATH)) {
+            errno = ENOENT;
+        } else if(result == FR_EXIST) {
+            errno = EEXIST;
+        } else if(result == FR_TOO_MANY_OPEN_FILES) {
+            errno = ENFILE;
+        } else {
+            errno = EIO;
+        }
         return -1;
     }
-    filesOpened[which] = 1;
+
+    const char *name = strrchr(path, '/');
+    strncpy(openFile->name, name ? name + 1 : path, sizeof(openFile->name) - 1);
+
+#if FF_USE_FASTSEEK
+    /* Disk images and ROMs are opened without O_CREAT, O_TRUNC, or
+       O_APPEND and then read (and written) in place at random offsets. */
+    if(!(flags & (O_CREAT | O_TRUNC | O_APPEND))) {
+        startFastSeek(openFile);
+    }
+#endif /* FF_USE_FASTSEEK */
 
     return which + FD_OFFSET;
 #else /* not USE_FATFS */